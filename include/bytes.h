@@ -3,8 +3,15 @@
 
 #include <stdint.h>
 
+// Set on hash table keys allocated with room for a KeyExpire after the
+// header, see hash_table.h
+#define BYTES_EXPIRE_ROOM 1
+
 typedef struct Bytes_ {
   uint32_t length;
+  // BYTES_* flags, only meaningful on hash table keys. They sit in what
+  // would otherwise be padding.
+  uint32_t flags;
   char *data;
 } Bytes;
 
@@ -6,6 +6,23 @@
 
 #ifndef CLIENT_H
 #define CLIENT_H
+
+// A client's pipeline stops running while this many reply bytes wait for
+// the socket, and its socket is no longer read
+#define CLIENT_OUTPUT_PAUSE (256 * 1024)
+
+typedef enum { CLIENT_CLASS_NORMAL = 0, CLIENT_CLASS_COUNT } client_class;
+
+// A client is dropped once its pending replies exceed `hard` bytes, or stay
+// above `soft` bytes for `soft_seconds`. 0 disables a limit.
+typedef struct ClientOutputLimit_ {
+  size_t hard;
+  size_t soft;
+  long long soft_seconds;
+} ClientOutputLimit;
+
+extern ClientOutputLimit client_output_limits[CLIENT_CLASS_COUNT];
+
 typedef struct Client_ {
   int fd;
 
@@ -13,16 +30,50 @@ typedef struct Client_ {
   size_t query_length;
   size_t query_cap;
 
+  // arg_values point at arg_views, which reference query_buffer in place.
+  // They are only valid until the command is done; anything kept must be
+  // copied.
   int arg_count;
   Bytes **arg_values;
+  Bytes *arg_views;
   size_t arg_values_cap;
   size_t query_pos;
 
+  // Set by an I/O thread: read status and the length of an already parsed
+  // command waiting in arg_values (0 if none)
+  int io_status;
+  size_t parsed_consumed;
+
+  // Waiting for the reply of a command forwarded to another shard
+  int blocked;
+
+  // Commands were left in the query buffer because too many replies were
+  // pending, they run once the socket takes them
+  int pipeline_paused;
+
+  // Events registered with epoll: EPOLLOUT while replies wait for the
+  // socket, no EPOLLIN while the client is paused on its replies
+  uint32_t poll_events;
+
+  // io_uring: a multishot receive is still armed on the socket
+  int recv_armed;
+
+  client_class class;
+  // When the pending replies went over the soft limit, 0 if they are not
+  long long soft_limit_since;
+
   OutputBuffer *output_buffer;
 } Client;
 
 Client *create_client(int fd);
+void free_client(Client *client);
 int read_from_client(Client *client);
+int client_append_query(Client *client, const char *data, size_t len);
 void reset_client_args(Client *client);
+void client_compact_query(Client *client);
+int client_output_paused(Client *client);
+int client_check_output_limits(Client *client, long long now);
+const char *client_class_name(client_class class);
+client_class client_class_by_name(const char *name);
 
 #endif // !CLIENT_H
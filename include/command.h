@@ -1,30 +1,54 @@
 #ifndef COMMAND_H
 #define COMMAND_H
 
+#include "expire.h"
 #include "hash_table.h"
 #include "networking.h"
 #include "parser.h"
+#include "timer.h"
 
 typedef struct CommandContext_ {
   Client *client;
   HashTable *db;
-  HashTable *expires;
   HashTable *vector_indices;
   OutputBuffer *ob;
+  ExpireIndex *expire_index;
 } CommandContext;
 
 typedef void (*commandProc)(CommandContext *ctx);
 
+// The command needs the whole keyspace, not only the shard it runs on
+#define CMD_GLOBAL (1 << 0)
+// Only reads the keyspace
+#define CMD_READ (1 << 1)
+// May modify the keyspace
+#define CMD_WRITE (1 << 2)
+// Server administration, not about particular keys
+#define CMD_ADMIN (1 << 3)
+
+// arity is the exact argument count including the name, or -N for at least
+// N. It is checked before proc runs.
+// first_key, last_key and key_step locate the key arguments (a negative
+// last_key counts from the end, first_key 0 means no keys)
 typedef struct Command_ {
   char *name;
   commandProc proc;
   int arity;
+  int first_key;
+  int last_key;
+  int key_step;
+  int flags;
 } Command;
 
 r_obj *create_command_object(Command *cmd);
 
-long long get_time_ms();
+extern Command CommandTable[];
+extern int command_count;
+
+int command_table_init(void);
 Command *command_lookup(char *name, int len);
+int command_check_arity(Command *cmd, int argc, OutputBuffer *ob);
+int command_last_key(Command *cmd, int argc);
 
 void set_command(CommandContext *ctx);
 void get_command(CommandContext *ctx);
@@ -64,5 +88,8 @@ void vidx_info_command(CommandContext *ctx);
 void vadd_command(CommandContext *ctx);
 void save_command(CommandContext *ctx);
 void ping_command(CommandContext *ctx);
+void info_command(CommandContext *ctx);
+void latency_command(CommandContext *ctx);
+void slowlog_command(CommandContext *ctx);
 
 #endif // !COMMAND_H
@@ -0,0 +1,38 @@
+#ifndef EXPIRE_H
+#define EXPIRE_H
+
+#include <stddef.h>
+
+#include "hash_table.h"
+
+// Keys sampled per round of active expiry, another round follows while more
+// than ACTIVE_EXPIRE_STALE_PERCENT of them had expired
+#define ACTIVE_EXPIRE_KEYS_PER_LOOP 20
+#define ACTIVE_EXPIRE_STALE_PERCENT 10
+// A cycle that ran out of budget with expired keys left is repeated after
+// this many milliseconds instead of at the next cron
+#define ACTIVE_EXPIRE_FAST_INTERVAL_MS 2
+
+typedef struct ExpireEntry_ {
+  long long when;
+  Bytes *key;
+} ExpireEntry;
+
+// Optional min-heap of deadlines (--active-expire-index). Entries are never
+// removed when a key is deleted or its TTL changes, they are checked against
+// the deadline in the key when they come up and dropped if it no longer
+// matches.
+typedef struct ExpireIndex_ {
+  ExpireEntry *heap;
+  size_t count;
+  size_t cap;
+} ExpireIndex;
+
+extern int expire_index_enabled;
+
+void expire_index_add(ExpireIndex *index, Bytes *key, long long when);
+void expire_index_rebuild(ExpireIndex *index, HashTable *db);
+
+int active_expire_cycle(HashTable *db, ExpireIndex *index, long long budget_us);
+
+#endif // !EXPIRE_H
@@ -0,0 +1,35 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include "hash_table.h"
+#include "listpack.h"
+
+// Hashes start out as a listpack of field, value, field, value, ... and
+// become a HashTable for good once they have more than
+// hash_max_listpack_entries fields or a field or value longer than
+// hash_max_listpack_value bytes (--hash-max-listpack-entries and
+// --hash-max-listpack-value)
+#define HASH_MAX_LISTPACK_ENTRIES 128
+#define HASH_MAX_LISTPACK_VALUE 64
+
+extern int hash_max_listpack_entries;
+extern int hash_max_listpack_value;
+
+typedef struct HashObjectIterator_ {
+  r_obj *o;
+  HashTableIterator it;
+  unsigned char *p;
+} HashObjectIterator;
+
+r_obj *create_hash_listpack_object(void);
+
+void hash_object_set(r_obj *o, Bytes *field, const char *value, uint32_t len);
+int hash_object_get(r_obj *o, Bytes *field, Bytes *value, r_obj **ref);
+size_t hash_object_size(r_obj *o);
+void hash_object_check_limits(r_obj *o);
+
+void hash_object_iterator_init(r_obj *o, HashObjectIterator *it);
+int hash_object_next(HashObjectIterator *it, Bytes *field, Bytes *value);
+void hash_object_iterator_release(HashObjectIterator *it);
+
+#endif // !HASH_H
@@ -3,27 +3,125 @@
 
 #include "bytes.h"
 #include <stddef.h>
+#include <stdint.h>
 
 struct RObj;
 typedef struct RObj r_obj;
 
+// Deadline of a key, kept in the key's own allocation between the Bytes
+// header and the data when the key has BYTES_EXPIRE_ROOM. The room stays
+// once allocated, `when` is -1 while the key has no deadline.
+typedef struct KeyExpire_ {
+  // Wall clock milliseconds
+  long long when;
+  // Position in the table's expiring array
+  size_t slot;
+} KeyExpire;
+
+#define key_expire(k) ((KeyExpire *)((k) + 1))
+
+#ifdef HASH_TABLE_OPEN_ADDRESSING
+
+// Open addressing engine: one control byte per slot (empty, deleted, or the
+// low 7 bits of the hash) scanned 16 at a time. Keys are stored in a single
+// allocation with their data.
+typedef struct Node_ {
+  Bytes *key;
+  r_obj *value;
+} Node;
+
+typedef struct HashTable_ {
+  uint8_t *ctrl;
+  Node *slots;
+  size_t size;
+  size_t count;
+  size_t used;
+
+  uint8_t *rehash_ctrl;
+  Node *rehash_slots;
+  size_t rehash_size;
+  size_t rehash_used;
+  long rehash_index;
+
+  int paused;
+
+  Bytes **expiring;
+  size_t expiring_count;
+  size_t expiring_cap;
+} HashTable;
+
+#else
+
 typedef struct Node_ {
   Bytes *key;
   r_obj *value;
   struct Node_ *next;
 } Node;
 
+// While rehashing, entries live in both `buckets` (old) and `rehash_buckets`
+// (new). Buckets below `rehash_index` have already been migrated.
 typedef struct HashTable_ {
   Node **buckets;
   size_t size;
   size_t count;
+
+  Node **rehash_buckets;
+  size_t rehash_size;
+  long rehash_index;
+
+  int paused;
+
+  // Keys with a deadline, in no particular order. Active expiry samples
+  // from here and each key knows its slot, so removal is O(1).
+  Bytes **expiring;
+  size_t expiring_count;
+  size_t expiring_cap;
 } HashTable;
 
+#endif
+
+typedef struct HashTableIterator_ {
+  HashTable *hash_table;
+  int table;
+  size_t index;
+  Node *entry;
+  Node *next_entry;
+} HashTableIterator;
+
+#define hash_table_is_rehashing(ht) ((ht)->rehash_index != -1)
+
+// Deadline of a table key, -1 if it has none
+static inline long long hash_key_expire(const Bytes *key) {
+  return (key->flags & BYTES_EXPIRE_ROOM) ? key_expire(key)->when : -1;
+}
+
+void hash_seed_init(void);
+uint64_t hash(const Bytes *key);
+
 r_obj *create_hash_object();
 HashTable *hash_table_create(size_t size);
-void hash_table_set(HashTable *hash_table, Bytes *key, r_obj *val);
+// Returns -1 when nothing was stored, val then still belongs to the caller
+int hash_table_set(HashTable *hash_table, Bytes *key, r_obj *val);
 r_obj *hash_table_get(HashTable *hash_table, Bytes *key);
+Node *hash_table_find_entry(HashTable *hash_table, Bytes *key);
 int hash_table_del(HashTable *hash_table, Bytes *key);
+// Removes key and returns its value without freeing it (NULL if absent)
+r_obj *hash_table_take(HashTable *hash_table, Bytes *key);
 void hash_table_destroy(HashTable *hash_table);
 
+int hash_table_rehash(HashTable *hash_table, int n);
+int hash_table_rehash_us(HashTable *hash_table, long long us);
+
+void hash_table_iterator_init(HashTable *hash_table, HashTableIterator *it);
+Node *hash_table_next(HashTableIterator *it);
+void hash_table_iterator_release(HashTableIterator *it);
+
+Node *hash_table_random_entry(HashTable *hash_table);
+
+// Engine independent key storage, see hash_table.c
+Bytes *hash_key_dup(const Bytes *src, int room);
+void hash_key_free(HashTable *hash_table, Bytes *key);
+int hash_table_set_expire(HashTable *hash_table, Bytes *key, long long when);
+Bytes *hash_table_random_expiring(HashTable *hash_table);
+
 #endif // !HASH_TABLE_H
@@ -0,0 +1,33 @@
+#ifndef INTSET_H
+#define INTSET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Element widths, every element of an intset is stored with the same one
+#define INTSET_ENC_INT16 ((uint32_t)sizeof(int16_t))
+#define INTSET_ENC_INT32 ((uint32_t)sizeof(int32_t))
+#define INTSET_ENC_INT64 ((uint32_t)sizeof(int64_t))
+
+// Sorted array of distinct integers in a single allocation. The width is
+// the smallest one that fits every element and only ever grows, adding a
+// value that doesn't fit rewrites the array with the wider encoding.
+typedef struct IntSet_ {
+  uint32_t encoding;
+  uint32_t length;
+  int8_t contents[];
+} IntSet;
+
+#define intset_len(is) ((is)->length)
+#define intset_blob_len(is)                                                    \
+  (sizeof(IntSet) + (size_t)(is)->length * (is)->encoding)
+
+IntSet *intset_new(void);
+IntSet *intset_add(IntSet *is, int64_t value, int *added);
+IntSet *intset_remove(IntSet *is, int64_t value, int *removed);
+int intset_find(const IntSet *is, int64_t value);
+int64_t intset_get(const IntSet *is, uint32_t pos);
+uint32_t intset_seek(const IntSet *is, uint32_t pos, int64_t value);
+int intset_valid(const IntSet *is, size_t len);
+
+#endif // !INTSET_H
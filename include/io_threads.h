@@ -0,0 +1,14 @@
+#ifndef IO_THREADS_H
+#define IO_THREADS_H
+
+#include "client.h"
+
+#define IO_THREADS_MAX 64
+
+typedef enum { IO_OP_READ, IO_OP_WRITE } io_op;
+
+int io_threads_init(int count);
+int io_threads_count(void);
+void io_threads_run(Client **clients, int count, io_op op);
+
+#endif // !IO_THREADS_H
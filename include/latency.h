@@ -0,0 +1,75 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+// Log-linear histogram of durations measured in cycles of latency_now().
+// Every power of two is split into 2^LATENCY_SUB_BITS buckets, so a bucket
+// is never more than ~6% wide. Durations above 2^LATENCY_MAX_BITS cycles
+// land in the last bucket.
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_COUNT (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 42
+#define LATENCY_BUCKETS                                                        \
+  ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 2) * LATENCY_SUB_COUNT)
+
+// Only the shard owning a histogram records into it, other threads may read
+// it at any time: every field is accessed with relaxed atomics
+typedef struct LatencyHistogram_ {
+  uint64_t calls;
+  uint64_t total;
+  uint64_t buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+// Commands are only timed while this is set (--latency-tracking)
+extern int latency_tracking;
+
+void latency_init(void);
+
+static inline uint64_t latency_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline int latency_bucket(uint64_t cycles) {
+  if (cycles < LATENCY_SUB_COUNT)
+    return (int)cycles;
+
+  int exp = 63 - __builtin_clzll(cycles);
+  if (exp > LATENCY_MAX_BITS)
+    return LATENCY_BUCKETS - 1;
+
+  int sub = (int)(cycles >> (exp - LATENCY_SUB_BITS)) & (LATENCY_SUB_COUNT - 1);
+  return (exp - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT + sub;
+}
+
+static inline void latency_add(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+}
+
+// Single writer, no locked instructions on the command path
+static inline void latency_record(LatencyHistogram *h, uint64_t cycles) {
+  latency_add(&h->calls, 1);
+  latency_add(&h->total, cycles);
+  latency_add(&h->buckets[latency_bucket(cycles)], 1);
+}
+
+void latency_merge(LatencyHistogram *dst, const LatencyHistogram *src);
+double latency_usec(uint64_t cycles);
+uint64_t latency_cycles(double usec);
+double latency_bucket_usec(int bucket);
+double latency_percentile(const LatencyHistogram *h, double percentile);
+
+#endif // !LATENCY_H
@@ -1,6 +1,8 @@
 #ifndef LIST_H
 #define LIST_H
 
+#include "bytes.h"
+#include "listpack.h"
 #include <stddef.h>
 
 struct RObj;
@@ -12,29 +14,68 @@ typedef struct RObj r_obj;
 #define LMOVE_DEST_LEFT 1 << 2
 #define LMOVE_DEST_RIGHT 1 << 3
 
-typedef struct ListNode_ {
-  r_obj *value;
-  struct ListNode_ *next;
-  struct ListNode_ *prev;
-} ListNode;
+// Elements are packed into listpack chunks of up to LIST_CHUNK_BYTES, an
+// element too large for that gets a chunk of its own
+#define LIST_CHUNK_BYTES 8192
 
+// Chunks further than this from both ends are kept LZF compressed, 0 turns
+// compression off
+#define LIST_COMPRESS_DEPTH 0
+// Smaller chunks aren't worth compressing
+#define LIST_COMPRESS_MIN_BYTES 48
+
+extern int list_compress_depth;
+
+// A chunk's listpack in compressed form
+typedef struct ListChunkLzf_ {
+  // Size of the listpack once decompressed
+  uint32_t raw;
+  uint32_t bytes;
+  unsigned char data[];
+} ListChunkLzf;
+
+// Exactly one of lp and lzf is set. The count is kept on the chunk so
+// compressed chunks can be skipped without decompressing them.
+typedef struct ListChunk_ {
+  struct ListChunk_ *prev;
+  struct ListChunk_ *next;
+  Listpack *lp;
+  ListChunkLzf *lzf;
+  uint32_t count;
+} ListChunk;
+
+// Doubly linked list of chunks. Positions are found by skipping whole
+// chunks by their counts from the closer end, then walking one listpack.
 typedef struct List_ {
   size_t size;
+  size_t chunks;
 
-  ListNode *tail;
-  ListNode *head;
+  ListChunk *tail;
+  ListChunk *head;
+
+  // Interior chunk decompressed for a read, compressed again when another
+  // one is needed
+  ListChunk *open;
 } List;
 
+typedef struct ListIterator_ {
+  List *list;
+  ListChunk *chunk;
+  unsigned char *p;
+} ListIterator;
+
 r_obj *create_list_object(void);
 
 List *list_create(void);
-int list_ins_node_head(List *list, r_obj *value);
-int list_ins_node_tail(List *list, r_obj *value);
-r_obj *list_pop_tail(List *list);
-r_obj *list_pop_head(List *list);
-ListNode *list_get_node_at(List *list, size_t index, int from_tail);
+int list_push_head(List *list, const char *data, uint32_t len);
+int list_push_tail(List *list, const char *data, uint32_t len);
+int list_index(List *list, long index, Bytes *out);
+void list_trim(List *list, size_t head, size_t tail);
 void list_destroy(List *list);
 
+void list_iterator_init(List *list, size_t index, ListIterator *it);
+int list_next(ListIterator *it, Bytes *out);
+
 #define list_size(list) ((list)->size)
 
 #endif // !LIST_H
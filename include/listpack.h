@@ -0,0 +1,54 @@
+#ifndef LISTPACK_H
+#define LISTPACK_H
+
+#include "bytes.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Length prefixed strings packed back to back in a single allocation. Each
+// entry is
+//
+//   <len> <data> <backlen>
+//
+// where <len> takes 1, 2 or 5 bytes depending on the length and <backlen>
+// is the size of <len> plus <data> written 7 bits per byte, so entries can
+// be walked in both directions. Every operation is a scan or a memmove, the
+// encoding is meant for small collections only.
+typedef struct Listpack_ {
+  // Bytes of entries, the header not included
+  uint32_t bytes;
+  uint32_t count;
+  unsigned char entries[];
+} Listpack;
+
+#define listpack_count(lp) ((lp)->count)
+// Size of the whole allocation, which is also its serialized form
+#define listpack_blob_len(lp) (sizeof(Listpack) + (size_t)(lp)->bytes)
+
+Listpack *listpack_new(void);
+size_t listpack_entry_size(uint32_t len);
+
+unsigned char *listpack_first(Listpack *lp);
+unsigned char *listpack_last(Listpack *lp);
+unsigned char *listpack_next(Listpack *lp, unsigned char *p);
+unsigned char *listpack_prev(Listpack *lp, unsigned char *p);
+unsigned char *listpack_seek(Listpack *lp, long index);
+void listpack_get(unsigned char *p, Bytes *out);
+unsigned char *listpack_find(Listpack *lp, unsigned char *p, const char *data,
+                             uint32_t len, int skip);
+
+// Functions that change the listpack may move it and return the new
+// address, or NULL when out of memory with the listpack left as it was.
+// `data` must not point into the listpack itself.
+Listpack *listpack_insert(Listpack *lp, unsigned char **p, const char *data,
+                          uint32_t len);
+Listpack *listpack_append(Listpack *lp, const char *data, uint32_t len);
+Listpack *listpack_prepend(Listpack *lp, const char *data, uint32_t len);
+Listpack *listpack_replace(Listpack *lp, unsigned char **p, const char *data,
+                           uint32_t len);
+Listpack *listpack_delete(Listpack *lp, unsigned char **p);
+Listpack *listpack_delete_range(Listpack *lp, unsigned char *p, uint32_t n);
+
+int listpack_valid(Listpack *lp, size_t len);
+
+#endif // !LISTPACK_H
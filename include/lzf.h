@@ -0,0 +1,17 @@
+#ifndef LZF_H
+#define LZF_H
+
+#include <stddef.h>
+
+// Byte oriented LZ77 in the LZF format: a control byte either starts a run
+// of 1 to 32 literals, or is a back reference of 3 to 264 bytes within the
+// previous 8 KiB. No entropy coding, it trades ratio for speed.
+//
+// Both return the number of bytes written to out, or 0 if the result
+// doesn't fit in out_len. Decompressing corrupt input also returns 0.
+size_t lzf_compress(const unsigned char *in, size_t in_len, unsigned char *out,
+                    size_t out_len);
+size_t lzf_decompress(const unsigned char *in, size_t in_len,
+                      unsigned char *out, size_t out_len);
+
+#endif // !LZF_H
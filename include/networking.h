@@ -1,17 +1,59 @@
 #include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #ifndef NETWORKING_H
 #define NETWORKING_H
 
-typedef struct OutputBuffer_ {
-  char *data;
+// Replies are queued as a list of chunks. A chunk either holds copied bytes
+// or references a value of the database, which is then written straight
+// from the value with sendmsg instead of being copied.
+#define OB_CHUNK_SIZE (16 * 1024)
+// The chunk after a reference usually only takes "\r\n" and the next header
+#define OB_CHUNK_SIZE_SMALL 256
+// Shorter values are cheaper to copy than to reference
+#define OB_REF_MIN_LEN 1024
+#define OB_IOV_MAX 64
+
+struct RObj;
+
+typedef struct ReplyChunk_ {
+  struct ReplyChunk_ *next;
+
+  // Referenced value, NULL when the bytes live in buf
+  struct RObj *ref;
+  const char *data;
   size_t length;
+  size_t sent;
   size_t capacity;
+  char buf[];
+} ReplyChunk;
+
+typedef struct OutputBuffer_ {
+  ReplyChunk *head;
+  ReplyChunk *tail;
+  // Bytes queued and not written yet
+  size_t length;
   int fd;
+
+  // A drained chunk kept for the next reply
+  ReplyChunk *spare;
+
+  // Set while an asynchronous send (io_uring) covers the first chunks,
+  // replies keep being appended behind them until it completes
+  int inflight;
+  struct iovec *iov;
+  struct msghdr msg;
 } OutputBuffer;
 
 OutputBuffer *create_output_buffer(int fd);
+void free_output_buffer(OutputBuffer *ob);
+void output_buffer_reset(OutputBuffer *ob);
 void append_to_output_buffer(OutputBuffer *ob, const char *data, size_t len);
+void append_ref_to_output_buffer(OutputBuffer *ob, struct RObj *o,
+                                 const char *data, size_t len);
+void output_buffer_splice(OutputBuffer *dst, OutputBuffer *src);
 void flush_buffer(OutputBuffer *ob);
-
+int output_buffer_begin_send(OutputBuffer *ob);
+void output_buffer_sent(OutputBuffer *ob, size_t written);
 
 #endif // !NETWORKING_H
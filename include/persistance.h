@@ -3,7 +3,8 @@
 
 #include "hash_table.h"
 
-void rdb_save(HashTable *db, HashTable *expires, char *filename);
-void rdb_load(HashTable *db, HashTable *expires, char *filename);
+void rdb_save(HashTable *db, char *filename);
+void rdb_save_all(HashTable **dbs, int count, char *filename);
+void rdb_load(HashTable *db, char *filename);
 
 #endif // !PERSISTANCE_H
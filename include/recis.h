@@ -2,6 +2,7 @@
 #define RECIS_H
 
 #include "parser.h"
+#include <limits.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -29,14 +30,56 @@ typedef enum {
   HNSW = 9,
 } obj_type;
 
+// How a STRING, SET, HASH or ZSET keeps its value, every other type is
+// OBJ_ENCODING_RAW
+typedef enum {
+  // data points to a Bytes allocated on its own
+  OBJ_ENCODING_RAW = 0,
+  // The Bytes and its data follow the object in the same allocation
+  OBJ_ENCODING_EMBSTR = 1,
+  // data is the integer itself. Only top level values are encoded this way,
+  // see create_string_value_object.
+  OBJ_ENCODING_INT = 2,
+  // A SET whose members are all integers, data is an IntSet
+  OBJ_ENCODING_INTSET = 3,
+  // A small HASH, data is a Listpack of fields and values
+  OBJ_ENCODING_LISTPACK = 4,
+  // A small ZSET, data is a ZPack of members sorted by score
+  OBJ_ENCODING_ZPACK = 5,
+} obj_encoding;
+
+// Strings up to this long are embedded, 64 bytes with the headers
+#define OBJ_EMBSTR_MAX 31
+// Enough for any int64 in decimal
+#define OBJ_INT_BUF 24
+
+// Objects with this refcount are shared and immutable. They are never
+// counted nor freed, so every shard can hand them out without touching
+// the cache line.
+#define OBJ_SHARED_REFCOUNT INT_MAX
+// Integer values 0 .. OBJ_SHARED_INTEGERS - 1 all point to the same objects
+#define OBJ_SHARED_INTEGERS 10000
+
+// refcount is shared between threads: a reply can still reference a value
+// after the shard that owns it has deleted it
 typedef struct RObj {
-  obj_type type;
+  uint16_t type;
+  uint16_t encoding;
+  int refcount;
   void *data;
 } r_obj;
 
+#define string_object_int(o) ((long long)(intptr_t)(o)->data)
+
+void shared_objects_init(void);
 r_obj *create_string_object(const char *str, uint32_t length);
+r_obj *create_string_value_object(const char *str, uint32_t length);
+int string_is_int64(const char *str, uint32_t length, long long *out);
+r_obj *create_int_string_object(long long value);
+Bytes *string_object_bytes(r_obj *o, Bytes *tmp, char *buf);
 r_obj *create_int_object(long long value);
 r_obj *create_double_object(double value);
+void incr_ref_count(r_obj *o);
 void free_object(r_obj *o);
 
 #endif // !RECIS_H
@@ -1,13 +1,81 @@
 #ifndef SET_H
 #define SET_H
 
-#include "hash_table.h"
+#include "bytes.h"
+#include "intset.h"
+#include "recis.h"
+#include <stddef.h>
 
-typedef HashTable Set;
+// Sets of integers start out as an IntSet and become a hash set once they
+// get a member that isn't an integer or more than this many members
+#define SET_MAX_INTSET_ENTRIES 512
+
+struct RObj;
+typedef struct RObj r_obj;
+
+// A set stores members only. Each entry is a single allocation holding the
+// chain link, the member's Bytes header and its data, there is no value slot.
+typedef struct SetEntry_ {
+  struct SetEntry_ *next;
+  Bytes member;
+} SetEntry;
+
+// Chained like the chained HashTable engine, with the same incremental
+// rehash: while rehashing, members live in both `buckets` (old) and
+// `rehash_buckets` (new), buckets below `rehash_index` have been migrated.
+typedef struct Set_ {
+  SetEntry **buckets;
+  size_t size;
+  size_t count;
+
+  SetEntry **rehash_buckets;
+  size_t rehash_size;
+  long rehash_index;
+
+  int paused;
+} Set;
+
+typedef struct SetIterator_ {
+  Set *set;
+  int table;
+  size_t index;
+  SetEntry *entry;
+  SetEntry *next_entry;
+} SetIterator;
+
+// Walks a set object in either encoding. Integers are printed into buf, the
+// returned Bytes is only valid until the next call.
+typedef struct SetObjectIterator_ {
+  r_obj *o;
+  SetIterator it;
+  uint32_t pos;
+  Bytes tmp;
+  char buf[OBJ_INT_BUF];
+} SetObjectIterator;
+
+#define set_size(set) ((set)->count)
 
 r_obj *create_set_object();
+r_obj *create_intset_object();
+r_obj *create_set_object_for(Bytes *member);
+
+int set_object_add(r_obj *o, Bytes *member);
+int set_object_rem(r_obj *o, Bytes *member);
+int set_object_is_member(r_obj *o, Bytes *member);
+size_t set_object_size(r_obj *o);
+
+void set_object_iterator_init(r_obj *o, SetObjectIterator *it);
+Bytes *set_object_next(SetObjectIterator *it);
+void set_object_iterator_release(SetObjectIterator *it);
+
+Set *set_create(size_t size);
+void set_destroy(Set *set);
 int set_add(Set *set, Bytes *member);
 int set_rem(Set *set, Bytes *member);
 int set_is_member(Set *set, Bytes *member);
 
+void set_iterator_init(Set *set, SetIterator *it);
+Bytes *set_next(SetIterator *it);
+void set_iterator_release(SetIterator *it);
+
 #endif // !SET_H
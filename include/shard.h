@@ -0,0 +1,103 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "client.h"
+#include "command.h"
+#include "hash_table.h"
+#include "latency.h"
+#include "slowlog.h"
+#include "timer.h"
+
+#define SHARDS_MAX 64
+#define SHARD_QUEUE_SIZE 4096
+// Per second rates are averaged over this many cron samples
+#define SHARD_STATS_SAMPLES 16
+
+// shard_route result for commands whose keys live on more than one shard
+#define SHARD_ALL -1
+
+// Lock-free single producer, single consumer ring of messages
+typedef struct ShardQueue_ {
+  _Atomic size_t head;
+  char pad[64 - sizeof(size_t)];
+  _Atomic size_t tail;
+  void *items[SHARD_QUEUE_SIZE];
+} ShardQueue;
+
+// One event loop and the slice of the keyspace it owns
+typedef struct Shard_ {
+  int id;
+  int epfd;
+  int server_fd;
+  int event_fd;
+
+  // Deadlines are kept in the keys, see KeyExpire
+  HashTable *db;
+  HashTable *vector_indices;
+  ExpireIndex expire_index;
+
+  // inbox[j] carries messages sent by shard j
+  ShardQueue *inbox[SHARDS_MAX];
+  uint64_t wake_mask;
+
+  // Clients whose forwarded command got its reply and can run again
+  Client **resumed;
+  size_t resumed_count;
+  size_t resumed_cap;
+
+  // Clients over their soft output limit, checked on every iteration until
+  // they catch up or get dropped
+  Client **soft_limited;
+  size_t soft_limited_count;
+  size_t soft_limited_cap;
+
+  // Disconnected clients, freed at the end of a loop iteration once no
+  // forwarded command or asynchronous operation refers to them
+  Client **closed;
+  size_t closed_count;
+  size_t closed_cap;
+
+  // Latency of the commands run here, indexed like CommandTable
+  LatencyHistogram *command_latency;
+  Slowlog slowlog;
+
+  // Commands run here, read by INFO from other shards
+  uint64_t stat_commands;
+  uint64_t stat_ops_per_sec;
+  // Keys and deadlines in db, the owner publishes them for INFO
+  uint64_t stat_keys;
+  uint64_t stat_expires;
+  uint64_t ops_samples[SHARD_STATS_SAMPLES];
+  int ops_sample_index;
+  uint64_t ops_last_commands;
+  long long ops_last_ms;
+
+  // Deadlines of the event loop, the cron is one of them
+  TimerWheel timers;
+  Timer cron;
+  Timer expire_fast;
+} Shard;
+
+extern Shard *shards;
+extern int shard_count;
+
+int shards_init(int count);
+void shards_distribute(void);
+
+int shard_for_key(Bytes *key);
+int shard_route(Shard *self, Command *cmd, Client *c);
+
+void shard_enter(Shard *self);
+void shard_leave(Shard *self);
+
+void shard_call(Shard *self, Command *cmd, CommandContext *ctx);
+void shard_sample_stats(Shard *self, long long now_ms);
+void shard_forward(Shard *self, int target, Command *cmd, Client *c);
+void shard_run_exclusive(Shard *self, Command *cmd, Client *c);
+void shard_drain(Shard *self);
+void shard_wake_peers(Shard *self);
+
+#endif // !SHARD_H
@@ -0,0 +1,46 @@
+#ifndef SLOWLOG_H
+#define SLOWLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "client.h"
+
+// Only the head of long commands is kept
+#define SLOWLOG_ENTRY_MAX_ARGC 32
+#define SLOWLOG_ENTRY_MAX_STRING 128
+
+typedef struct SlowlogEntry_ {
+  long long id;
+  // Unix time in seconds when the command ended
+  long long time;
+  long long duration_usec;
+
+  int argc;
+  Bytes **argv;
+
+  int fd;
+  char addr[64];
+} SlowlogEntry;
+
+// Ring of the last slowlog_max_len slow commands of a shard, only written by
+// the shard itself
+typedef struct Slowlog_ {
+  SlowlogEntry *entries;
+  size_t next;
+  size_t length;
+} Slowlog;
+
+// Commands running for at least this many microseconds are logged, a
+// negative value disables the log
+extern long long slowlog_log_slower_than;
+extern size_t slowlog_max_len;
+// slowlog_log_slower_than in latency_now() cycles, UINT64_MAX when disabled
+extern uint64_t slowlog_threshold;
+
+void slowlog_configure(void);
+int slowlog_init(Slowlog *log);
+void slowlog_push(Slowlog *log, Client *c, uint64_t cycles);
+void slowlog_reset(Slowlog *log);
+
+#endif // !SLOWLOG_H
@@ -0,0 +1,60 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+// Hierarchical timing wheel with a 1ms tick. Level l has 64 slots of 64^l
+// ticks each, four levels cover about 4.6 hours and later deadlines wait in
+// the last level until they get close. Adding and removing a timer is O(1),
+// timers are moved down a level when the wheel reaches their slot.
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+typedef void (*timer_proc)(void *data);
+
+typedef struct Timer_ {
+  struct Timer_ *next;
+  // NULL while the timer is not scheduled
+  struct Timer_ **pprev;
+  int level;
+  int slot;
+
+  // Monotonic milliseconds
+  long long expires;
+  timer_proc proc;
+  void *data;
+} Timer;
+
+typedef struct TimerWheel_ {
+  // Next tick to process, every timer before it has run
+  long long now;
+  uint64_t occupied[TIMER_WHEEL_LEVELS];
+  Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} TimerWheel;
+
+#define timer_pending(t) ((t)->pprev != NULL)
+
+// Clock read once per event loop iteration by clock_update, every command
+// handled in that iteration sees the same time. Deadlines of keys are wall
+// clock milliseconds, timers and stats go by the monotonic clock. Each loop
+// thread keeps its own copy.
+extern _Thread_local long long clock_unix_ms;
+extern _Thread_local long long clock_mono_us;
+
+void clock_update(void);
+
+// Wall clock milliseconds as of the last clock_update, for TTLs
+static inline long long get_time_ms(void) { return clock_unix_ms; }
+
+long long timer_now_ms(void);
+long long timer_now_us(void);
+
+void timer_wheel_init(TimerWheel *w, long long now);
+void timer_init(Timer *t, timer_proc proc, void *data);
+void timer_add(TimerWheel *w, Timer *t, long long expires);
+void timer_del(TimerWheel *w, Timer *t);
+void timer_wheel_run(TimerWheel *w, long long now);
+int timer_wheel_timeout(TimerWheel *w, long long now);
+
+#endif // !TIMER_H
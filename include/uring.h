@@ -0,0 +1,61 @@
+#ifndef URING_H
+#define URING_H
+
+#ifdef NET_IO_URING
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Minimal io_uring wrapper over the raw syscalls: submission and completion
+// rings plus one provided buffer ring for multishot receives.
+typedef struct Uring_ {
+  int fd;
+  int flags;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  unsigned sqe_tail;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *buf_ring;
+  char *buf_base;
+  unsigned buf_count;
+  unsigned buf_size;
+  unsigned short buf_tail;
+} Uring;
+
+int uring_init(Uring *r, unsigned entries);
+int uring_setup_buffers(Uring *r, unsigned count, unsigned size, int group);
+
+struct io_uring_sqe *uring_get_sqe(Uring *r);
+int uring_submit_and_wait(Uring *r, unsigned wait_nr);
+
+struct io_uring_cqe *uring_peek_cqe(Uring *r);
+void uring_cqe_seen(Uring *r);
+
+char *uring_buffer(Uring *r, unsigned bid);
+void uring_recycle_buffer(Uring *r, unsigned bid);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd,
+                                 uint64_t user_data);
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, int group,
+                               uint64_t user_data);
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                        const struct msghdr *msg, uint64_t user_data);
+void uring_prep_timeout(struct io_uring_sqe *sqe,
+                        struct __kernel_timespec *ts, uint64_t user_data);
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf, size_t len,
+                     uint64_t user_data);
+
+#endif // NET_IO_URING
+
+#endif // !URING_H
@@ -0,0 +1,54 @@
+#ifndef ZPACK_H
+#define ZPACK_H
+
+#include "bytes.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Entries sorted by score, then by member, followed by the member bytes in
+// the same order. An entry's offset is where its member starts within
+// those bytes. Ranks are plain indexes and scores are binary searched, but
+// inserting or deleting moves everything after the position, the encoding
+// is meant for small sorted sets only.
+typedef struct ZPackEntry_ {
+  double score;
+  uint32_t offset;
+  uint32_t length;
+} ZPackEntry;
+
+typedef struct ZPack_ {
+  uint32_t count;
+  // Bytes of member data, after the entries
+  uint32_t bytes;
+  ZPackEntry entries[];
+} ZPack;
+
+#define zpack_count(zp) ((zp)->count)
+#define zpack_members(zp) ((char *)((zp)->entries + (zp)->count))
+// Size of the whole allocation, which is also its serialized form
+#define zpack_blob_len(zp)                                                     \
+  (sizeof(ZPack) + (size_t)(zp)->count * sizeof(ZPackEntry) +                  \
+   (size_t)(zp)->bytes)
+
+ZPack *zpack_new(void);
+
+long zpack_find(ZPack *zp, const char *member, uint32_t len);
+void zpack_get(ZPack *zp, uint32_t index, Bytes *member, double *score);
+
+// Index of the first entry with a score >= min, or > min if `exclusive`.
+// count when there is none.
+uint32_t zpack_score_lower(ZPack *zp, double min, int exclusive);
+// Index of the first entry whose member is >= min, or > min if
+// `exclusive`. Only meaningful when every score is the same.
+uint32_t zpack_lex_lower(ZPack *zp, Bytes *min, int exclusive);
+
+// Functions that change the zpack may move it and return the new address,
+// or NULL when out of memory with the zpack left as it was. `member` must
+// not point into the zpack itself.
+ZPack *zpack_insert(ZPack *zp, double score, const char *member,
+                    uint32_t len);
+ZPack *zpack_delete(ZPack *zp, uint32_t index);
+
+int zpack_valid(ZPack *zp, size_t len);
+
+#endif // !ZPACK_H
@@ -3,6 +3,7 @@
 
 #include "client.h"
 #include "hash_table.h"
+#include "zpack.h"
 
 struct RObj;
 typedef struct RObj r_obj;
@@ -24,6 +25,16 @@ typedef struct RObj r_obj;
 #define ZRANGE_SET_LIMIT 1 << 3
 #define ZRANGE_SET_WITHSCORES 1 << 4
 
+// Sorted sets start out as a ZPack and become a dict plus skiplist for good
+// once they have more than zset_max_zpack_entries members or a member
+// longer than zset_max_zpack_value bytes (--zset-max-zpack-entries and
+// --zset-max-zpack-value)
+#define ZSET_MAX_ZPACK_ENTRIES 128
+#define ZSET_MAX_ZPACK_VALUE 64
+
+extern int zset_max_zpack_entries;
+extern int zset_max_zpack_value;
+
 #define ZSKIPLIST_MAX_LEVEL 32
 #define ZSKIPLIST_P 0.25
 
@@ -53,18 +64,45 @@ typedef struct ZSet_ {
   ZSkipList *zsl;
 } ZSet;
 
+// Walks a sorted set of either encoding from a starting element towards
+// the highest score, or the lowest if `reverse`
+typedef struct ZSetIterator_ {
+  r_obj *o;
+  ZSkipListNode *node;
+  // Next ZPack index, out of range when done
+  long index;
+  int reverse;
+} ZSetIterator;
+
 r_obj *create_zset_object();
+r_obj *create_zset_zpack_object(void);
+
+int zset_object_score(r_obj *o, Bytes *member, double *score);
+void zset_object_add(r_obj *o, Bytes *member, double score);
+int zset_object_rem(r_obj *o, Bytes *member);
+size_t zset_object_size(r_obj *o);
+long zset_object_rank(r_obj *o, Bytes *member);
+void zset_object_check_limits(r_obj *o);
+
+void zset_iterator_rank(r_obj *o, long rank, int reverse, ZSetIterator *it);
+void zset_iterator_score(r_obj *o, double bound, int reverse,
+                         ZSetIterator *it);
+void zset_iterator_lex(r_obj *o, Bytes *bound, int inclusive, int reverse,
+                       ZSetIterator *it);
+int zset_next(ZSetIterator *it, Bytes *member, double *score);
 
 ZSet *zset_create();
+// Returns -1 when out of memory
 int zset_add(ZSet *zs, Bytes *element, double score);
 void zset_range(ZSet *zs, int min_index, int max_index);
 void zset_destroy(ZSet *zs);
 
-void zrange_emit_node(OutputBuffer *ob, ZSkipListNode *node, int with_scores);
+void zrange_emit(OutputBuffer *ob, Bytes *member, double score,
+                 int with_scores);
 ZSkipListNode *zsl_next_node(ZSkipListNode *node, int reverse);
 ZSkipListNode *zsl_last_in_range(ZSkipList *zsl, double max);
 ZSkipListNode *zsl_last_in_lex_range(ZSkipList *zsl, Bytes *max, int inclusive);
-ZSkipListNode *zsl_get_element_by_rank(ZSkipList *zsl, int rank);
+ZSkipListNode *zsl_get_element_by_rank(ZSkipList *zsl, unsigned long rank);
 ZSkipListNode *zsl_first_in_range(ZSkipList *zsl, double min);
 int zsl_remove(ZSkipList *zsl, double score, Bytes *element);
 ZSkipListNode *zsl_first_in_lex_range(ZSkipList *zsl, Bytes *min,
@@ -10,6 +10,7 @@ Bytes *create_bytes_object(const char *data, uint32_t length) {
     return NULL;
 
   b->length = length;
+  b->flags = 0;
   b->data = malloc(length + 1);
   if (b->data == NULL) {
     free(b);
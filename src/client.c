@@ -4,8 +4,18 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
+ClientOutputLimit client_output_limits[CLIENT_CLASS_COUNT] = {
+    [CLIENT_CLASS_NORMAL] = {1024UL * 1024 * 1024, 256UL * 1024 * 1024, 60},
+};
+
+static const char *client_class_names[CLIENT_CLASS_COUNT] = {
+    [CLIENT_CLASS_NORMAL] = "normal",
+};
+
 Client *create_client(int fd) {
   Client *client;
   if ((client = (Client *)malloc(sizeof(Client))) == NULL)
@@ -26,19 +36,55 @@ Client *create_client(int fd) {
 
   client->arg_count = 0;
   client->arg_values = NULL;
+  client->arg_views = NULL;
   client->arg_values_cap = 0;
   client->query_pos = 0;
 
+  client->io_status = 0;
+  client->parsed_consumed = 0;
+  client->blocked = 0;
+  client->pipeline_paused = 0;
+  client->poll_events = 0;
+  client->recv_armed = 0;
+
+  client->class = CLIENT_CLASS_NORMAL;
+  client->soft_limit_since = 0;
+
   client->output_buffer = create_output_buffer(fd);
 
   return client;
 }
 
+// Only once nothing refers to the client anymore, see disconnect_client
+void free_client(Client *client) {
+  free_output_buffer(client->output_buffer);
+  free(client->query_buffer);
+  free(client->arg_values);
+  free(client->arg_views);
+  free(client);
+}
+
+// Moving the query buffer must carry the argument views of an already
+// parsed command along
+static int grow_query_buffer(Client *client, size_t cap) {
+  uintptr_t old = (uintptr_t)client->query_buffer;
+  char *buf = realloc(client->query_buffer, cap);
+  if (buf == NULL)
+    return -1;
+
+  for (int i = 0; i < client->arg_count; i++)
+    client->arg_views[i].data =
+        buf + ((uintptr_t)client->arg_views[i].data - old);
+
+  client->query_buffer = buf;
+  client->query_cap = cap;
+  return 0;
+}
+
 int read_from_client(Client *client) {
-  if (client->query_length >= client->query_cap) {
-    client->query_cap *= 2;
-    client->query_buffer = realloc(client->query_buffer, client->query_cap);
-  }
+  if (client->query_length >= client->query_cap &&
+      grow_query_buffer(client, client->query_cap * 2) != 0)
+    return -1;
 
   ssize_t nread = read(client->fd, client->query_buffer + client->query_length,
                        client->query_cap - client->query_length);
@@ -54,15 +100,85 @@ int read_from_client(Client *client) {
   return 0;
 }
 
-void reset_client_args(Client *client) {
-  if (client->arg_values) {
-    for (int i = 0; i < client->arg_count; i++) {
-      if (client->arg_values[i] != NULL) {
-        free_bytes_object(client->arg_values[i]);
-        client->arg_values[i] = NULL;
-      }
-    }
+// Appends bytes received outside of read_from_client (io_uring buffers)
+int client_append_query(Client *client, const char *data, size_t len) {
+  if (client->query_length + len > client->query_cap) {
+    size_t cap = client->query_cap * 2;
+    while (cap < client->query_length + len)
+      cap *= 2;
+
+    if (grow_query_buffer(client, cap) != 0)
+      return -1;
   }
 
-  client->arg_count = 0;
+  memcpy(client->query_buffer + client->query_length, data, len);
+  client->query_length += len;
+  return 0;
+}
+
+// Arguments are views into the query buffer, there is nothing to free
+void reset_client_args(Client *client) { client->arg_count = 0; }
+
+// Drops the consumed part of the query buffer. Runs only between commands,
+// when no argument view points into the buffer.
+void client_compact_query(Client *client) {
+  if (client->arg_count > 0 || client->parsed_consumed > 0)
+    return;
+
+  if (client->query_pos == client->query_length) {
+    client->query_pos = 0;
+    client->query_length = 0;
+    return;
+  }
+
+  // A partial command is left, slide it down once it sits far enough in
+  if (client->query_pos < client->query_cap / 2)
+    return;
+
+  memmove(client->query_buffer, client->query_buffer + client->query_pos,
+          client->query_length - client->query_pos);
+  client->query_length -= client->query_pos;
+  client->query_pos = 0;
+}
+
+int client_output_paused(Client *client) {
+  return client->output_buffer->length >= CLIENT_OUTPUT_PAUSE;
+}
+
+// Returns -1 once the client fell too far behind reading its replies
+int client_check_output_limits(Client *client, long long now) {
+  ClientOutputLimit *limit = &client_output_limits[client->class];
+  size_t pending = client->output_buffer->length;
+
+  if (limit->hard > 0 && pending > limit->hard)
+    return -1;
+
+  if (limit->soft == 0 || pending <= limit->soft) {
+    client->soft_limit_since = 0;
+    return 0;
+  }
+
+  if (client->soft_limit_since == 0) {
+    client->soft_limit_since = now;
+    return 0;
+  }
+
+  if (now - client->soft_limit_since >= limit->soft_seconds * 1000)
+    return -1;
+
+  return 0;
+}
+
+const char *client_class_name(client_class class) {
+  return client_class_names[class];
+}
+
+// Returns CLIENT_CLASS_COUNT for an unknown name
+client_class client_class_by_name(const char *name) {
+  for (int i = 0; i < CLIENT_CLASS_COUNT; i++) {
+    if (strcasecmp(client_class_names[i], name) == 0)
+      return (client_class)i;
+  }
+
+  return CLIENT_CLASS_COUNT;
 }
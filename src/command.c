@@ -1,9 +1,11 @@
 #include "../include/command.h"
+#include "../include/hash.h"
 #include "../include/hnsw.h"
 #include "../include/list.h"
 #include "../include/persistance.h"
 #include "../include/recis.h"
 #include "../include/set.h"
+#include "../include/shard.h"
 #include "../include/vector.h"
 #include "../include/zset.h"
 #include <ctype.h>
@@ -19,67 +21,154 @@
 #include <time.h>
 #include <unistd.h>
 
-Command CommandTable[] = {{"SET", set_command, -3},
-                          {"GET", get_command, 2},
-                          {"DEL", del_command, -2},
-                          {"TTL", ttl_command, 2},
-                          {"INCR", incr_command, 2},
-                          {"INCRBY", incrby_command, 3},
-                          {"LPUSH", lpush_command, -3},
-                          {"RPUSH", rpush_command, -3},
-                          {"RPOP", rpop_command, -2},
-                          {"LPOP", lpop_command, -2},
-                          {"LLEN", llen_command, 2},
-                          {"LINDEX", lindex_command, 3},
-                          {"LRANGE", lrange_command, 4},
-                          {"LMOVE", lmove_command, 5},
-                          {"LTRIM", ltrim_command, 4},
-                          {"SADD", sadd_command, -3},
-                          {"SREM", srem_command, -3},
-                          {"SCARD", scard_command, 2},
-                          {"SINTER", sinter_command, -2},
-                          {"SISMEMBER", sismember_command, 3},
-                          {"SMEMEBERS", smembers_command, 2},
-                          {"HSET", hset_command, -4},
-                          {"HGET", hget_command, 3},
-                          {"HMGET", hmget_command, -3},
-                          {"HINCRBY", hincrby_command, 4},
-                          {"ZADD", zadd_command, -4},
-                          {"ZREM", zrem_command, -3},
-                          {"ZCARD", zcard_command, 2},
-                          {"ZRANGE", zrange_command, -4},
-                          {"ZSCORE", zscore_command, 3},
-                          {"ZRANK", zrank_command, 3},
-                          {"VIDX.CREATE", vidx_create_command, -4},
-                          {"VIDX.DROP", vidx_drop_command, 2},
-                          {"VIDX.LIST", vidx_list, 1},
-                          {"VIDX.INFO", vidx_info_command, 2},
-                          {"VADD", vadd_command, 4},
-                          {"SAVE", save_command, 1},
-                          {"PING", ping_command, 1},
-                          {NULL, NULL, 0}};
+Command CommandTable[] = {
+    {"SET", set_command, -3, 1, 1, 1, CMD_WRITE},
+    {"GET", get_command, 2, 1, 1, 1, CMD_READ},
+    {"DEL", del_command, -2, 1, -1, 1, CMD_WRITE},
+    {"TTL", ttl_command, 2, 1, 1, 1, CMD_READ},
+    {"INCR", incr_command, 2, 1, 1, 1, CMD_WRITE},
+    {"INCRBY", incrby_command, 3, 1, 1, 1, CMD_WRITE},
+    {"LPUSH", lpush_command, -3, 1, 1, 1, CMD_WRITE},
+    {"RPUSH", rpush_command, -3, 1, 1, 1, CMD_WRITE},
+    {"RPOP", rpop_command, -2, 1, 1, 1, CMD_WRITE},
+    {"LPOP", lpop_command, -2, 1, 1, 1, CMD_WRITE},
+    {"LLEN", llen_command, 2, 1, 1, 1, CMD_READ},
+    {"LINDEX", lindex_command, 3, 1, 1, 1, CMD_READ},
+    {"LRANGE", lrange_command, 4, 1, 1, 1, CMD_READ},
+    {"LMOVE", lmove_command, 5, 1, 2, 1, CMD_WRITE},
+    {"LTRIM", ltrim_command, 4, 1, 1, 1, CMD_WRITE},
+    {"SADD", sadd_command, -3, 1, 1, 1, CMD_WRITE},
+    {"SREM", srem_command, -3, 1, 1, 1, CMD_WRITE},
+    {"SCARD", scard_command, 2, 1, 1, 1, CMD_READ},
+    {"SINTER", sinter_command, -2, 1, -1, 1, CMD_READ},
+    {"SISMEMBER", sismember_command, 3, 1, 1, 1, CMD_READ},
+    {"SMEMEBERS", smembers_command, 2, 1, 1, 1, CMD_READ},
+    {"HSET", hset_command, -4, 1, 1, 1, CMD_WRITE},
+    {"HGET", hget_command, 3, 1, 1, 1, CMD_READ},
+    {"HMGET", hmget_command, -3, 1, 1, 1, CMD_READ},
+    {"HINCRBY", hincrby_command, 4, 1, 1, 1, CMD_WRITE},
+    {"ZADD", zadd_command, -4, 1, 1, 1, CMD_WRITE},
+    {"ZREM", zrem_command, -3, 1, 1, 1, CMD_WRITE},
+    {"ZCARD", zcard_command, 2, 1, 1, 1, CMD_READ},
+    {"ZRANGE", zrange_command, -4, 1, 1, 1, CMD_READ},
+    {"ZSCORE", zscore_command, 3, 1, 1, 1, CMD_READ},
+    {"ZRANK", zrank_command, 3, 1, 1, 1, CMD_READ},
+    {"VIDX.CREATE", vidx_create_command, -4, 1, 1, 1, CMD_WRITE},
+    {"VIDX.DROP", vidx_drop_command, 2, 1, 1, 1, CMD_WRITE},
+    {"VIDX.LIST", vidx_list, 1, 0, 0, 0, CMD_READ | CMD_GLOBAL},
+    {"VIDX.INFO", vidx_info_command, 2, 1, 1, 1, CMD_READ},
+    {"VADD", vadd_command, 4, 1, 2, 1, CMD_WRITE},
+    {"SAVE", save_command, 1, 0, 0, 0, CMD_ADMIN | CMD_GLOBAL},
+    {"PING", ping_command, 1, 0, 0, 0, 0},
+    {"INFO", info_command, -1, 0, 0, 0, CMD_ADMIN},
+    {"LATENCY", latency_command, -2, 0, 0, 0, CMD_ADMIN},
+    {"SLOWLOG", slowlog_command, -2, 0, 0, 0, CMD_ADMIN | CMD_GLOBAL},
+    {NULL, NULL, 0, 0, 0, 0, 0}};
 
 r_obj *create_command_object(Command *cmd) {
   r_obj *o;
   if ((o = (r_obj *)malloc(sizeof(r_obj))) == NULL)
     return NULL;
   o->type = COMMAND;
+  o->refcount = 1;
+  o->encoding = OBJ_ENCODING_RAW;
   o->data = cmd;
   return o;
 }
-Command *command_lookup(char *name, int len) {
+// Commands are dispatched through a perfect hash of the upper-cased name:
+// every command owns a slot, so a lookup costs one hash and one compare. The
+// seed is picked so the current table has no collisions, command_table_init
+// only searches for another one when a new command collides.
+#define COMMAND_SLOTS_BITS 7
+#define COMMAND_SLOTS (1 << COMMAND_SLOTS_BITS)
+#define COMMAND_HASH_SEED 2166136822u
+#define COMMAND_SEED_TRIES 1000000
+
+typedef struct CommandSlot_ {
+  Command *cmd;
+  int len;
+} CommandSlot;
+
+static CommandSlot command_slots[COMMAND_SLOTS];
+static uint32_t command_seed = COMMAND_HASH_SEED;
+
+int command_count = 0;
+
+// FNV-1a with ASCII letters folded to upper case
+static inline uint32_t command_hash(const char *name, int len, uint32_t seed) {
+  uint32_t h = seed ^ (uint32_t)len;
+
+  for (int i = 0; i < len; i++)
+    h = (h ^ ((unsigned char)name[i] & 0xDF)) * 16777619u;
+
+  return h >> (32 - COMMAND_SLOTS_BITS);
+}
+
+static int command_slots_fill(uint32_t seed) {
+  memset(command_slots, 0, sizeof(command_slots));
+
   for (int i = 0; CommandTable[i].name != NULL; i++) {
-    char *cmd_name = CommandTable[i].name;
+    int len = (int)strlen(CommandTable[i].name);
+    CommandSlot *slot =
+        &command_slots[command_hash(CommandTable[i].name, len, seed)];
 
-    if (strlen(cmd_name) != len)
-      continue;
+    if (slot->cmd != NULL)
+      return -1;
+
+    slot->cmd = &CommandTable[i];
+    slot->len = len;
+  }
+
+  return 0;
+}
+
+int command_table_init(void) {
+  while (CommandTable[command_count].name != NULL)
+    command_count++;
 
-    if (strncasecmp(name, cmd_name, len) == 0) {
-      return &CommandTable[i];
+  for (uint32_t i = 0; i < COMMAND_SEED_TRIES; i++) {
+    if (command_slots_fill(COMMAND_HASH_SEED + i) == 0) {
+      if (i > 0)
+        fprintf(stderr, "Command hash seed collides, update it to %u\n",
+                COMMAND_HASH_SEED + i);
+      command_seed = COMMAND_HASH_SEED + i;
+      return 0;
     }
   }
 
-  return NULL;
+  return -1;
+}
+
+Command *command_lookup(char *name, int len) {
+  CommandSlot *slot = &command_slots[command_hash(name, len, command_seed)];
+
+  if (slot->cmd == NULL || slot->len != len ||
+      strncasecmp(name, slot->cmd->name, len) != 0)
+    return NULL;
+
+  return slot->cmd;
+}
+
+// Replies with an error and returns 0 if argc doesn't fit the arity
+int command_check_arity(Command *cmd, int argc, OutputBuffer *ob) {
+  if ((cmd->arity > 0 && argc == cmd->arity) ||
+      (cmd->arity < 0 && argc >= -cmd->arity))
+    return 1;
+
+  char err[128];
+  int err_len = snprintf(err, sizeof(err),
+                         "-ERR wrong number of arguments for '%s' command\r\n",
+                         cmd->name);
+  append_to_output_buffer(ob, err, err_len);
+  return 0;
+}
+
+// Index of the last key argument, resolving a last_key counted from the end
+int command_last_key(Command *cmd, int argc) {
+  int last = cmd->last_key < 0 ? argc + cmd->last_key : cmd->last_key;
+  if (last >= argc)
+    last = argc - 1;
+  return last;
 }
 
 int is_valid_alpha_string(const char *str) {
@@ -123,12 +212,9 @@ uint32_t parse_uint32(const char *s) {
   return (uint32_t)val;
 }
 
-long long get_time_ms() { return (long long)time(NULL) * 1000; }
-
 void set_command(CommandContext *ctx) {
   Client *client = ctx->client;
   HashTable *db = ctx->db;
-  HashTable *expires = ctx->expires;
   OutputBuffer *ob = ctx->ob;
 
   Bytes **arg_values = client->arg_values;
@@ -210,6 +296,13 @@ void set_command(CommandContext *ctx) {
 
   r_obj *o = hash_table_get(db, arg_values[1]);
 
+  // The old value in whatever encoding, for IFEQ, IFNE and GET
+  Bytes old_tmp;
+  char old_buf[OBJ_INT_BUF];
+  Bytes *old = NULL;
+  if (o != NULL && o->type == STRING)
+    old = string_object_bytes(o, &old_tmp, old_buf);
+
   if (nx && o != NULL) {
     append_to_output_buffer(ob, "_\r\n", 3);
     return;
@@ -231,7 +324,7 @@ void set_command(CommandContext *ctx) {
       return;
     }
 
-    if (bytes_equal((Bytes *)o->data, ifeq_val) == 0) {
+    if (bytes_equal(old, ifeq_val) == 0) {
       append_to_output_buffer(ob, "_\r\n", 3);
       return;
     }
@@ -239,7 +332,7 @@ void set_command(CommandContext *ctx) {
 
   if (ifne) {
     if (o != NULL) {
-      if (o->type == STRING && bytes_equal((Bytes *)o->data, ifne_val) != 0) {
+      if (o->type == STRING && bytes_equal(old, ifne_val) != 0) {
         append_to_output_buffer(ob, "_\r\n", 3);
         return;
       }
@@ -251,17 +344,16 @@ void set_command(CommandContext *ctx) {
     return;
   }
 
-  if (flags & OBJ_SET_GET) {
-    if (o == NULL) {
-      append_to_output_buffer(ob, "_\r\n", 3);
-    } else if (o->type != STRING) {
+  // A missing key's nil goes out after the value is stored, storing a new
+  // key is what can fail
+  if ((flags & OBJ_SET_GET) && o != NULL) {
+    if (o->type != STRING) {
       append_to_output_buffer(ob,
                               "-WRONGTYPE Operation against a key holding the "
                               "wrong kind of value\r\n",
                               68);
       return;
     } else {
-      Bytes *old = (Bytes *)o->data;
       char header[64];
       int head_len =
           snprintf(header, sizeof(header), "$%" PRIu32 "\r\n", old->length);
@@ -272,26 +364,27 @@ void set_command(CommandContext *ctx) {
     }
   }
 
-  if ((flags & OBJ_SET_KEEPTTL) && o != NULL && expire_at == -1) {
-    r_obj *ttl = hash_table_get(expires, arg_values[1]);
-    if (ttl != NULL) {
-      expire_at = *(long long *)ttl->data;
-    }
-  }
-
   Bytes *val = arg_values[2];
 
-  r_obj *new_obj = create_string_object(val->data, val->length);
-  hash_table_set(db, arg_values[1], new_obj);
+  // Overwriting keeps the key and with it the deadline, which KEEPTTL wants
+  r_obj *new_obj = create_string_value_object(val->data, val->length);
+  if (hash_table_set(db, arg_values[1], new_obj) != 0) {
+    free_object(new_obj);
+    append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+    return;
+  }
 
   if (expire_at != -1) {
-    hash_table_set(expires, arg_values[1], create_int_object(expire_at));
-  } else {
-    hash_table_del(expires, arg_values[1]);
+    hash_table_set_expire(db, arg_values[1], expire_at);
+    expire_index_add(ctx->expire_index, arg_values[1], expire_at);
+  } else if (!(flags & OBJ_SET_KEEPTTL)) {
+    hash_table_set_expire(db, arg_values[1], -1);
   }
 
   if (!(flags & OBJ_SET_GET)) {
     append_to_output_buffer(ob, "+OK\r\n", 5);
+  } else if (o == NULL) {
+    append_to_output_buffer(ob, "_\r\n", 3);
   }
   return;
 }
@@ -299,7 +392,6 @@ void set_command(CommandContext *ctx) {
 void get_command(CommandContext *ctx) {
   Client *client = ctx->client;
   HashTable *db = ctx->db;
-  HashTable *expires = ctx->expires;
   OutputBuffer *ob = ctx->ob;
 
   Bytes **arg_values = client->arg_values;
@@ -310,28 +402,25 @@ void get_command(CommandContext *ctx) {
     return;
   }
 
-  r_obj *exp_obj = hash_table_get(expires, arg_values[1]);
+  // One lookup, the deadline comes with the key
+  Node *entry = hash_table_find_entry(db, arg_values[1]);
 
-  if (exp_obj != NULL) {
-    long long *kill_time = (long long *)exp_obj->data;
-    if (get_time_ms() > *kill_time) {
+  if (entry != NULL) {
+    long long kill_time = hash_key_expire(entry->key);
+    if (kill_time != -1 && get_time_ms() > kill_time) {
       hash_table_del(db, arg_values[1]);
-      hash_table_del(expires, arg_values[1]);
-
-      /* append_to_output_buffer(ob, "_\r\n", 3); */
-      append_to_output_buffer(ob, "$-1\r\n", 5);
-      return;
+      entry = NULL;
     }
   }
 
-  r_obj *o = hash_table_get(db, arg_values[1]);
-
-  if (!o) {
+  if (entry == NULL) {
     /* append_to_output_buffer(ob, "_\r\n", 3); */
     append_to_output_buffer(ob, "$-1\r\n", 5);
     return;
   }
 
+  r_obj *o = entry->value;
+
   if (o->type != STRING) {
     append_to_output_buffer(ob,
                             "-WRONGTYPE Operation against a key holding the "
@@ -340,13 +429,23 @@ void get_command(CommandContext *ctx) {
     return;
   }
 
+  char header[64];
+
+  if (o->encoding == OBJ_ENCODING_INT) {
+    char num[OBJ_INT_BUF];
+    int num_len = snprintf(num, sizeof(num), "%lld", string_object_int(o));
+    int resp_len = snprintf(header, sizeof(header), "$%d\r\n%s\r\n", num_len,
+                            num);
+    append_to_output_buffer(ob, header, resp_len);
+    return;
+  }
+
   Bytes *value = (Bytes *)o->data;
 
-  char header[64];
   int head_len =
       snprintf(header, sizeof(header), "$%" PRIu32 "\r\n", value->length);
   append_to_output_buffer(ob, header, head_len);
-  append_to_output_buffer(ob, value->data, value->length);
+  append_ref_to_output_buffer(ob, o, value->data, value->length);
   append_to_output_buffer(ob, "\r\n", 2);
 
   return;
@@ -355,7 +454,6 @@ void get_command(CommandContext *ctx) {
 void del_command(CommandContext *ctx) {
   Client *client = ctx->client;
   HashTable *db = ctx->db;
-  HashTable *expires = ctx->expires;
   OutputBuffer *ob = ctx->ob;
 
   Bytes **arg_values = client->arg_values;
@@ -370,10 +468,8 @@ void del_command(CommandContext *ctx) {
 
   for (int i = 1; i < arg_count; i++) {
     Bytes *key = arg_values[i];
-    if (hash_table_del(db, key) == 1) {
-      hash_table_del(expires, key);
+    if (hash_table_del(db, key) == 1)
       deleted_count++;
-    }
   }
 
   char resp[64];
@@ -385,7 +481,6 @@ void del_command(CommandContext *ctx) {
 void ttl_command(CommandContext *ctx) {
   Client *client = ctx->client;
   HashTable *db = ctx->db;
-  HashTable *expires = ctx->expires;
   OutputBuffer *ob = ctx->ob;
 
   Bytes **arg_values = client->arg_values;
@@ -396,25 +491,62 @@ void ttl_command(CommandContext *ctx) {
     return;
   }
 
-  r_obj *o = hash_table_get(db, arg_values[1]);
-  if (o == NULL) {
+  Node *entry = hash_table_find_entry(db, arg_values[1]);
+  if (entry == NULL) {
     append_to_output_buffer(ob, ":-2\r\n", 5);
     return;
   }
 
-  r_obj *ttl = hash_table_get(expires, arg_values[1]);
-  if (ttl == NULL) {
+  long long when = hash_key_expire(entry->key);
+  if (when == -1) {
     append_to_output_buffer(ob, ":-1\r\n", 5);
     return;
   }
 
-  long long seconds = (*(long long *)ttl->data - get_time_ms()) / 1000;
+  long long left = when - get_time_ms();
+  if (left < 0) {
+    hash_table_del(db, arg_values[1]);
+    append_to_output_buffer(ob, ":-2\r\n", 5);
+    return;
+  }
+
+  // Rounded, a fresh EX 10 still reads 10
+  long long seconds = (left + 500) / 1000;
   char resp[64];
   int resp_len = snprintf(resp, sizeof(resp), ":%lld\r\n", seconds);
   append_to_output_buffer(ob, resp, resp_len);
   return;
 }
 
+// Integer value of a STRING, 0 if it doesn't hold one
+static int string_object_get_int64(r_obj *o, int64_t *value) {
+  if (o->encoding == OBJ_ENCODING_INT) {
+    *value = string_object_int(o);
+    return 1;
+  }
+
+  return try_parse_int64(((Bytes *)o->data)->data, value);
+}
+
+// Stores the result of INCR and friends. An integer encoded value nobody
+// else holds a reference to is updated in place.
+// Returns -1 if the value could not be stored.
+static int string_value_set_int64(HashTable *db, Bytes *key, r_obj *o,
+                                  int64_t value) {
+  if (o != NULL && o->encoding == OBJ_ENCODING_INT &&
+      __atomic_load_n(&o->refcount, __ATOMIC_RELAXED) == 1) {
+    o->data = (void *)(intptr_t)value;
+    return 0;
+  }
+
+  r_obj *value_o = create_int_string_object(value);
+  if (hash_table_set(db, key, value_o) != 0) {
+    free_object(value_o);
+    return -1;
+  }
+  return 0;
+}
+
 void incr_command(CommandContext *ctx) {
   Client *client = ctx->client;
   HashTable *db = ctx->db;
@@ -440,8 +572,7 @@ void incr_command(CommandContext *ctx) {
       return;
     }
 
-    Bytes *o_bytes = (Bytes *)o->data;
-    if (try_parse_int64(o_bytes->data, &value) == 0) {
+    if (string_object_get_int64(o, &value) == 0) {
       append_to_output_buffer(
           ob, "-value is not an integer or out of range\r\n", 42);
       return;
@@ -456,12 +587,13 @@ void incr_command(CommandContext *ctx) {
 
   value++;
 
-  char num_str[64];
-  int num_len = snprintf(num_str, sizeof(num_str), "%" PRId64, value);
-  hash_table_set(db, client->arg_values[1],
-                 create_string_object(num_str, num_len));
+  if (string_value_set_int64(db, arg_values[1], o, value) != 0) {
+    append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+    return;
+  }
+
   char resp[64];
-  int resp_len = snprintf(resp, sizeof(resp), ":%s\r\n", num_str);
+  int resp_len = snprintf(resp, sizeof(resp), ":%" PRId64 "\r\n", value);
   append_to_output_buffer(ob, resp, resp_len);
   return;
 }
@@ -499,8 +631,7 @@ void incrby_command(CommandContext *ctx) {
       return;
     }
 
-    Bytes *o_bytes = (Bytes *)o->data;
-    if (try_parse_int64(o_bytes->data, &value) == 0) {
+    if (string_object_get_int64(o, &value) == 0) {
       append_to_output_buffer(
           ob, "-value is not an integer or out of range\r\n", 42);
       return;
@@ -516,12 +647,13 @@ void incrby_command(CommandContext *ctx) {
 
   value += increment;
 
-  char num_str[64];
-  int num_len = snprintf(num_str, sizeof(num_str), "%" PRId64, value);
-  hash_table_set(db, arg_values[1], create_string_object(num_str, num_len));
+  if (string_value_set_int64(db, arg_values[1], o, value) != 0) {
+    append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+    return;
+  }
 
   char resp[64];
-  int resp_len = snprintf(resp, sizeof(resp), ":%s\r\n", num_str);
+  int resp_len = snprintf(resp, sizeof(resp), ":%" PRId64 "\r\n", value);
   append_to_output_buffer(ob, resp, resp_len);
   return;
 }
@@ -551,8 +683,7 @@ void decr_command(CommandContext *ctx) {
       return;
     }
 
-    Bytes *o_bytes = (Bytes *)o->data;
-    if (try_parse_int64(o_bytes->data, &value) == 0) {
+    if (string_object_get_int64(o, &value) == 0) {
       append_to_output_buffer(
           ob, "-value is not an integer or out of range\r\n", 42);
       return;
@@ -567,12 +698,13 @@ void decr_command(CommandContext *ctx) {
 
   value--;
 
-  char num_str[64];
-  int num_len = snprintf(num_str, sizeof(num_str), "%" PRId64, value);
-  hash_table_set(db, client->arg_values[1],
-                 create_string_object(num_str, num_len));
+  if (string_value_set_int64(db, arg_values[1], o, value) != 0) {
+    append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+    return;
+  }
+
   char resp[64];
-  int resp_len = snprintf(resp, sizeof(resp), ":%s\r\n", num_str);
+  int resp_len = snprintf(resp, sizeof(resp), ":%" PRId64 "\r\n", value);
   append_to_output_buffer(ob, resp, resp_len);
   return;
 }
@@ -610,8 +742,7 @@ void decrby_command(CommandContext *ctx) {
       return;
     }
 
-    Bytes *o_bytes = (Bytes *)o->data;
-    if (try_parse_int64(o_bytes->data, &value) == 0) {
+    if (string_object_get_int64(o, &value) == 0) {
       append_to_output_buffer(
           ob, "-value is not an integer or out of range\r\n", 42);
       return;
@@ -627,16 +758,28 @@ void decrby_command(CommandContext *ctx) {
 
   value -= decrement;
 
-  char num_str[64];
-  int num_len = snprintf(num_str, sizeof(num_str), "%" PRId64, value);
-  hash_table_set(db, arg_values[1], create_string_object(num_str, num_len));
+  if (string_value_set_int64(db, arg_values[1], o, value) != 0) {
+    append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+    return;
+  }
 
   char resp[64];
-  int resp_len = snprintf(resp, sizeof(resp), ":%s\r\n", num_str);
+  int resp_len = snprintf(resp, sizeof(resp), ":%" PRId64 "\r\n", value);
   append_to_output_buffer(ob, resp, resp_len);
   return;
 }
 
+// Elements live packed inside the list, replies copy them
+static void list_reply_element(OutputBuffer *ob, Bytes *element) {
+  char bulk_header[64];
+  int bh_len = snprintf(bulk_header, sizeof(bulk_header), "$%" PRIu32 "\r\n",
+                        element->length);
+
+  append_to_output_buffer(ob, bulk_header, bh_len);
+  append_to_output_buffer(ob, element->data, element->length);
+  append_to_output_buffer(ob, "\r\n", 2);
+}
+
 void lpush_command(CommandContext *ctx) {
   Client *client = ctx->client;
   HashTable *db = ctx->db;
@@ -661,15 +804,18 @@ void lpush_command(CommandContext *ctx) {
 
   if (!o) {
     o = create_list_object();
-    hash_table_set(db, arg_values[1], o);
+    if (hash_table_set(db, arg_values[1], o) != 0) {
+      free_object(o);
+      append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+      return;
+    }
   }
 
   int j;
   List *list = (List *)o->data;
 
   for (j = 2; j < arg_count; j++) {
-    list_ins_node_head(
-        list, create_string_object(arg_values[j]->data, arg_values[j]->length));
+    list_push_head(list, arg_values[j]->data, arg_values[j]->length);
   }
 
   char resp[64];
@@ -746,25 +892,10 @@ void lindex_command(CommandContext *ctx) {
     return;
   }
 
-  ListNode *member = list->head;
-  printf("list->head %s", (char *)member->value);
+  Bytes member;
+  list_index(list, index, &member);
 
-  while (index > 0) {
-    member = member->next;
-    index--;
-  }
-
-  r_obj *member_o = (r_obj *)member->value;
-  Bytes *member_bytes = (Bytes *)member_o->data;
-
-  char *value = member_bytes->data;
-  uint32_t val_len = member_bytes->length;
-
-  char header[64];
-  int head_len = snprintf(header, sizeof(header), "$%" PRIu32 "\r\n", val_len);
-  append_to_output_buffer(ob, header, head_len);
-  append_to_output_buffer(ob, value, val_len);
-  append_to_output_buffer(ob, "\r\n", 2);
+  list_reply_element(ob, &member);
   return;
 }
 
@@ -821,38 +952,20 @@ void lrange_command(CommandContext *ctx) {
     return;
   }
 
-  int forward = (start <= llen / 2) ? 1 : 0;
-
   if (stop >= llen)
     stop = llen - 1;
   size_t range_len = stop - start + 1;
 
-  ListNode *node;
-
-  if (forward)
-    node = list_get_node_at(list, start, 0);
-  else
-    node = list_get_node_at(list, start, 1);
-
   char header[64];
-  int header_len = snprintf(header, sizeof(header), "*%ld\r\n", range_len);
+  int header_len = snprintf(header, sizeof(header), "*%zu\r\n", range_len);
   append_to_output_buffer(ob, header, header_len);
 
-  while (node && range_len > 0) {
-    r_obj *member_o = (r_obj *)node->value;
-    Bytes *member_bytes = (Bytes *)member_o->data;
-
-    char *value = member_bytes->data;
-    uint32_t val_len = member_bytes->length;
+  ListIterator it;
+  Bytes member;
 
-    char bulk_header[64];
-    int bh_len =
-        snprintf(bulk_header, sizeof(bulk_header), "$%" PRIu32 "\r\n", val_len);
-
-    append_to_output_buffer(ob, bulk_header, bh_len);
-    append_to_output_buffer(ob, value, val_len);
-    append_to_output_buffer(ob, "\r\n", 2);
-    node = forward ? node->next : node->prev;
+  list_iterator_init(list, start, &it);
+  while (range_len > 0 && list_next(&it, &member)) {
+    list_reply_element(ob, &member);
     range_len--;
   }
 
@@ -862,7 +975,6 @@ void lrange_command(CommandContext *ctx) {
 void lmove_command(CommandContext *ctx) {
   Client *client = ctx->client;
   HashTable *db = ctx->db;
-  HashTable *expires = ctx->expires;
   OutputBuffer *ob = ctx->ob;
 
   Bytes **arg_values = client->arg_values;
@@ -916,7 +1028,11 @@ void lmove_command(CommandContext *ctx) {
 
   if (!dest_o) {
     dest_o = create_list_object();
-    hash_table_set(db, arg_values[2], dest_o);
+    if (hash_table_set(db, arg_values[2], dest_o) != 0) {
+      free_object(dest_o);
+      append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+      return;
+    }
   } else if (dest_o != NULL && dest_o->type != LIST) {
     char *msg = "-WRONGTYPE Operation against a key holding "
                 "the wrong kind of value\r\n";
@@ -927,37 +1043,37 @@ void lmove_command(CommandContext *ctx) {
   List *src_list = (List *)src_o->data;
   List *dest_list = (List *)dest_o->data;
 
-  r_obj *value;
+  Bytes element;
+  int from_head = (flags & LMOVE_SRC_LEFT) != 0;
 
-  if (flags & LMOVE_SRC_LEFT)
-    value = list_pop_head(src_list);
-  else if (flags & LMOVE_SRC_RIGHT)
-    value = list_pop_tail(src_list);
-
-  if (!value) {
+  if (!list_index(src_list, from_head ? 0 : -1, &element)) {
     append_to_output_buffer(ob, "$-1\r\n", 5);
     return;
   }
 
+  // The element points into src, which may also be dest, copy it out
+  // before either list changes
+  Bytes value;
+  value.length = element.length;
+  if ((value.data = malloc(element.length + 1)) == NULL) {
+    append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+    return;
+  }
+  memcpy(value.data, element.data, element.length);
+
+  list_trim(src_list, from_head ? 1 : 0, from_head ? 0 : 1);
+
   if (flags & LMOVE_DEST_LEFT)
-    list_ins_node_head(dest_list, value);
+    list_push_head(dest_list, value.data, value.length);
   else if (flags & LMOVE_DEST_RIGHT)
-    list_ins_node_tail(dest_list, value);
+    list_push_tail(dest_list, value.data, value.length);
 
   if (src_list->size == 0) {
     hash_table_del(db, arg_values[1]);
-    hash_table_del(expires, arg_values[1]);
   }
 
-  Bytes *value_bytes = (Bytes *)value->data;
-
-  uint32_t val_len = value_bytes->length;
-  char bulk_header[64];
-  int bh_len =
-      snprintf(bulk_header, sizeof(bulk_header), "$%" PRIu32 "\r\n", val_len);
-  append_to_output_buffer(ob, bulk_header, bh_len);
-  append_to_output_buffer(ob, value_bytes->data, val_len);
-  append_to_output_buffer(ob, "\r\n", 2);
+  list_reply_element(ob, &value);
+  free(value.data);
 
   return;
 }
@@ -1019,17 +1135,7 @@ void ltrim_command(CommandContext *ctx) {
   if (stop >= llen)
     stop = llen - 1;
 
-  for (int64_t i = 0; i < start; i++) {
-    r_obj *value = list_pop_head(list);
-    free_object(value);
-  }
-
-  stop = stop - start;
-
-  while (list->size > stop + 1) {
-    r_obj *value = list_pop_tail(list);
-    free_object(value);
-  }
+  list_trim(list, start, llen - 1 - stop);
 
   append_to_output_buffer(ob, "+OK\r\n", 5);
   return;
@@ -1049,7 +1155,7 @@ void rpush_command(CommandContext *ctx) {
   }
 
   r_obj *o = hash_table_get(db, arg_values[1]);
-  if (o != NULL && o->type == LIST) {
+  if (o != NULL && o->type != LIST) {
     char *msg = "-WRONGTYPE Operation against a key holding "
                 "the wrong kind of value\r\n";
     append_to_output_buffer(ob, msg, strlen(msg));
@@ -1058,15 +1164,18 @@ void rpush_command(CommandContext *ctx) {
 
   if (!o) {
     o = create_list_object();
-    hash_table_set(db, arg_values[1], o);
+    if (hash_table_set(db, arg_values[1], o) != 0) {
+      free_object(o);
+      append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+      return;
+    }
   }
 
   int j;
   List *list = (List *)o->data;
 
   for (j = 2; j < arg_count; j++) {
-    list_ins_node_tail(
-        list, create_string_object(arg_values[j]->data, arg_values[j]->length));
+    list_push_tail(list, arg_values[j]->data, arg_values[j]->length);
   }
 
   char resp[64];
@@ -1078,7 +1187,6 @@ void rpush_command(CommandContext *ctx) {
 void rpop_command(CommandContext *ctx) {
   Client *client = ctx->client;
   HashTable *db = ctx->db;
-  HashTable *expires = ctx->expires;
   OutputBuffer *ob = ctx->ob;
 
   Bytes **arg_values = client->arg_values;
@@ -1105,7 +1213,7 @@ void rpop_command(CommandContext *ctx) {
 
   if (arg_count == 3) {
     int64_t count;
-    if (try_parse_int64(arg_values[2]->data, &count) == 0) {
+    if (try_parse_int64(arg_values[2]->data, &count) == 0 || count < 0) {
       append_to_output_buffer(
           ob, "-value is out of range, must be positive\r\n", 42);
       return;
@@ -1120,36 +1228,18 @@ void rpop_command(CommandContext *ctx) {
         snprintf(header, sizeof(header), "*%" PRId64 "\r\n", count);
     append_to_output_buffer(ob, header, header_len);
 
+    Bytes value;
     for (int64_t i = 0; i < count; i++) {
-      r_obj *value = list_pop_tail(list);
-      Bytes *value_bytes = (Bytes *)value->data;
-      uint32_t val_len = value_bytes->length;
-
-      char bulk_header[64];
-      int bh_len = snprintf(bulk_header, sizeof(bulk_header),
-                            "$%" PRIu32 "\r\n", val_len);
-      append_to_output_buffer(ob, bulk_header, bh_len);
-      append_to_output_buffer(ob, value_bytes->data, val_len);
-      append_to_output_buffer(ob, "\r\n", 2);
-
-      free_object(value);
+      list_index(list, -1, &value);
+      list_reply_element(ob, &value);
+      list_trim(list, 0, 1);
     }
   } else {
-    r_obj *value = list_pop_tail(list);
-
-    if (value) {
-      Bytes *value_bytes = (Bytes *)value->data;
-      uint32_t val_len = value_bytes->length;
-
-      char bulk_header[64];
-      int bh_len = snprintf(bulk_header, sizeof(bulk_header),
-                            "$%" PRIu32 "\r\n", val_len);
-
-      append_to_output_buffer(ob, bulk_header, bh_len);
-      append_to_output_buffer(ob, value_bytes->data, val_len);
-      append_to_output_buffer(ob, "\r\n", 2);
+    Bytes value;
 
-      free_object(value);
+    if (list_index(list, -1, &value)) {
+      list_reply_element(ob, &value);
+      list_trim(list, 0, 1);
     } else {
       append_to_output_buffer(ob, "$-1\r\n", 5);
       return;
@@ -1157,7 +1247,6 @@ void rpop_command(CommandContext *ctx) {
   }
   if (list->size == 0) {
     hash_table_del(db, arg_values[1]);
-    hash_table_del(expires, arg_values[1]);
   }
 
   return;
@@ -1166,7 +1255,6 @@ void rpop_command(CommandContext *ctx) {
 void lpop_command(CommandContext *ctx) {
   Client *client = ctx->client;
   HashTable *db = ctx->db;
-  HashTable *expires = ctx->expires;
   OutputBuffer *ob = ctx->ob;
 
   Bytes **arg_values = client->arg_values;
@@ -1193,7 +1281,7 @@ void lpop_command(CommandContext *ctx) {
 
   if (arg_count == 3) {
     int64_t count;
-    if (try_parse_int64(arg_values[2]->data, &count) == 0) {
+    if (try_parse_int64(arg_values[2]->data, &count) == 0 || count < 0) {
       append_to_output_buffer(
           ob, "-value is out of range, must be positive\r\n", 42);
       return;
@@ -1208,36 +1296,20 @@ void lpop_command(CommandContext *ctx) {
         snprintf(header, sizeof(header), "*%" PRId64 "\r\n", count);
     append_to_output_buffer(ob, header, header_len);
 
-    for (int64_t i = 0; i < count; i++) {
-      r_obj *value = list_pop_head(list);
-      Bytes *value_bytes = (Bytes *)value->data;
-      uint32_t val_len = value_bytes->length;
+    ListIterator it;
+    Bytes value;
 
-      char bulk_header[64];
-      int bh_len = snprintf(bulk_header, sizeof(bulk_header),
-                            "$%" PRIu32 "\r\n", val_len);
-      append_to_output_buffer(ob, bulk_header, bh_len);
-      append_to_output_buffer(ob, value_bytes->data, val_len);
-      append_to_output_buffer(ob, "\r\n", 2);
-
-      free_object(value);
-    }
+    // Reply from the packed elements first, then drop them in one trim
+    list_iterator_init(list, 0, &it);
+    for (int64_t i = 0; i < count && list_next(&it, &value); i++)
+      list_reply_element(ob, &value);
+    list_trim(list, count, 0);
   } else {
-    r_obj *value = list_pop_head(list);
+    Bytes value;
 
-    if (value) {
-      Bytes *value_bytes = (Bytes *)value->data;
-      uint32_t val_len = value_bytes->length;
-
-      char bulk_header[64];
-      int bh_len = snprintf(bulk_header, sizeof(bulk_header),
-                            "$%" PRIu32 "\r\n", val_len);
-
-      append_to_output_buffer(ob, bulk_header, bh_len);
-      append_to_output_buffer(ob, value_bytes->data, val_len);
-      append_to_output_buffer(ob, "\r\n", 2);
-
-      free_object(value);
+    if (list_index(list, 0, &value)) {
+      list_reply_element(ob, &value);
+      list_trim(list, 1, 0);
     } else {
       append_to_output_buffer(ob, "$-1\r\n", 5);
       return;
@@ -1245,7 +1317,6 @@ void lpop_command(CommandContext *ctx) {
   }
   if (list->size == 0) {
     hash_table_del(db, arg_values[1]);
-    hash_table_del(expires, arg_values[1]);
   }
 
   return;
@@ -1278,10 +1349,9 @@ void scard_command(CommandContext *ctx) {
     return;
   }
 
-  Set *set = (Set *)o->data;
-
   char resp[64];
-  int resp_len = snprintf(resp, sizeof(resp), ":%zu\r\n", set->count);
+  int resp_len =
+      snprintf(resp, sizeof(resp), ":%zu\r\n", set_object_size(o));
   append_to_output_buffer(ob, resp, resp_len);
   return;
 }
@@ -1308,17 +1378,19 @@ void sadd_command(CommandContext *ctx) {
   }
 
   if (o == NULL) {
-    o = create_set_object();
-    hash_table_set(db, arg_values[1], o);
+    o = create_set_object_for(arg_values[2]);
+    if (hash_table_set(db, arg_values[1], o) != 0) {
+      free_object(o);
+      append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+      return;
+    }
   }
 
   int j;
   int count = 0;
 
-  Set *set = (Set *)o->data;
-
   for (j = 2; j < arg_count; j++) {
-    if (set_add(set, arg_values[j]) == 1) {
+    if (set_object_add(o, arg_values[j]) == 1) {
       count++;
     }
   }
@@ -1332,7 +1404,6 @@ void sadd_command(CommandContext *ctx) {
 void srem_command(CommandContext *ctx) {
   Client *client = ctx->client;
   HashTable *db = ctx->db;
-  HashTable *expires = ctx->expires;
   OutputBuffer *ob = ctx->ob;
 
   Bytes **arg_values = client->arg_values;
@@ -1357,18 +1428,15 @@ void srem_command(CommandContext *ctx) {
     return;
   }
 
-  Set *set = (Set *)o->data;
-
   int j;
   int count = 0;
   for (j = 2; j < arg_count; j++) {
-    if (set_rem(set, arg_values[j]) == 1)
+    if (set_object_rem(o, arg_values[j]) == 1)
       count++;
   }
 
-  if (set->count == 0) {
+  if (set_object_size(o) == 0) {
     hash_table_del(db, arg_values[1]);
-    hash_table_del(expires, arg_values[1]);
   }
 
   char resp[64];
@@ -1377,6 +1445,71 @@ void srem_command(CommandContext *ctx) {
   return;
 }
 
+static void sinter_reply_member(OutputBuffer *ob, Bytes *member) {
+  char bulk_header[64];
+  int bh_len = snprintf(bulk_header, sizeof(bulk_header), "$%" PRIu32 "\r\n",
+                        member->length);
+
+  append_to_output_buffer(ob, bulk_header, bh_len);
+  append_to_output_buffer(ob, member->data, member->length);
+  append_to_output_buffer(ob, "\r\n", 2);
+}
+
+// Every input is an intset. The smallest one is walked in order and each
+// other set keeps a cursor that only moves forward, intset_seek merges or
+// gallops depending on how far the next candidate is. Returns -1 when out
+// of memory.
+static long sinter_intsets(r_obj **sets, int n, r_obj *small,
+                           OutputBuffer *ob) {
+  IntSet *base = (IntSet *)small->data;
+  uint32_t *pos;
+
+  if ((pos = (uint32_t *)calloc(n, sizeof(uint32_t))) == NULL)
+    return -1;
+
+  long count = 0;
+
+  for (uint32_t i = 0; i < intset_len(base); i++) {
+    int64_t value = intset_get(base, i);
+    int in_all = 1;
+
+    for (int j = 0; j < n; j++) {
+      if (sets[j] == small)
+        continue;
+
+      IntSet *is = (IntSet *)sets[j]->data;
+      pos[j] = intset_seek(is, pos[j], value);
+
+      // Nothing this large is left in one of the sets, so nothing after it
+      if (pos[j] == intset_len(is)) {
+        free(pos);
+        return count;
+      }
+
+      if (intset_get(is, pos[j]) != value) {
+        in_all = 0;
+        break;
+      }
+    }
+
+    if (in_all) {
+      char buf[OBJ_INT_BUF];
+      Bytes member;
+
+      member.length =
+          (uint32_t)snprintf(buf, sizeof(buf), "%" PRId64, value);
+      member.flags = 0;
+      member.data = buf;
+      sinter_reply_member(ob, &member);
+
+      count++;
+    }
+  }
+
+  free(pos);
+  return count;
+}
+
 void sinter_command(CommandContext *ctx) {
   Client *client = ctx->client;
   HashTable *db = ctx->db;
@@ -1390,15 +1523,16 @@ void sinter_command(CommandContext *ctx) {
     return;
   }
 
-  Set **sets;
-  if ((sets = (Set **)malloc((arg_count - 1) * sizeof(Set *))) == NULL) {
+  r_obj **sets;
+  if ((sets = (r_obj **)malloc((arg_count - 1) * sizeof(r_obj *))) == NULL) {
     append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
     return;
   }
 
   int j;
-  int card = 0;
-  Set *small = NULL;
+  size_t card = 0;
+  r_obj *small = NULL;
+  int all_intsets = 1;
 
   for (j = 1; j < arg_count; j++) {
     r_obj *o = hash_table_get(db, arg_values[j]);
@@ -1417,63 +1551,76 @@ void sinter_command(CommandContext *ctx) {
       return;
     }
 
-    Set *set = (Set *)o->data;
-    if (set->size == 0) {
+    size_t size = set_object_size(o);
+    if (size == 0) {
       free(sets);
       append_to_output_buffer(ob, "~0\r\n", 4);
       return;
     }
 
-    sets[j - 1] = set;
+    sets[j - 1] = o;
+
+    if (o->encoding != OBJ_ENCODING_INTSET)
+      all_intsets = 0;
 
-    if (small == NULL || set->size < card) {
-      small = set;
-      card = set->size;
+    if (small == NULL || size < card) {
+      small = o;
+      card = size;
     }
   }
 
-  size_t count = 0;
+  // Members are rendered aside first so the header can carry the final count
+  OutputBuffer *reply = ob;
+  if ((ob = create_output_buffer(-1)) == NULL) {
+    free(sets);
+    append_to_output_buffer(reply, "-ERR out of memory\r\n", 20);
+    return;
+  }
+
+  long count = 0;
 
-  for (size_t i = 0; i <= small->size; i++) {
-    Node *entry = small->buckets[i];
-    while (entry) {
+  if (all_intsets) {
+    count = sinter_intsets(sets, arg_count - 1, small, ob);
+  } else {
+    SetObjectIterator it;
+    set_object_iterator_init(small, &it);
+
+    Bytes *member;
+    while ((member = set_object_next(&it)) != NULL) {
       int in_all = 1;
 
       for (int j = 0; j < arg_count - 1; j++) {
         if (sets[j] == small)
           continue;
 
-        if (!set_is_member(sets[j], entry->key)) {
+        if (!set_object_is_member(sets[j], member)) {
           in_all = 0;
           break;
         }
       }
 
       if (in_all) {
-        Bytes *val_bytes = entry->key;
-        char *val = val_bytes->data;
-        uint32_t val_len = val_bytes->length;
-
-        char bulk_header[64];
-        int bh_len = snprintf(bulk_header, sizeof(bulk_header),
-                              "$%" PRIu32 "\r\n", val_len);
-
-        append_to_output_buffer(ob, bulk_header, bh_len);
-        append_to_output_buffer(ob, val, val_len);
-        append_to_output_buffer(ob, "\r\n", 2);
-
+        sinter_reply_member(ob, member);
         count++;
       }
-
-      entry = entry->next;
     }
+
+    set_object_iterator_release(&it);
   }
 
   free(sets);
 
+  if (count < 0) {
+    free_output_buffer(ob);
+    append_to_output_buffer(reply, "-ERR out of memory\r\n", 20);
+    return;
+  }
+
   char header[64];
-  int header_len = snprintf(header, sizeof(header), "~%zu\r\n", count);
-  write(ob->fd, header, header_len);
+  int header_len = snprintf(header, sizeof(header), "~%ld\r\n", count);
+  append_to_output_buffer(reply, header, header_len);
+  output_buffer_splice(reply, ob);
+  free_output_buffer(ob);
   return;
 }
 
@@ -1504,7 +1651,7 @@ void sismember_command(CommandContext *ctx) {
     return;
   }
 
-  int is_member = set_is_member((Set *)o->data, arg_values[2]);
+  int is_member = set_object_is_member(o, arg_values[2]);
   char resp[64];
   int resp_len = snprintf(resp, sizeof(resp), ":%d\r\n", is_member);
   append_to_output_buffer(ob, resp, resp_len);
@@ -1538,34 +1685,32 @@ void smembers_command(CommandContext *ctx) {
     return;
   }
 
-  Set *set = (Set *)o->data;
-  size_t count = set->count;
+  size_t count = set_object_size(o);
 
   char header[64];
   int header_len = snprintf(header, sizeof(header), "*%zu\r\n", count);
   append_to_output_buffer(ob, header, header_len);
 
-  int j;
-  for (j = 0; j < set->size; j++) {
-    Node *entry = set->buckets[j];
-    while (entry) {
-      Bytes *value_bytes = entry->key;
+  SetObjectIterator it;
+  set_object_iterator_init(o, &it);
 
-      char *val = value_bytes->data;
-      uint32_t val_len = value_bytes->length;
+  Bytes *value_bytes;
+  while ((value_bytes = set_object_next(&it)) != NULL) {
 
-      char bulk_header[64];
-      int bh_len = snprintf(bulk_header, sizeof(bulk_header),
-                            "$%" PRIu32 "\r\n", val_len);
+    char *val = value_bytes->data;
+    uint32_t val_len = value_bytes->length;
 
-      append_to_output_buffer(ob, bulk_header, bh_len);
-      append_to_output_buffer(ob, val, val_len);
-      append_to_output_buffer(ob, "\r\n", 2);
+    char bulk_header[64];
+    int bh_len = snprintf(bulk_header, sizeof(bulk_header), "$%" PRIu32 "\r\n",
+                          val_len);
 
-      entry = entry->next;
-    }
+    append_to_output_buffer(ob, bulk_header, bh_len);
+    append_to_output_buffer(ob, val, val_len);
+    append_to_output_buffer(ob, "\r\n", 2);
   }
 
+  set_object_iterator_release(&it);
+
   return;
 }
 
@@ -1592,8 +1737,12 @@ void hset_command(CommandContext *ctx) {
   }
 
   if (o == NULL) {
-    o = create_hash_object();
-    hash_table_set(db, arg_values[1], o);
+    o = create_hash_listpack_object();
+    if (hash_table_set(db, arg_values[1], o) != 0) {
+      free_object(o);
+      append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+      return;
+    }
   }
 
   int count = 0;
@@ -1601,8 +1750,7 @@ void hset_command(CommandContext *ctx) {
   for (j = 2; j < arg_count; j++) {
     Bytes *field = arg_values[j];
     Bytes *value = arg_values[++j];
-    hash_table_set((HashTable *)o->data, field,
-                   create_string_object(value->data, value->length));
+    hash_object_set(o, field, value->data, value->length);
     count++;
   }
 
@@ -1638,23 +1786,26 @@ void hget_command(CommandContext *ctx) {
     return;
   }
 
-  HashTable *hash = (HashTable *)o->data;
-  r_obj *hash_o = hash_table_get(hash, arg_values[2]);
-  if (hash_o == NULL) {
+  Bytes value;
+  r_obj *hash_o;
+  if (!hash_object_get(o, arg_values[2], &value, &hash_o)) {
     append_to_output_buffer(ob, "-ERR args\r\n", 11);
     return;
   }
 
-  Bytes *value_bytes = (Bytes *)hash_o->data;
-  uint32_t val_len = value_bytes->length;
-  char *val = value_bytes->data;
+  uint32_t val_len = value.length;
+  char *val = value.data;
 
   char bulk_header[64];
   int bh_len =
       snprintf(bulk_header, sizeof(bulk_header), "$%" PRIu32 "\r\n", val_len);
 
   append_to_output_buffer(ob, bulk_header, bh_len);
-  append_to_output_buffer(ob, val, val_len);
+  // Listpack values live inside the hash and are copied
+  if (hash_o != NULL)
+    append_ref_to_output_buffer(ob, hash_o, val, val_len);
+  else
+    append_to_output_buffer(ob, val, val_len);
   append_to_output_buffer(ob, "\r\n", 2);
 
   return;
@@ -1686,8 +1837,6 @@ void hmget_command(CommandContext *ctx) {
     return;
   }
 
-  HashTable *hash = (HashTable *)o->data;
-
   char header[64];
   int header_len = snprintf(header, sizeof(header), "*%d\r\n", arg_count - 2);
   append_to_output_buffer(ob, header, header_len);
@@ -1695,24 +1844,25 @@ void hmget_command(CommandContext *ctx) {
   for (int j = 2; j < arg_count; j++) {
     Bytes *field = arg_values[j];
 
-    r_obj *field_o = hash_table_get(hash, field);
-
-    if (field_o == NULL) {
+    Bytes value;
+    r_obj *field_o;
+    if (!hash_object_get(o, field, &value, &field_o)) {
       append_to_output_buffer(ob, "_\r\n", 3);
       continue;
     }
 
-    Bytes *value_bytes = (Bytes *)field_o->data;
-
-    uint32_t val_len = value_bytes->length;
-    char *val = value_bytes->data;
+    uint32_t val_len = value.length;
+    char *val = value.data;
 
     char bulk_header[64];
     int bh_len =
         snprintf(bulk_header, sizeof(bulk_header), "$%" PRIu32 "\r\n", val_len);
 
     append_to_output_buffer(ob, bulk_header, bh_len);
-    append_to_output_buffer(ob, val, val_len);
+    if (field_o != NULL)
+      append_ref_to_output_buffer(ob, field_o, val, val_len);
+    else
+      append_to_output_buffer(ob, val, val_len);
     append_to_output_buffer(ob, "\r\n", 2);
   }
 
@@ -1749,19 +1899,32 @@ void hincrby_command(CommandContext *ctx) {
   }
 
   if (o == NULL) {
-    o = create_hash_object();
-    hash_table_set(db, arg_values[1], o);
+    o = create_hash_listpack_object();
+    if (hash_table_set(db, arg_values[1], o) != 0) {
+      free_object(o);
+      append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+      return;
+    }
   }
 
-  HashTable *hash = (HashTable *)o->data;
-
-  r_obj *field_o = hash_table_get(hash, arg_values[2]);
+  Bytes value;
+  r_obj *field_o;
   int64_t current_val = 0;
 
-  if (field_o != NULL) {
-    Bytes *bytes = (Bytes *)field_o->data;
+  if (hash_object_get(o, arg_values[2], &value, &field_o)) {
+    // Listpack values aren't NUL terminated, anything this long isn't a
+    // number anyway
+    char buf[64];
+
+    if (value.length >= sizeof(buf)) {
+      append_to_output_buffer(ob, "-ERR hash value is not an integer\r\n", 35);
+      return;
+    }
+
+    memcpy(buf, value.data, value.length);
+    buf[value.length] = '\0';
 
-    if (try_parse_int64(bytes->data, &current_val) == 0) {
+    if (try_parse_int64(buf, &current_val) == 0) {
       append_to_output_buffer(ob, "-ERR hash value is not an integer\r\n", 35);
       return;
     }
@@ -1778,8 +1941,7 @@ void hincrby_command(CommandContext *ctx) {
 
   char num_str[64];
   int len = snprintf(num_str, sizeof(num_str), "%" PRId64, new_val);
-  r_obj *new_obj = create_string_object(num_str, len);
-  hash_table_set(hash, arg_values[2], new_obj);
+  hash_object_set(o, arg_values[2], num_str, (uint32_t)len);
 
   char resp[64];
   int resp_len = snprintf(resp, sizeof(resp), ":%" PRId64 "\r\n", new_val);
@@ -1872,12 +2034,14 @@ void zadd_command(CommandContext *ctx) {
       return;
     }
 
-    o = create_zset_object();
-    hash_table_set(db, arg_values[1], o);
+    o = create_zset_zpack_object();
+    if (hash_table_set(db, arg_values[1], o) != 0) {
+      free_object(o);
+      append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+      return;
+    }
   }
 
-  ZSet *zs = (ZSet *)o->data;
-
   int added = 0;
   int changed = 0;
   int processed = 0;
@@ -1888,12 +2052,9 @@ void zadd_command(CommandContext *ctx) {
     Bytes *member = arg_values[++i];
 
     if (flags & ZADD_SET_INCR) {
-      r_obj *score_o = hash_table_get(zs->dict, member);
       double current_score = 0.0;
 
-      if (score_o != NULL) {
-        current_score = *(double *)score_o->data;
-      } else {
+      if (!zset_object_score(o, member, &current_score)) {
         if (xx) {
           append_to_output_buffer(ob, "_\r\n", 3);
           return;
@@ -1902,7 +2063,7 @@ void zadd_command(CommandContext *ctx) {
 
       double new_score = current_score + score;
 
-      zset_add(zs, member, new_score);
+      zset_object_add(o, member, new_score);
       char num_str[64];
 
       int len = snprintf(num_str, sizeof(num_str), "%.17g", new_score);
@@ -1917,25 +2078,24 @@ void zadd_command(CommandContext *ctx) {
       return;
     }
 
-    r_obj *member_o = hash_table_get(zs->dict, member);
+    double current_score;
+    int exists = zset_object_score(o, member, &current_score);
 
-    if (nx && member_o != NULL)
+    if (nx && exists)
       continue;
-    if (xx && member_o == NULL)
+    if (xx && !exists)
       continue;
 
-    if (member_o != NULL) {
-      double current_score = *(double *)member_o->data;
-
+    if (exists) {
       if (gt && score <= current_score)
         continue;
       if (lt && score >= current_score)
         continue;
 
-      zset_add(zs, member, score);
+      zset_object_add(o, member, score);
       changed++;
     } else {
-      zset_add(zs, member, score);
+      zset_object_add(o, member, score);
       added++;
     }
   }
@@ -1956,7 +2116,6 @@ void zadd_command(CommandContext *ctx) {
 void zrem_command(CommandContext *ctx) {
   Client *client = ctx->client;
   HashTable *db = ctx->db;
-  HashTable *expires = ctx->expires;
   OutputBuffer *ob = ctx->ob;
 
   Bytes **arg_values = client->arg_values;
@@ -1982,30 +2141,15 @@ void zrem_command(CommandContext *ctx) {
     return;
   }
 
-  ZSet *zs = (ZSet *)o->data;
-
   int j;
   int deleted_count = 0;
   for (j = 2; j < arg_count; j++) {
-    Bytes *member = arg_values[j];
-
-    r_obj *score_o = hash_table_get(zs->dict, member);
-
-    if (score_o == NULL) {
-      continue;
-    }
-
-    double score = *(double *)score_o->data;
-
-    if (zsl_remove(zs->zsl, score, member) == 1 &&
-        hash_table_del(zs->dict, member) == 1) {
+    if (zset_object_rem(o, arg_values[j]))
       deleted_count++;
-    }
   }
 
-  if (zs->dict->count == 0) {
+  if (zset_object_size(o) == 0) {
     hash_table_del(db, arg_values[1]);
-    hash_table_del(expires, arg_values[1]);
   }
 
   char num_str[64];
@@ -2042,10 +2186,9 @@ void zcard_command(CommandContext *ctx) {
     return;
   }
 
-  ZSet *zs = (ZSet *)o->data;
-
   char num_str[64];
-  int num_len = snprintf(num_str, sizeof(num_str), ":%zu\r\n", zs->dict->count);
+  int num_len =
+      snprintf(num_str, sizeof(num_str), ":%zu\r\n", zset_object_size(o));
   append_to_output_buffer(ob, num_str, num_len);
   return;
 }
@@ -2134,41 +2277,44 @@ void zrange_command(CommandContext *ctx) {
     return;
   }
 
-  ZSet *zs = (ZSet *)o->data;
-  ZSkipList *zsl = zs->zsl;
-  ZSkipListNode *node;
+  ZSetIterator it;
+  Bytes member;
+  double score;
   int count = 0;
 
+  // Elements are rendered aside first so the header can carry the final count
+  OutputBuffer *reply = ob;
+  if ((ob = create_output_buffer(-1)) == NULL) {
+    append_to_output_buffer(reply, "-ERR out of memory\r\n", 20);
+    return;
+  }
+
   if (flags & ZRANGE_SET_BYSCORE) {
     double start = atof(arg_values[2]->data);
     double stop = atof(arg_values[3]->data);
 
-    if (reverse)
-      node = zsl_last_in_range(zsl, stop);
-    else
-      node = zsl_first_in_range(zsl, start);
+    zset_iterator_score(o, reverse ? stop : start, reverse, &it);
 
-    while (node && limit_offset) {
-      if (reverse ? (node->score < start) : (node->score > stop)) {
-        node = NULL;
+    int done = 0;
+    while (limit_offset && zset_next(&it, &member, &score)) {
+      if (reverse ? (score < start) : (score > stop)) {
+        done = 1;
         break;
       }
 
-      node = zsl_next_node(node, reverse);
       limit_offset--;
     }
 
-    while (node && (limit_count != 0)) {
-      if (reverse ? (node->score < start) : (node->score > stop)) {
+    while (!done && (limit_count != 0) && zset_next(&it, &member, &score)) {
+      if (reverse ? (score < start) : (score > stop)) {
         break;
       }
 
-      zrange_emit_node(ob, node, with_scores);
+      zrange_emit(ob, &member, score, with_scores);
       if (with_scores)
         count++;
       count++;
 
-      node = zsl_next_node(node, reverse);
       if (limit_count > 0)
         limit_count--;
     }
@@ -2178,19 +2324,21 @@ void zrange_command(CommandContext *ctx) {
     Bytes *max_arg = arg_values[3];
 
     if (min_arg->length == 1 && min_arg->data[0] == '-') {
-      node = zsl->head->level[0].forward;
+      zset_iterator_rank(o, 0, reverse, &it);
 
     } else {
       if (min_arg->length < 1) {
         append_to_output_buffer(
-            ob, "-ERR min or max not valid string range item\r\n", 46);
+            reply, "-ERR min or max not valid string range item\r\n", 46);
+        free_output_buffer(ob);
         return;
       }
 
       int inclusive = (min_arg->data[0] == '[');
       if (!inclusive && min_arg->data[0] != '(') {
         append_to_output_buffer(
-            ob, "-ERR min or max not valid string range item\r\n", 46);
+            reply, "-ERR min or max not valid string range item\r\n", 46);
+        free_output_buffer(ob);
         return;
       }
 
@@ -2199,17 +2347,14 @@ void zrange_command(CommandContext *ctx) {
       min_parsed.data = min_arg->data + 1;
       min_parsed.length = min_arg->length - 1;
 
-      if (reverse)
-        node = zsl_last_in_lex_range(zsl, &min_parsed, inclusive);
-      else
-        node = zsl_first_in_lex_range(zsl, &min_parsed, inclusive);
+      zset_iterator_lex(o, &min_parsed, inclusive, reverse, &it);
     }
 
     if (reverse && (max_arg->length == 1 && max_arg->data[0] == '+')) {
-      node = zsl->tail;
+      zset_iterator_rank(o, (long)zset_object_size(o) - 1, reverse, &it);
     }
 
-    while (node && limit_count > 0) {
+    while (limit_count != 0 && zset_next(&it, &member, &score)) {
       if (reverse) {
         if (!(min_arg->length == 1 && min_arg->data[0] == '-')) {
           Bytes min_val;
@@ -2217,7 +2362,7 @@ void zrange_command(CommandContext *ctx) {
           min_val.length = min_arg->length - 1;
           int inclusive = (min_arg->data[0] == '[');
 
-          int cmp = bytes_compare(node->element, &min_val);
+          int cmp = bytes_compare(&member, &min_val);
 
           if (inclusive ? (cmp < 0) : (cmp <= 0))
             break;
@@ -2229,16 +2374,18 @@ void zrange_command(CommandContext *ctx) {
           max_val.length = max_arg->length - 1;
           int inclusive = (max_arg->data[0] == '[');
 
-          int cmp = bytes_compare(node->element, &max_val);
+          int cmp = bytes_compare(&member, &max_val);
 
           if (inclusive ? (cmp > 0) : (cmp >= 0))
             break;
         }
       }
 
-      zrange_emit_node(ob, node, 0);
-      node = zsl_next_node(node, reverse);
-      limit_count--;
+      zrange_emit(ob, &member, score, 0);
+      count++;
+
+      if (limit_count > 0)
+        limit_count--;
     }
 
   } else {
@@ -2249,10 +2396,12 @@ void zrange_command(CommandContext *ctx) {
     if (try_parse_int64(arg_values[2]->data, &start) == 0 ||
         try_parse_int64(arg_values[3]->data, &stop) == 0) {
       append_to_output_buffer(
-          ob, "-value is not an integer or out of range\r\n", 42);
+          reply, "-value is not an integer or out of range\r\n", 42);
+      free_output_buffer(ob);
+      return;
     }
 
-    size_t llen = zsl->length;
+    size_t llen = zset_object_size(o);
 
     if (start < 0)
       start = llen + start;
@@ -2262,7 +2411,8 @@ void zrange_command(CommandContext *ctx) {
       start = 0;
 
     if (start > stop || start >= llen) {
-      append_to_output_buffer(ob, "*0\r\n", 4);
+      append_to_output_buffer(reply, "*0\r\n", 4);
+      free_output_buffer(ob);
       return;
     }
 
@@ -2270,25 +2420,23 @@ void zrange_command(CommandContext *ctx) {
       stop = llen - 1;
     long range_len = stop - start + 1;
 
-    if (reverse)
-      node = zsl_get_element_by_rank(zsl, stop);
-    else
-      node = zsl_get_element_by_rank(zsl, start);
+    zset_iterator_rank(o, reverse ? stop : start, reverse, &it);
 
-    while (node && range_len > 0) {
-      zrange_emit_node(ob, node, with_scores);
+    while (range_len > 0 && zset_next(&it, &member, &score)) {
+      zrange_emit(ob, &member, score, with_scores);
       if (with_scores)
         count++;
       count++;
 
-      node = zsl_next_node(node, reverse);
       range_len--;
     }
   }
 
   char header[64];
   int header_len = snprintf(header, sizeof(header), "*%d\r\n", count);
-  write(ob->fd, header, header_len);
+  append_to_output_buffer(reply, header, header_len);
+  output_buffer_splice(reply, ob);
+  free_output_buffer(ob);
 }
 
 void zscore_command(CommandContext *ctx) {
@@ -2315,15 +2463,12 @@ void zscore_command(CommandContext *ctx) {
     return;
   }
 
-  ZSet *zs = (ZSet *)o->data;
-  r_obj *score_o = hash_table_get(zs->dict, arg_values[2]);
-  if (score_o == NULL) {
+  double score;
+  if (!zset_object_score(o, arg_values[2], &score)) {
     append_to_output_buffer(ob, "$-1\r\n", 5);
     return;
   }
 
-  double score = *(double *)score_o->data;
-
   char resp[128];
   int resp_len = snprintf(resp, sizeof(resp), ",%.17g\r\n", score);
   append_to_output_buffer(ob, resp, resp_len);
@@ -2354,20 +2499,10 @@ void zrank_command(CommandContext *ctx) {
     return;
   }
 
-  ZSet *zs = (ZSet *)o->data;
-
-  r_obj *score_o = hash_table_get(zs->dict, arg_values[2]);
-  if (score_o == NULL) {
-    append_to_output_buffer(ob, "$-1\r\n", 5);
-    return;
-  }
-
-  double score = *(double *)score_o->data;
-  unsigned long rank = zsl_get_rank(zs->zsl, score, arg_values[2]);
-  if (rank > 0) {
-    rank--;
+  long rank = zset_object_rank(o, arg_values[2]);
+  if (rank >= 0) {
     char resp[64];
-    int resp_len = snprintf(resp, sizeof(resp), ":%lu\r\n", rank);
+    int resp_len = snprintf(resp, sizeof(resp), ":%ld\r\n", rank);
     append_to_output_buffer(ob, resp, resp_len);
   } else {
     append_to_output_buffer(ob, "$-1\r\n", 5);
@@ -2435,7 +2570,11 @@ void vidx_create_command(CommandContext *ctx) {
     ef_construction = M;
 
   r_obj *o = create_hnsw_object(metric, M, ef_construction, dimension);
-  hash_table_set(vector_indices, arg_values[1], o);
+  if (hash_table_set(vector_indices, arg_values[1], o) != 0) {
+    free_object(o);
+    append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+    return;
+  }
 
   append_to_output_buffer(ob, "+OK\r\n", 5);
   return;
@@ -2467,7 +2606,6 @@ void vidx_drop_command(CommandContext *ctx) {
 
 void vidx_list(CommandContext *ctx) {
   Client *client = ctx->client;
-  HashTable *vector_indices = ctx->vector_indices;
   OutputBuffer *ob = ctx->ob;
 
   int arg_count = client->arg_count;
@@ -2477,17 +2615,31 @@ void vidx_list(CommandContext *ctx) {
     return;
   }
 
+  // Runs with every shard parked, indices are spread over all of them
+  HashTable *tables[SHARDS_MAX];
+  int table_count = 1;
+  tables[0] = ctx->vector_indices;
+
+  if (shard_count > 1) {
+    table_count = shard_count;
+    for (int i = 0; i < shard_count; i++)
+      tables[i] = shards[i].vector_indices;
+  }
+
+  size_t total = 0;
+  for (int i = 0; i < table_count; i++)
+    total += tables[i]->count;
+
   char header[64];
-  int header_len =
-      snprintf(header, sizeof(header), "*%ld\r\n", vector_indices->count);
+  int header_len = snprintf(header, sizeof(header), "*%zu\r\n", total);
   append_to_output_buffer(ob, header, header_len);
 
-  int j;
-  for (j = 0; j < vector_indices->size; j++) {
-    Node *node = vector_indices->buckets[j];
+  for (int i = 0; i < table_count; i++) {
+    HashTableIterator it;
+    hash_table_iterator_init(tables[i], &it);
 
-    while (node) {
-      Node *next = node->next;
+    Node *node;
+    while ((node = hash_table_next(&it)) != NULL) {
       Bytes *key = node->key;
 
       char bulk_header[64];
@@ -2496,8 +2648,9 @@ void vidx_list(CommandContext *ctx) {
       append_to_output_buffer(ob, bulk_header, bh_len);
       append_to_output_buffer(ob, key->data, key->length);
       append_to_output_buffer(ob, "\r\n", 2);
-      node = next;
     }
+
+    hash_table_iterator_release(&it);
   }
 
   return;
@@ -2572,10 +2725,15 @@ printf("[DEBUG] DB is deleting vector at addr: %p\n", old_o->data); // <--- TRAP
     hash_table_del(db, arg_values[2]);
   }
 
-  hnsw_insert(idx, arg_values[2], v);
-
+  // The index shares the vector, it only gets it once the key holds it
   r_obj *vector_o = create_vector_object(v);
-  hash_table_set(db, arg_values[2], vector_o);
+  if (hash_table_set(db, arg_values[2], vector_o) != 0) {
+    free_object(vector_o);
+    append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+    return;
+  }
+
+  hnsw_insert(idx, arg_values[2], v);
 
   append_to_output_buffer(ob, ":1\r\n", 4);
   return;
@@ -2583,10 +2741,20 @@ printf("[DEBUG] DB is deleting vector at addr: %p\n", old_o->data); // <--- TRAP
 
 void save_command(CommandContext *ctx) {
   HashTable *db = ctx->db;
-  HashTable *expires = ctx->expires;
   OutputBuffer *ob = ctx->ob;
 
-  rdb_save(db, expires, "dump.rdb");
+  // Runs with every shard parked, so all keyspaces go in the same file
+  if (shard_count > 1) {
+    HashTable *dbs[SHARDS_MAX];
+
+    for (int i = 0; i < shard_count; i++)
+      dbs[i] = shards[i].db;
+
+    rdb_save_all(dbs, shard_count, "dump.rdb");
+  } else {
+    rdb_save(db, "dump.rdb");
+  }
+
   append_to_output_buffer(ob, "+OK\r\n", 5);
   return;
 }
@@ -2596,3 +2764,358 @@ void ping_command(CommandContext *ctx) {
   append_to_output_buffer(ob, "+PONG\r\n", 7);
   return;
 }
+
+// Latency of a command summed over every shard. The shards keep recording
+// while we read, the result is only approximately consistent.
+static void command_latency_collect(Command *cmd, LatencyHistogram *h) {
+  memset(h, 0, sizeof(*h));
+
+  for (int i = 0; i < shard_count; i++)
+    latency_merge(h, &shards[i].command_latency[cmd - CommandTable]);
+}
+
+static int command_name_lower(Command *cmd, char *buf, size_t size) {
+  size_t len = strlen(cmd->name);
+  if (len >= size)
+    len = size - 1;
+
+  for (size_t i = 0; i < len; i++)
+    buf[i] = tolower((unsigned char)cmd->name[i]);
+  buf[len] = '\0';
+
+  return (int)len;
+}
+
+static void append_bulk_cstring(OutputBuffer *ob, const char *str) {
+  char header[32];
+  size_t len = strlen(str);
+  int header_len = snprintf(header, sizeof(header), "$%zu\r\n", len);
+
+  append_to_output_buffer(ob, header, header_len);
+  append_to_output_buffer(ob, str, len);
+  append_to_output_buffer(ob, "\r\n", 2);
+}
+
+static void append_integer(OutputBuffer *ob, uint64_t value) {
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), ":%" PRIu64 "\r\n", value);
+  append_to_output_buffer(ob, buf, len);
+}
+
+// INFO [stats|keyspace|commandstats]
+void info_command(CommandContext *ctx) {
+  Client *client = ctx->client;
+  OutputBuffer *ob = ctx->ob;
+
+  if (client->arg_count > 2) {
+    append_to_output_buffer(ob, "-ERR syntax error\r\n", 19);
+    return;
+  }
+
+  int stats = 1;
+  int keyspace = 1;
+  int commandstats = 1;
+
+  if (client->arg_count == 2) {
+    const char *section = client->arg_values[1]->data;
+    int all = strcasecmp(section, "all") == 0 ||
+              strcasecmp(section, "everything") == 0;
+
+    stats = all || strcasecmp(section, "stats") == 0;
+    keyspace = all || strcasecmp(section, "keyspace") == 0;
+    commandstats = all || strcasecmp(section, "commandstats") == 0;
+  }
+
+  size_t size = 256 + (size_t)command_count * 192;
+  size_t len = 0;
+  char *info;
+  LatencyHistogram *h;
+
+  if ((info = malloc(size)) == NULL ||
+      (h = malloc(sizeof(LatencyHistogram))) == NULL) {
+    free(info);
+    append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+    return;
+  }
+
+  if (stats) {
+    uint64_t commands = 0;
+    uint64_t ops_per_sec = 0;
+
+    for (int i = 0; i < shard_count; i++) {
+      commands += __atomic_load_n(&shards[i].stat_commands, __ATOMIC_RELAXED);
+      ops_per_sec +=
+          __atomic_load_n(&shards[i].stat_ops_per_sec, __ATOMIC_RELAXED);
+    }
+
+    len += snprintf(info + len, size - len,
+                    "# Stats\r\ntotal_commands_processed:%" PRIu64
+                    "\r\ninstantaneous_ops_per_sec:%" PRIu64 "\r\n",
+                    commands, ops_per_sec);
+  }
+
+  // Each shard publishes its counts after every command and cron run
+  if (keyspace) {
+    uint64_t keys = 0;
+    uint64_t expires = 0;
+
+    for (int i = 0; i < shard_count; i++) {
+      keys += __atomic_load_n(&shards[i].stat_keys, __ATOMIC_RELAXED);
+      expires += __atomic_load_n(&shards[i].stat_expires, __ATOMIC_RELAXED);
+    }
+
+    len += snprintf(info + len, size - len,
+                    "%s# Keyspace\r\ndb0:keys=%" PRIu64 ",expires=%" PRIu64
+                    "\r\n",
+                    len > 0 ? "\r\n" : "", keys, expires);
+  }
+
+  if (commandstats)
+    len += snprintf(info + len, size - len, "%s# Commandstats\r\n",
+                    len > 0 ? "\r\n" : "");
+
+  for (int i = 0; i < command_count && commandstats; i++) {
+    Command *cmd = &CommandTable[i];
+    command_latency_collect(cmd, h);
+
+    if (h->calls == 0)
+      continue;
+
+    char name[32];
+    command_name_lower(cmd, name, sizeof(name));
+
+    double usec = latency_usec(h->total);
+    len += snprintf(info + len, size - len,
+                    "cmdstat_%s:calls=%" PRIu64
+                    ",usec=%.0f,usec_per_call=%.2f,p50=%.3f,p99=%.3f,"
+                    "p999=%.3f\r\n",
+                    name, h->calls, usec, usec / (double)h->calls,
+                    latency_percentile(h, 50), latency_percentile(h, 99),
+                    latency_percentile(h, 99.9));
+  }
+
+  char header[32];
+  int header_len = snprintf(header, sizeof(header), "$%zu\r\n", len);
+  append_to_output_buffer(ob, header, header_len);
+  append_to_output_buffer(ob, info, len);
+  append_to_output_buffer(ob, "\r\n", 2);
+
+  free(h);
+  free(info);
+}
+
+// Cumulative counts at power of two microsecond bounds, like Redis does
+static void latency_histogram_reply(OutputBuffer *ob, Command *cmd,
+                                    LatencyHistogram *h) {
+  uint64_t counts[64] = {0};
+  int first = 64, last = -1;
+
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    if (h->buckets[i] == 0)
+      continue;
+
+    double usec = latency_bucket_usec(i);
+    int bound = 0;
+    while (bound < 63 && (double)(1ULL << bound) < usec)
+      bound++;
+
+    counts[bound] += h->buckets[i];
+    if (bound < first)
+      first = bound;
+    if (bound > last)
+      last = bound;
+  }
+
+  char name[32];
+  char buf[64];
+  command_name_lower(cmd, name, sizeof(name));
+  append_bulk_cstring(ob, name);
+
+  append_to_output_buffer(ob, "*12\r\n", 5);
+  append_bulk_cstring(ob, "calls");
+  append_integer(ob, h->calls);
+  append_bulk_cstring(ob, "usec");
+  append_integer(ob, (uint64_t)latency_usec(h->total));
+
+  const char *labels[] = {"p50", "p99", "p999"};
+  const double percentiles[] = {50, 99, 99.9};
+  for (int i = 0; i < 3; i++) {
+    append_bulk_cstring(ob, labels[i]);
+    snprintf(buf, sizeof(buf), "%.3f", latency_percentile(h, percentiles[i]));
+    append_bulk_cstring(ob, buf);
+  }
+
+  append_bulk_cstring(ob, "histogram_usec");
+
+  int pairs = last < 0 ? 0 : last - first + 1;
+  int len = snprintf(buf, sizeof(buf), "*%d\r\n", pairs * 2);
+  append_to_output_buffer(ob, buf, len);
+
+  uint64_t cumulative = 0;
+  for (int bound = first; bound <= last; bound++) {
+    cumulative += counts[bound];
+    append_integer(ob, 1ULL << bound);
+    append_integer(ob, cumulative);
+  }
+}
+
+// LATENCY HISTOGRAM [command ...], every command that ran when none is given
+void latency_command(CommandContext *ctx) {
+  Client *client = ctx->client;
+  OutputBuffer *ob = ctx->ob;
+  Bytes **arg_values = client->arg_values;
+  int arg_count = client->arg_count;
+
+  if (strcasecmp(arg_values[1]->data, "HISTOGRAM") != 0) {
+    append_to_output_buffer(ob, "-ERR unknown subcommand\r\n", 25);
+    return;
+  }
+
+  LatencyHistogram *h;
+  Command **selected;
+
+  if ((h = malloc(sizeof(LatencyHistogram))) == NULL ||
+      (selected = malloc(command_count * sizeof(Command *))) == NULL) {
+    free(h);
+    append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+    return;
+  }
+
+  int count = 0;
+  if (arg_count == 2) {
+    for (int i = 0; i < command_count; i++) {
+      command_latency_collect(&CommandTable[i], h);
+      if (h->calls > 0)
+        selected[count++] = &CommandTable[i];
+    }
+  } else {
+    // Unknown and repeated names are skipped
+    for (int i = 2; i < arg_count; i++) {
+      Command *cmd = command_lookup(arg_values[i]->data, arg_values[i]->length);
+      int seen = cmd == NULL;
+
+      for (int j = 0; j < count && !seen; j++)
+        seen = selected[j] == cmd;
+
+      if (!seen)
+        selected[count++] = cmd;
+    }
+  }
+
+  char header[32];
+  int header_len = snprintf(header, sizeof(header), "*%d\r\n", count * 2);
+  append_to_output_buffer(ob, header, header_len);
+
+  for (int i = 0; i < count; i++) {
+    command_latency_collect(selected[i], h);
+    latency_histogram_reply(ob, selected[i], h);
+  }
+
+  free(selected);
+  free(h);
+}
+
+static int slowlog_entry_newer(const void *a, const void *b) {
+  const SlowlogEntry *ea = *(const SlowlogEntry **)a;
+  const SlowlogEntry *eb = *(const SlowlogEntry **)b;
+
+  return (ea->id < eb->id) - (ea->id > eb->id);
+}
+
+static void slowlog_entry_reply(OutputBuffer *ob, SlowlogEntry *entry) {
+  char buf[64];
+  int len;
+
+  append_to_output_buffer(ob, "*6\r\n", 4);
+  append_integer(ob, (uint64_t)entry->id);
+  append_integer(ob, (uint64_t)entry->time);
+  append_integer(ob, (uint64_t)entry->duration_usec);
+
+  len = snprintf(buf, sizeof(buf), "*%d\r\n", entry->argc);
+  append_to_output_buffer(ob, buf, len);
+
+  for (int i = 0; i < entry->argc; i++) {
+    Bytes *arg = entry->argv[i];
+    len = snprintf(buf, sizeof(buf), "$%" PRIu32 "\r\n", arg->length);
+    append_to_output_buffer(ob, buf, len);
+    append_to_output_buffer(ob, arg->data, arg->length);
+    append_to_output_buffer(ob, "\r\n", 2);
+  }
+
+  append_bulk_cstring(ob, entry->addr);
+  len = snprintf(buf, sizeof(buf), ":%d\r\n", entry->fd);
+  append_to_output_buffer(ob, buf, len);
+}
+
+// SLOWLOG GET [count] | LEN | RESET. Runs with every shard parked, their
+// logs are merged newest first.
+void slowlog_command(CommandContext *ctx) {
+  Client *client = ctx->client;
+  OutputBuffer *ob = ctx->ob;
+  Bytes **arg_values = client->arg_values;
+  int arg_count = client->arg_count;
+  const char *sub = arg_values[1]->data;
+
+  if (strcasecmp(sub, "LEN") == 0 && arg_count == 2) {
+    size_t total = 0;
+    for (int i = 0; i < shard_count; i++)
+      total += shards[i].slowlog.length;
+
+    append_integer(ob, total);
+    return;
+  }
+
+  if (strcasecmp(sub, "RESET") == 0 && arg_count == 2) {
+    for (int i = 0; i < shard_count; i++)
+      slowlog_reset(&shards[i].slowlog);
+
+    append_to_output_buffer(ob, "+OK\r\n", 5);
+    return;
+  }
+
+  if (strcasecmp(sub, "GET") != 0 || arg_count > 3) {
+    append_to_output_buffer(ob, "-ERR unknown subcommand or wrong number of "
+                                "arguments for 'SLOWLOG'\r\n", 68);
+    return;
+  }
+
+  int64_t count = 10;
+  if (arg_count == 3 &&
+      (!try_parse_int64(arg_values[2]->data, &count) || count < -1)) {
+    append_to_output_buffer(
+        ob, "-ERR count should be greater than or equal to -1\r\n", 50);
+    return;
+  }
+
+  size_t total = 0;
+  for (int i = 0; i < shard_count; i++)
+    total += shards[i].slowlog.length;
+
+  SlowlogEntry **entries = NULL;
+  if (total > 0 && (entries = malloc(total * sizeof(SlowlogEntry *))) == NULL) {
+    append_to_output_buffer(ob, "-ERR out of memory\r\n", 20);
+    return;
+  }
+
+  size_t n = 0;
+  for (int i = 0; i < shard_count; i++) {
+    Slowlog *log = &shards[i].slowlog;
+    for (size_t j = 0; j < log->length; j++)
+      entries[n++] = &log->entries[j];
+  }
+
+  qsort(entries, n, sizeof(SlowlogEntry *), slowlog_entry_newer);
+
+  if (count >= 0 && (size_t)count < n)
+    n = (size_t)count;
+
+  char header[32];
+  int header_len = snprintf(header, sizeof(header), "*%zu\r\n", n);
+  append_to_output_buffer(ob, header, header_len);
+
+  for (size_t i = 0; i < n; i++)
+    slowlog_entry_reply(ob, entries[i]);
+
+  free(entries);
+}
+
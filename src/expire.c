@@ -0,0 +1,180 @@
+#include "../include/expire.h"
+#include "../include/command.h"
+#include "../include/recis.h"
+#include "../include/timer.h"
+
+#include <stdlib.h>
+
+// The clock is only read every few keys
+#define ACTIVE_EXPIRE_CLOCK_EVERY 16
+// Stale entries make the index rebuilt once it holds this many more entries
+// than there are keys with a deadline
+#define EXPIRE_INDEX_SLACK 1024
+
+int expire_index_enabled = 0;
+
+static void expire_index_sift_up(ExpireIndex *index, size_t i) {
+  ExpireEntry entry = index->heap[i];
+
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (index->heap[parent].when <= entry.when)
+      break;
+
+    index->heap[i] = index->heap[parent];
+    i = parent;
+  }
+
+  index->heap[i] = entry;
+}
+
+static void expire_index_sift_down(ExpireIndex *index, size_t i) {
+  ExpireEntry entry = index->heap[i];
+
+  while (1) {
+    size_t child = 2 * i + 1;
+    if (child >= index->count)
+      break;
+
+    if (child + 1 < index->count &&
+        index->heap[child + 1].when < index->heap[child].when)
+      child++;
+
+    if (entry.when <= index->heap[child].when)
+      break;
+
+    index->heap[i] = index->heap[child];
+    i = child;
+  }
+
+  index->heap[i] = entry;
+}
+
+static int expire_index_push(ExpireIndex *index, Bytes *key, long long when) {
+  if (index->count == index->cap) {
+    size_t cap = index->cap ? index->cap * 2 : 1024;
+    ExpireEntry *heap = realloc(index->heap, cap * sizeof(ExpireEntry));
+
+    if (heap == NULL)
+      return -1;
+
+    index->heap = heap;
+    index->cap = cap;
+  }
+
+  Bytes *copy;
+  if ((copy = bytes_dup(key)) == NULL)
+    return -1;
+
+  index->heap[index->count].when = when;
+  index->heap[index->count].key = copy;
+  index->count++;
+  return 0;
+}
+
+static void expire_index_clear(ExpireIndex *index) {
+  for (size_t i = 0; i < index->count; i++)
+    free_bytes_object(index->heap[i].key);
+
+  index->count = 0;
+}
+
+void expire_index_rebuild(ExpireIndex *index, HashTable *db) {
+  expire_index_clear(index);
+
+  for (size_t i = 0; i < db->expiring_count; i++) {
+    Bytes *key = db->expiring[i];
+    if (expire_index_push(index, key, key_expire(key)->when) < 0)
+      break;
+  }
+
+  for (size_t i = index->count / 2; i-- > 0;)
+    expire_index_sift_down(index, i);
+}
+
+// Called whenever a key gets a deadline
+void expire_index_add(ExpireIndex *index, Bytes *key, long long when) {
+  if (!expire_index_enabled)
+    return;
+
+  if (expire_index_push(index, key, when) == 0)
+    expire_index_sift_up(index, index->count - 1);
+}
+
+static ExpireEntry expire_index_pop(ExpireIndex *index) {
+  ExpireEntry top = index->heap[0];
+
+  index->count--;
+  if (index->count > 0) {
+    index->heap[0] = index->heap[index->count];
+    expire_index_sift_down(index, 0);
+  }
+
+  return top;
+}
+
+// Deletes keys in deadline order, returns -1 once the budget ran out
+static int active_expire_index(HashTable *db, ExpireIndex *index,
+                               long long now, long long deadline_us) {
+  if (index->count > 2 * db->expiring_count + EXPIRE_INDEX_SLACK)
+    expire_index_rebuild(index, db);
+
+  for (int n = 1; index->count > 0 && index->heap[0].when < now; n++) {
+    ExpireEntry entry = expire_index_pop(index);
+    Node *node = hash_table_find_entry(db, entry.key);
+
+    // The key may have been deleted or given another deadline since
+    if (node != NULL && hash_key_expire(node->key) == entry.when)
+      hash_table_del(db, entry.key);
+
+    free_bytes_object(entry.key);
+
+    if (n % ACTIVE_EXPIRE_CLOCK_EVERY == 0 && timer_now_us() > deadline_us)
+      return -1;
+  }
+
+  return 0;
+}
+
+// Samples keys with a deadline and deletes the expired ones. Sampling goes
+// on while a round still finds more than ACTIVE_EXPIRE_STALE_PERCENT stale
+// keys and stops once budget_us is spent. Returns 1 if it had to stop with
+// expired keys left, the caller should come back soon.
+int active_expire_cycle(HashTable *db, ExpireIndex *index, long long budget_us) {
+  if (db->expiring_count == 0)
+    return 0;
+
+  long long now = get_time_ms();
+  long long deadline_us = timer_now_us() + budget_us;
+
+  if (expire_index_enabled &&
+      active_expire_index(db, index, now, deadline_us) < 0)
+    return 1;
+
+  int sampled, expired;
+
+  do {
+    sampled = 0;
+    expired = 0;
+
+    for (int i = 0; i < ACTIVE_EXPIRE_KEYS_PER_LOOP; i++) {
+      Bytes *key = hash_table_random_expiring(db);
+      if (key == NULL)
+        break;
+
+      sampled++;
+
+      // The key is the table's own, it is freed by the delete
+      if (now > key_expire(key)->when) {
+        hash_table_del(db, key);
+        expired++;
+      }
+    }
+
+    if (timer_now_us() > deadline_us)
+      return expired * 100 > sampled * ACTIVE_EXPIRE_STALE_PERCENT;
+  } while (sampled > 0 &&
+           expired * 100 > sampled * ACTIVE_EXPIRE_STALE_PERCENT);
+
+  return 0;
+}
@@ -0,0 +1,196 @@
+#include "../include/hash.h"
+#include "../include/recis.h"
+#include <stdlib.h>
+
+int hash_max_listpack_entries = HASH_MAX_LISTPACK_ENTRIES;
+int hash_max_listpack_value = HASH_MAX_LISTPACK_VALUE;
+
+r_obj *create_hash_listpack_object(void) {
+  r_obj *o;
+
+  if ((o = (r_obj *)malloc(sizeof(r_obj))) == NULL)
+    return NULL;
+
+  o->type = HASH;
+  o->refcount = 1;
+  o->encoding = OBJ_ENCODING_LISTPACK;
+
+  o->data = listpack_new();
+
+  if (o->data == NULL) {
+    free(o);
+    return NULL;
+  }
+
+  return o;
+}
+
+// Moves the pairs of a listpack hash into a HashTable
+static int hash_object_convert(r_obj *o) {
+  Listpack *lp = (Listpack *)o->data;
+  HashTable *ht;
+
+  if ((ht = hash_table_create(listpack_count(lp) / 2)) == NULL)
+    return -1;
+
+  unsigned char *p = listpack_first(lp);
+  while (p != NULL) {
+    Bytes field, value;
+
+    listpack_get(p, &field);
+    p = listpack_next(lp, p);
+    listpack_get(p, &value);
+    p = listpack_next(lp, p);
+
+    r_obj *value_o = create_string_object(value.data, value.length);
+    if (hash_table_set(ht, &field, value_o) != 0) {
+      // The listpack stays as it was
+      free_object(value_o);
+      hash_table_destroy(ht);
+      return -1;
+    }
+  }
+
+  free(lp);
+  o->data = ht;
+  o->encoding = OBJ_ENCODING_RAW;
+  return 0;
+}
+
+// Converts a listpack hash that no longer fits the limits, e.g. one loaded
+// from disk that was written with larger ones
+void hash_object_check_limits(r_obj *o) {
+  if (o->encoding != OBJ_ENCODING_LISTPACK)
+    return;
+
+  Listpack *lp = (Listpack *)o->data;
+  if (listpack_count(lp) / 2 > (uint32_t)hash_max_listpack_entries) {
+    hash_object_convert(o);
+    return;
+  }
+
+  for (unsigned char *p = listpack_first(lp); p; p = listpack_next(lp, p)) {
+    Bytes entry;
+
+    listpack_get(p, &entry);
+    if (entry.length > (uint32_t)hash_max_listpack_value) {
+      hash_object_convert(o);
+      return;
+    }
+  }
+}
+
+// Adds the field or overwrites its value, the value is copied
+void hash_object_set(r_obj *o, Bytes *field, const char *value, uint32_t len) {
+  if (o->encoding == OBJ_ENCODING_LISTPACK) {
+    if (field->length > (uint32_t)hash_max_listpack_value ||
+        len > (uint32_t)hash_max_listpack_value) {
+      if (hash_object_convert(o) < 0)
+        return;
+    }
+  }
+
+  if (o->encoding == OBJ_ENCODING_LISTPACK) {
+    Listpack *lp = (Listpack *)o->data;
+    Listpack *updated;
+    unsigned char *p =
+        listpack_find(lp, listpack_first(lp), field->data, field->length, 1);
+
+    if (p != NULL) {
+      p = listpack_next(lp, p);
+      if ((updated = listpack_replace(lp, &p, value, len)) != NULL)
+        o->data = updated;
+      return;
+    }
+
+    if ((updated = listpack_append(lp, field->data, field->length)) == NULL)
+      return;
+    lp = updated;
+
+    if ((updated = listpack_append(lp, value, len)) == NULL) {
+      // Don't leave a field without its value behind
+      p = listpack_last(lp);
+      o->data = listpack_delete(lp, &p);
+      return;
+    }
+    o->data = lp = updated;
+
+    if (listpack_count(lp) / 2 > (uint32_t)hash_max_listpack_entries)
+      hash_object_convert(o);
+    return;
+  }
+
+  r_obj *value_o = create_string_object(value, len);
+  if (hash_table_set((HashTable *)o->data, field, value_o) != 0)
+    free_object(value_o);
+}
+
+// Looks up a field. The value points into the hash and is only valid until
+// it changes. For a HashTable hash *ref is the value's object, a reply can
+// hold on to it instead of copying, NULL for a listpack hash.
+int hash_object_get(r_obj *o, Bytes *field, Bytes *value, r_obj **ref) {
+  if (o->encoding == OBJ_ENCODING_LISTPACK) {
+    Listpack *lp = (Listpack *)o->data;
+    unsigned char *p =
+        listpack_find(lp, listpack_first(lp), field->data, field->length, 1);
+
+    if (p == NULL)
+      return 0;
+
+    listpack_get(listpack_next(lp, p), value);
+    *ref = NULL;
+    return 1;
+  }
+
+  r_obj *val = hash_table_get((HashTable *)o->data, field);
+  if (val == NULL)
+    return 0;
+
+  *value = *(Bytes *)val->data;
+  *ref = val;
+  return 1;
+}
+
+size_t hash_object_size(r_obj *o) {
+  if (o->encoding == OBJ_ENCODING_LISTPACK)
+    return listpack_count((Listpack *)o->data) / 2;
+
+  return ((HashTable *)o->data)->count;
+}
+
+void hash_object_iterator_init(r_obj *o, HashObjectIterator *it) {
+  it->o = o;
+
+  if (o->encoding == OBJ_ENCODING_LISTPACK)
+    it->p = listpack_first((Listpack *)o->data);
+  else
+    hash_table_iterator_init((HashTable *)o->data, &it->it);
+}
+
+int hash_object_next(HashObjectIterator *it, Bytes *field, Bytes *value) {
+  if (it->o->encoding == OBJ_ENCODING_LISTPACK) {
+    Listpack *lp = (Listpack *)it->o->data;
+
+    if (it->p == NULL)
+      return 0;
+
+    listpack_get(it->p, field);
+    it->p = listpack_next(lp, it->p);
+    listpack_get(it->p, value);
+    it->p = listpack_next(lp, it->p);
+    return 1;
+  }
+
+  Node *node = hash_table_next(&it->it);
+  if (node == NULL)
+    return 0;
+
+  *field = *node->key;
+  *value = *(Bytes *)node->value->data;
+  return 1;
+}
+
+void hash_object_iterator_release(HashObjectIterator *it) {
+  if (it->o->encoding != OBJ_ENCODING_LISTPACK)
+    hash_table_iterator_release(&it->it);
+}
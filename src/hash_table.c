@@ -5,52 +5,114 @@
 #include "../include/set.h"
 #include "../include/zset.h"
 #include "string.h"
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+// Keyed 64-bit hash in the wyhash family: 48 bytes per round on long keys,
+// two overlapping loads for keys up to 16 bytes. The seed is drawn at startup
+// so bucket placement can't be predicted by clients.
+static uint64_t hash_seed = 0xa0761d6478bd642fULL;
+
+static const uint64_t hash_secret[4] = {
+    0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL,
+    0x589965cc75374cc3ULL};
+
+static inline void hash_mum(uint64_t *a, uint64_t *b) {
+  __uint128_t r = (__uint128_t)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+}
 
-unsigned long hash(const Bytes *key) {
-  unsigned int val = 0;
-  unsigned int tmp;
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+  hash_mum(&a, &b);
+  return a ^ b;
+}
 
-  for (uint32_t i = 0; i < key->length; i++) {
-    val = (val << 4) + key->data[i];
-    if ((tmp = (val & 0xf0000000))) {
-      val = val ^ (tmp >> 24);
-      val = val ^ tmp;
-    }
-  }
+static inline uint64_t hash_read64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
 
-  return val;
+static inline uint64_t hash_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
 }
 
-static void hash_table_resize(HashTable *hash_table) {
-  size_t new_size = hash_table->size * 2;
+static inline uint64_t hash_read3(const uint8_t *p, size_t k) {
+  return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k - 1];
+}
 
-  Node **new_buckets = calloc(new_size, sizeof(Node *));
-  if (new_buckets == NULL)
-    return;
+void hash_seed_init(void) {
+  uint64_t seed;
 
-  for (size_t i = 0; i < hash_table->size; i++) {
-    Node *node = hash_table->buckets[i];
-    while (node) {
-      Node *next_node = node->next;
+  if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    seed = ((uint64_t)ts.tv_nsec << 32) ^ (uint64_t)ts.tv_sec ^
+           ((uint64_t)getpid() << 16);
+  }
 
-      unsigned int new_index = hash(node->key) % new_size;
+  hash_seed = seed;
+}
 
-      node->next = new_buckets[new_index];
-      new_buckets[new_index] = node;
+uint64_t hash(const Bytes *key) {
+  const uint8_t *p = (const uint8_t *)key->data;
+  size_t len = key->length;
+  uint64_t seed = hash_seed ^ hash_mix(hash_seed ^ hash_secret[0],
+                                       hash_secret[1]);
+  uint64_t a, b;
+
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (hash_read32(p) << 32) | hash_read32(p + ((len >> 3) << 2));
+      b = (hash_read32(p + len - 4) << 32) |
+          hash_read32(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = hash_read3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = hash_mix(hash_read64(p) ^ hash_secret[1],
+                        hash_read64(p + 8) ^ seed);
+        see1 = hash_mix(hash_read64(p + 16) ^ hash_secret[2],
+                        hash_read64(p + 24) ^ see1);
+        see2 = hash_mix(hash_read64(p + 32) ^ hash_secret[3],
+                        hash_read64(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
 
-      node = next_node;
+    while (i > 16) {
+      seed = hash_mix(hash_read64(p) ^ hash_secret[1],
+                      hash_read64(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
     }
-  }
 
-  free(hash_table->buckets);
+    a = hash_read64(p + i - 16);
+    b = hash_read64(p + i - 8);
+  }
 
-  hash_table->buckets = new_buckets;
-  hash_table->size = new_size;
+  a ^= hash_secret[1];
+  b ^= seed;
+  hash_mum(&a, &b);
 
-  return;
+  return hash_mix(a ^ hash_secret[0] ^ len, b ^ hash_secret[1]);
 }
 
 r_obj *create_hash_object() {
@@ -59,6 +121,8 @@ r_obj *create_hash_object() {
     return NULL;
 
   o->type = HASH;
+  o->refcount = 1;
+  o->encoding = OBJ_ENCODING_RAW;
   o->data = hash_table_create(64);
 
   if (o->data == NULL) {
@@ -69,27 +133,41 @@ r_obj *create_hash_object() {
   return o;
 }
 
-HashTable *hash_table_create(size_t size) {
-  HashTable *hash_table;
-
-  if ((hash_table = (HashTable *)malloc(sizeof(HashTable))) == NULL) {
+// Short strings are embedded, so the object, its Bytes and the data are a
+// single allocation
+static r_obj *create_embedded_string_object(const char *str,
+                                            uint32_t length) {
+  r_obj *o;
+  if ((o = (r_obj *)malloc(sizeof(r_obj) + sizeof(Bytes) + length + 1)) ==
+      NULL)
     return NULL;
-  }
 
-  hash_table->buckets = calloc(size, sizeof(Node *));
+  o->type = STRING;
+  o->refcount = 1;
+  o->encoding = OBJ_ENCODING_EMBSTR;
 
-  hash_table->size = size;
-  hash_table->count = 0;
+  Bytes *b = (Bytes *)(o + 1);
+  b->length = length;
+  b->flags = 0;
+  b->data = (char *)(b + 1);
+  memcpy(b->data, str, length);
+  b->data[length] = '\0';
 
-  return hash_table;
+  o->data = b;
+  return o;
 }
 
 r_obj *create_string_object(const char *str, uint32_t length) {
+  if (length <= OBJ_EMBSTR_MAX)
+    return create_embedded_string_object(str, length);
+
   r_obj *o;
   if ((o = (r_obj *)malloc(sizeof(r_obj))) == NULL) {
     return NULL;
   }
   o->type = STRING;
+  o->refcount = 1;
+  o->encoding = OBJ_ENCODING_RAW;
 
   Bytes *b = create_bytes_object(str, length);
   if (b == NULL) {
@@ -102,6 +180,91 @@ r_obj *create_string_object(const char *str, uint32_t length) {
   return o;
 }
 
+static r_obj shared_integers[OBJ_SHARED_INTEGERS];
+
+void shared_objects_init(void) {
+  for (int i = 0; i < OBJ_SHARED_INTEGERS; i++) {
+    shared_integers[i].type = STRING;
+    shared_integers[i].encoding = OBJ_ENCODING_INT;
+    shared_integers[i].refcount = OBJ_SHARED_REFCOUNT;
+    shared_integers[i].data = (void *)(intptr_t)i;
+  }
+}
+
+// Small values come from the shared pool and cost no allocation
+r_obj *create_int_string_object(long long value) {
+  if (value >= 0 && value < OBJ_SHARED_INTEGERS)
+    return &shared_integers[value];
+
+  r_obj *o;
+  if ((o = (r_obj *)malloc(sizeof(r_obj))) == NULL)
+    return NULL;
+
+  o->type = STRING;
+  o->refcount = 1;
+  o->encoding = OBJ_ENCODING_INT;
+  o->data = (void *)(intptr_t)value;
+  return o;
+}
+
+// Only strings that print back the same way are taken: no sign but '-', no
+// leading zeros, no spaces
+int string_is_int64(const char *str, uint32_t length, long long *out) {
+  if (length == 0 || length >= OBJ_INT_BUF)
+    return 0;
+
+  uint32_t i = str[0] == '-' ? 1 : 0;
+  if (i == length || (str[i] == '0' && length > 1))
+    return 0;
+
+  unsigned long long v = 0;
+  for (; i < length; i++) {
+    if (str[i] < '0' || str[i] > '9')
+      return 0;
+
+    unsigned long long digit = (unsigned long long)(str[i] - '0');
+    if (v > (ULLONG_MAX - digit) / 10)
+      return 0;
+    v = v * 10 + digit;
+  }
+
+  if (str[0] == '-') {
+    if (v > (unsigned long long)LLONG_MAX + 1)
+      return 0;
+    *out = (long long)(0 - v);
+  } else {
+    if (v > (unsigned long long)LLONG_MAX)
+      return 0;
+    *out = (long long)v;
+  }
+
+  return 1;
+}
+
+// Top level string values, integers are kept in the object word. Anything
+// stored this way has to be read through string_object_bytes.
+r_obj *create_string_value_object(const char *str, uint32_t length) {
+  long long value;
+
+  if (string_is_int64(str, length, &value))
+    return create_int_string_object(value);
+
+  return create_string_object(str, length);
+}
+
+// The bytes of a STRING in any encoding. Integers are printed into buf,
+// which needs OBJ_INT_BUF bytes, and described by tmp.
+Bytes *string_object_bytes(r_obj *o, Bytes *tmp, char *buf) {
+  if (o->encoding != OBJ_ENCODING_INT)
+    return (Bytes *)o->data;
+
+  tmp->length = (uint32_t)snprintf(buf, OBJ_INT_BUF, "%lld",
+                                   string_object_int(o));
+  tmp->flags = 0;
+  tmp->data = buf;
+  return tmp;
+}
+
 r_obj *create_int_object(long long value) {
   r_obj *o;
   if ((o = (r_obj *)malloc(sizeof(r_obj))) == NULL) {
@@ -109,6 +272,8 @@ r_obj *create_int_object(long long value) {
   }
 
   o->type = INT;
+  o->refcount = 1;
+  o->encoding = OBJ_ENCODING_RAW;
   long long *ptr = malloc(sizeof(long long));
   *ptr = value;
   o->data = ptr;
@@ -121,67 +286,35 @@ r_obj *create_double_object(double value) {
     return NULL;
 
   o->type = DOUBLE;
+  o->refcount = 1;
+  o->encoding = OBJ_ENCODING_RAW;
   double *ptr = malloc(sizeof(double));
   *ptr = value;
   o->data = ptr;
   return o;
 }
 
-void hash_table_set(HashTable *hash_table, Bytes *key, r_obj *val) {
-
-  if (hash_table->count >= hash_table->size) {
-    hash_table_resize(hash_table);
-  }
-
-  unsigned int slot = hash(key) % hash_table->size;
-
-  Node *entry = hash_table->buckets[slot];
-  while (entry) {
-    if (bytes_equal(key, entry->key) == 1) {
-      free_object(entry->value);
-      entry->value = val;
-
-      return;
-    }
-    entry = entry->next;
-  }
-
-  Node *new_node;
-  if ((new_node = (Node *)malloc(sizeof(Node))) == NULL) {
+void incr_ref_count(r_obj *o) {
+  if (__atomic_load_n(&o->refcount, __ATOMIC_RELAXED) == OBJ_SHARED_REFCOUNT)
     return;
-  }
-
-  new_node->key = bytes_dup(key);
-  new_node->value = val;
-  new_node->next = hash_table->buckets[slot];
 
-  hash_table->buckets[slot] = new_node;
-  hash_table->count++;
-}
-
-r_obj *hash_table_get(HashTable *hash_table, Bytes *key) {
-
-  unsigned int slot = hash(key) % hash_table->size;
-
-  Node *entry = hash_table->buckets[slot];
-  while (entry) {
-    if (bytes_equal(key, entry->key) == 1) {
-      return entry->value;
-    }
-    entry = entry->next;
-  }
-
-  return NULL;
+  __atomic_add_fetch(&o->refcount, 1, __ATOMIC_RELAXED);
 }
 
+// Drops one reference, the object goes away with the last one
 void free_object(r_obj *o) {
 
-  if (o == NULL)
+  if (o == NULL ||
+      __atomic_load_n(&o->refcount, __ATOMIC_RELAXED) == OBJ_SHARED_REFCOUNT)
+    return;
+
+  if (__atomic_sub_fetch(&o->refcount, 1, __ATOMIC_ACQ_REL) > 0)
     return;
 
   switch (o->type) {
   case STRING:
-    if (o->data) {
+    // Embedded and integer strings have nothing besides the object
+    if (o->encoding == OBJ_ENCODING_RAW && o->data) {
       free_bytes_object((Bytes *)o->data);
     }
     break;
@@ -194,13 +327,22 @@ void free_object(r_obj *o) {
       list_destroy((List *)o->data);
     break;
   case ZSET:
-    zset_destroy((ZSet *)o->data);
+    if (o->encoding == OBJ_ENCODING_ZPACK)
+      free(o->data);
+    else
+      zset_destroy((ZSet *)o->data);
     break;
   case SET:
-    hash_table_destroy((Set *)o->data);
+    if (o->encoding == OBJ_ENCODING_INTSET)
+      free(o->data);
+    else
+      set_destroy((Set *)o->data);
     break;
   case HASH:
-    hash_table_destroy((HashTable *)o->data);
+    if (o->encoding == OBJ_ENCODING_LISTPACK)
+      free(o->data);
+    else
+      hash_table_destroy((HashTable *)o->data);
     break;
   case VECTOR:
     vector_free((Vector *)o->data);
@@ -212,30 +354,361 @@ void free_object(r_obj *o) {
   free(o);
 }
 
-int hash_table_del(HashTable *hash_table, Bytes *key) {
+// Keys live in one allocation: the Bytes header, a KeyExpire when `room` is
+// set, then the data. Both engines store their keys this way.
+Bytes *hash_key_dup(const Bytes *src, int room) {
+  size_t header = sizeof(Bytes) + (room ? sizeof(KeyExpire) : 0);
+  Bytes *b;
+
+  if ((b = (Bytes *)malloc(header + src->length + 1)) == NULL)
+    return NULL;
+
+  b->length = src->length;
+  b->flags = room ? BYTES_EXPIRE_ROOM : 0;
+  b->data = (char *)b + header;
+  memcpy(b->data, src->data, src->length);
+  b->data[src->length] = '\0';
+
+  if (room)
+    key_expire(b)->when = -1;
+
+  return b;
+}
+
+static void hash_table_expiring_remove(HashTable *hash_table, Bytes *key) {
+  KeyExpire *e = key_expire(key);
+  Bytes *last = hash_table->expiring[--hash_table->expiring_count];
+
+  hash_table->expiring[e->slot] = last;
+  key_expire(last)->slot = e->slot;
+  e->when = -1;
+}
+
+static int hash_table_expiring_add(HashTable *hash_table, Bytes *key) {
+  if (hash_table->expiring_count == hash_table->expiring_cap) {
+    size_t cap = hash_table->expiring_cap ? hash_table->expiring_cap * 2 : 16;
+    Bytes **keys = realloc(hash_table->expiring, cap * sizeof(Bytes *));
+
+    if (keys == NULL)
+      return -1;
+
+    hash_table->expiring = keys;
+    hash_table->expiring_cap = cap;
+  }
+
+  key_expire(key)->slot = hash_table->expiring_count;
+  hash_table->expiring[hash_table->expiring_count++] = key;
+  return 0;
+}
+
+// Frees a key that was unlinked from the table
+void hash_key_free(HashTable *hash_table, Bytes *key) {
+  if (hash_key_expire(key) != -1)
+    hash_table_expiring_remove(hash_table, key);
+
+  free(key);
+}
+
+// Gives an existing key a deadline, or takes it away when `when` is -1. A key
+// without room is reallocated the first time it gets one. Returns 0 if the
+// key isn't there.
+int hash_table_set_expire(HashTable *hash_table, Bytes *key, long long when) {
+  Node *entry = hash_table_find_entry(hash_table, key);
+  if (entry == NULL)
+    return 0;
+
+  Bytes *k = entry->key;
+
+  if (!(k->flags & BYTES_EXPIRE_ROOM)) {
+    if (when == -1)
+      return 1;
+
+    Bytes *roomy;
+    if ((roomy = hash_key_dup(k, 1)) == NULL)
+      return 0;
+
+    entry->key = roomy;
+    free(k);
+    k = roomy;
+  }
+
+  KeyExpire *e = key_expire(k);
+
+  if (when == -1) {
+    if (e->when != -1)
+      hash_table_expiring_remove(hash_table, k);
+    return 1;
+  }
+
+  if (e->when == -1 && hash_table_expiring_add(hash_table, k) < 0)
+    return 0;
+
+  e->when = when;
+  return 1;
+}
+
+Bytes *hash_table_random_expiring(HashTable *hash_table) {
+  if (hash_table->expiring_count == 0)
+    return NULL;
+
+  return hash_table->expiring[random() % hash_table->expiring_count];
+}
+
+#ifndef HASH_TABLE_OPEN_ADDRESSING
 
-  printf("[DEBUG] DEL start. Key pointer: %p\n", key);
+// Table sizes are always powers of two so a slot is just the masked hash
+static size_t hash_table_round_size(size_t size) {
+  size_t n = 4;
+  while (n < size)
+    n <<= 1;
+  return n;
+}
+
+#define hash_slot(h, size) ((size_t)(h) & ((size) - 1))
+
+#define REHASH_EMPTY_VISITS 10
+#define RANDOM_ENTRY_TRIES 100
+// Tables shrink once fewer than one bucket in SHRINK_RATIO is used, so a
+// table emptied by deletes doesn't keep its memory and random sampling
+// still finds entries
+#define SHRINK_RATIO 8
+#define SHRINK_MIN_SIZE 16
+
+static long long hash_table_time_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Allocates the second table and marks the hash table as rehashing. The
+// entries are moved over a few buckets at a time by hash_table_rehash.
+static void hash_table_start_rehash(HashTable *hash_table, size_t new_size) {
+  Node **new_buckets = calloc(new_size, sizeof(Node *));
+  if (new_buckets == NULL)
+    return;
+
+  hash_table->rehash_buckets = new_buckets;
+  hash_table->rehash_size = new_size;
+  hash_table->rehash_index = 0;
+}
+
+static void hash_table_finish_rehash(HashTable *hash_table) {
+  free(hash_table->buckets);
+
+  hash_table->buckets = hash_table->rehash_buckets;
+  hash_table->size = hash_table->rehash_size;
+
+  hash_table->rehash_buckets = NULL;
+  hash_table->rehash_size = 0;
+  hash_table->rehash_index = -1;
+}
+
+// Moves up to n buckets from the old table to the new one. Visiting empty
+// buckets is bounded too, so a sparse old table can't make a step expensive.
+// Returns 1 while there is still work left, 0 once the rehash has finished.
+int hash_table_rehash(HashTable *hash_table, int n) {
+  if (!hash_table_is_rehashing(hash_table))
+    return 0;
+
+  size_t empty_visits = n * REHASH_EMPTY_VISITS;
+
+  while (n-- > 0 && (size_t)hash_table->rehash_index < hash_table->size) {
+    while (hash_table->buckets[hash_table->rehash_index] == NULL) {
+      hash_table->rehash_index++;
+      if ((size_t)hash_table->rehash_index >= hash_table->size)
+        break;
+      if (--empty_visits == 0)
+        return 1;
+    }
 
-  if (key && key->data)
-    printf("[DEBUG] Key string: %s\n", (char *)key->data);
+    if ((size_t)hash_table->rehash_index >= hash_table->size)
+      break;
+
+    Node *node = hash_table->buckets[hash_table->rehash_index];
+    while (node) {
+      Node *next_node = node->next;
+
+      size_t new_index = hash_slot(hash(node->key), hash_table->rehash_size);
+
+      node->next = hash_table->rehash_buckets[new_index];
+      hash_table->rehash_buckets[new_index] = node;
+
+      node = next_node;
+    }
+
+    hash_table->buckets[hash_table->rehash_index] = NULL;
+    hash_table->rehash_index++;
+  }
+
+  if ((size_t)hash_table->rehash_index >= hash_table->size) {
+    hash_table_finish_rehash(hash_table);
+    return 0;
+  }
+
+  return 1;
+}
+
+// Rehashes in batches of 100 buckets until `us` microseconds have passed.
+// Called from the event loop so an idle table still finishes migrating.
+int hash_table_rehash_us(HashTable *hash_table, long long us) {
+  if (!hash_table_is_rehashing(hash_table) || hash_table->paused)
+    return 0;
+
+  long long start = hash_table_time_us();
+  int steps = 0;
+
+  while (hash_table_rehash(hash_table, 100)) {
+    steps += 100;
+    if (hash_table_time_us() - start > us)
+      break;
+  }
+
+  return steps;
+}
+
+// Single bucket step piggybacked on regular lookups and updates.
+static void hash_table_rehash_step(HashTable *hash_table) {
+  if (hash_table->paused == 0)
+    hash_table_rehash(hash_table, 1);
+}
+
+static Node *hash_table_find(HashTable *hash_table, Bytes *key) {
+  uint64_t h = hash(key);
+  size_t slot = hash_slot(h, hash_table->size);
 
-  unsigned int slot = hash(key) % hash_table->size;
   Node *entry = hash_table->buckets[slot];
+  while (entry) {
+    if (bytes_equal(key, entry->key) == 1)
+      return entry;
+    entry = entry->next;
+  }
+
+  if (!hash_table_is_rehashing(hash_table))
+    return NULL;
+
+  slot = hash_slot(h, hash_table->rehash_size);
+
+  entry = hash_table->rehash_buckets[slot];
+  while (entry) {
+    if (bytes_equal(key, entry->key) == 1)
+      return entry;
+    entry = entry->next;
+  }
+
+  return NULL;
+}
+
+HashTable *hash_table_create(size_t size) {
+  HashTable *hash_table;
+
+  if ((hash_table = (HashTable *)malloc(sizeof(HashTable))) == NULL) {
+    return NULL;
+  }
+
+  size = hash_table_round_size(size);
+  hash_table->buckets = calloc(size, sizeof(Node *));
+
+  hash_table->size = size;
+  hash_table->count = 0;
+
+  hash_table->rehash_buckets = NULL;
+  hash_table->rehash_size = 0;
+  hash_table->rehash_index = -1;
+
+  hash_table->paused = 0;
+
+  hash_table->expiring = NULL;
+  hash_table->expiring_count = 0;
+  hash_table->expiring_cap = 0;
+
+  return hash_table;
+}
+
+int hash_table_set(HashTable *hash_table, Bytes *key, r_obj *val) {
+
+  if (hash_table_is_rehashing(hash_table)) {
+    hash_table_rehash_step(hash_table);
+  } else if (hash_table->count >= hash_table->size) {
+    hash_table_start_rehash(hash_table, hash_table->size * 2);
+  }
+
+  Node *entry = hash_table_find(hash_table, key);
+  if (entry) {
+    free_object(entry->value);
+    entry->value = val;
+
+    return 0;
+  }
+
+  Node *new_node;
+  if ((new_node = (Node *)malloc(sizeof(Node))) == NULL) {
+    return -1;
+  }
+
+  // New entries always go to the table that survives the rehash
+  Node **buckets = hash_table->buckets;
+  size_t size = hash_table->size;
+  if (hash_table_is_rehashing(hash_table)) {
+    buckets = hash_table->rehash_buckets;
+    size = hash_table->rehash_size;
+  }
+
+  size_t slot = hash_slot(hash(key), size);
+
+  if ((new_node->key = hash_key_dup(key, 0)) == NULL) {
+    free(new_node);
+    return -1;
+  }
+  new_node->value = val;
+  new_node->next = buckets[slot];
+
+  buckets[slot] = new_node;
+  hash_table->count++;
+  return 0;
+}
+
+r_obj *hash_table_get(HashTable *hash_table, Bytes *key) {
+
+  if (hash_table_is_rehashing(hash_table))
+    hash_table_rehash_step(hash_table);
+
+  Node *entry = hash_table_find(hash_table, key);
+  if (entry)
+    return entry->value;
+
+  return NULL;
+}
+
+Node *hash_table_find_entry(HashTable *hash_table, Bytes *key) {
+
+  if (hash_table_is_rehashing(hash_table))
+    hash_table_rehash_step(hash_table);
+
+  return hash_table_find(hash_table, key);
+}
+
+// Unlinks key; the value is handed to *taken when given, freed otherwise
+static int hash_table_del_from(HashTable *hash_table, Node **buckets,
+                               size_t size, Bytes *key, r_obj **taken) {
+  size_t slot = hash_slot(hash(key), size);
+  Node *entry = buckets[slot];
   Node *prev = NULL;
 
   while (entry) {
 
     if (bytes_equal(entry->key, key) == 1) {
       if (prev == NULL) {
-        hash_table->buckets[slot] = entry->next;
+        buckets[slot] = entry->next;
       } else {
         prev->next = entry->next;
       }
-      printf("[DEBUG] Found match. Deleting...\n");
 
-      free_object(entry->value);
+      if (taken)
+        *taken = entry->value;
+      else
+        free_object(entry->value);
 
-      free_bytes_object(entry->key);
+      hash_key_free(hash_table, entry->key);
       free(entry);
 
       hash_table->count--;
@@ -249,19 +722,53 @@ int hash_table_del(HashTable *hash_table, Bytes *key) {
   return 0;
 }
 
-void hash_table_destroy(HashTable *hash_table) {
-  if (!hash_table)
+static void hash_table_maybe_shrink(HashTable *hash_table) {
+  if (hash_table_is_rehashing(hash_table) || hash_table->paused ||
+      hash_table->size <= SHRINK_MIN_SIZE ||
+      hash_table->count * SHRINK_RATIO >= hash_table->size)
     return;
 
-  unsigned int i;
-  for (i = 0; i < hash_table->size; i++) {
-    Node *entry = hash_table->buckets[i];
+  hash_table_start_rehash(hash_table,
+                          hash_table_round_size(hash_table->count * 2));
+}
+
+static int hash_table_remove(HashTable *hash_table, Bytes *key,
+                             r_obj **taken) {
+
+  if (hash_table_is_rehashing(hash_table))
+    hash_table_rehash_step(hash_table);
+
+  if (hash_table_del_from(hash_table, hash_table->buckets, hash_table->size,
+                          key, taken) == 1) {
+    hash_table_maybe_shrink(hash_table);
+    return 1;
+  }
+
+  if (hash_table_is_rehashing(hash_table))
+    return hash_table_del_from(hash_table, hash_table->rehash_buckets,
+                               hash_table->rehash_size, key, taken);
+
+  return 0;
+}
+
+int hash_table_del(HashTable *hash_table, Bytes *key) {
+  return hash_table_remove(hash_table, key, NULL);
+}
+
+r_obj *hash_table_take(HashTable *hash_table, Bytes *key) {
+  r_obj *val = NULL;
+  hash_table_remove(hash_table, key, &val);
+  return val;
+}
+
+static void hash_table_free_buckets(Node **buckets, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    Node *entry = buckets[i];
     while (entry) {
       Node *next = entry->next;
 
-      if (entry->key) {
-        free_bytes_object(entry->key);
-      }
+      // The expiring array goes as a whole
+      free(entry->key);
 
       if (entry->value) {
         free_object(entry->value);
@@ -273,7 +780,112 @@ void hash_table_destroy(HashTable *hash_table) {
     }
   }
 
-  free(hash_table->buckets);
+  free(buckets);
+}
+
+void hash_table_destroy(HashTable *hash_table) {
+  if (!hash_table)
+    return;
+
+  hash_table_free_buckets(hash_table->buckets, hash_table->size);
+
+  if (hash_table->rehash_buckets)
+    hash_table_free_buckets(hash_table->rehash_buckets,
+                            hash_table->rehash_size);
 
+  free(hash_table->expiring);
   free(hash_table);
 }
+
+// Iterators pause incremental rehashing until released, so entries never move
+// between tables under an active iteration. The current entry may be deleted.
+void hash_table_iterator_init(HashTable *hash_table, HashTableIterator *it) {
+  it->hash_table = hash_table;
+  it->table = 0;
+  it->index = 0;
+  it->entry = NULL;
+  it->next_entry = NULL;
+
+  hash_table->paused++;
+}
+
+Node *hash_table_next(HashTableIterator *it) {
+  HashTable *hash_table = it->hash_table;
+
+  while (1) {
+    if (it->entry == NULL) {
+      Node **buckets = hash_table->buckets;
+      size_t size = hash_table->size;
+
+      if (it->table == 1) {
+        buckets = hash_table->rehash_buckets;
+        size = hash_table->rehash_size;
+      }
+
+      if (it->index >= size) {
+        if (it->table == 0 && hash_table_is_rehashing(hash_table)) {
+          it->table = 1;
+          it->index = 0;
+          continue;
+        }
+        return NULL;
+      }
+
+      it->entry = buckets[it->index++];
+    } else {
+      it->entry = it->next_entry;
+    }
+
+    if (it->entry) {
+      it->next_entry = it->entry->next;
+      return it->entry;
+    }
+  }
+}
+
+void hash_table_iterator_release(HashTableIterator *it) {
+  it->hash_table->paused--;
+}
+
+// Picks a random non-empty bucket, then a random entry within its chain.
+// Gives up after a bounded number of empty buckets on very sparse tables.
+Node *hash_table_random_entry(HashTable *hash_table) {
+  if (hash_table->count == 0)
+    return NULL;
+
+  if (hash_table_is_rehashing(hash_table))
+    hash_table_rehash_step(hash_table);
+
+  for (int tries = 0; tries < RANDOM_ENTRY_TRIES; tries++) {
+    Node **buckets = hash_table->buckets;
+    size_t size = hash_table->size;
+    size_t start = 0;
+
+    if (hash_table_is_rehashing(hash_table)) {
+      // Old buckets below rehash_index are already empty
+      if (random() & 1) {
+        buckets = hash_table->rehash_buckets;
+        size = hash_table->rehash_size;
+      } else {
+        start = hash_table->rehash_index;
+      }
+    }
+
+    Node *head = buckets[start + (random() % (size - start))];
+    if (head == NULL)
+      continue;
+
+    size_t len = 0;
+    for (Node *n = head; n; n = n->next)
+      len++;
+
+    for (size_t pick = random() % len; pick > 0; pick--)
+      head = head->next;
+
+    return head;
+  }
+
+  return NULL;
+}
+
+#endif // !HASH_TABLE_OPEN_ADDRESSING
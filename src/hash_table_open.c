@@ -0,0 +1,617 @@
+#ifdef HASH_TABLE_OPEN_ADDRESSING
+
+#include "../include/hash_table.h"
+#include "../include/recis.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+
+#define GROUP_WIDTH 16
+#define RANDOM_ENTRY_TRIES 100
+// Tables shrink once live entries fill less than one slot in SHRINK_RATIO
+#define SHRINK_RATIO 8
+
+#define h1(h) ((h) >> 7)
+#define h2(h) ((uint8_t)((h) & 0x7F))
+
+static long long hash_table_time_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t hash_table_round_size(size_t size) {
+  size_t n = GROUP_WIDTH;
+  while (n < size)
+    n <<= 1;
+  return n;
+}
+
+// Bitmask of the slots in a group whose control byte equals `c`
+static inline uint32_t group_match(const uint8_t *group, uint8_t c) {
+#ifdef __SSE2__
+  __m128i ctrl = _mm_load_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(c)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++)
+    if (group[i] == c)
+      mask |= 1u << i;
+  return mask;
+#endif
+}
+
+// Empty and deleted slots are the only control bytes with the top bit set
+static inline uint32_t group_match_free(const uint8_t *group) {
+#ifdef __SSE2__
+  __m128i ctrl = _mm_load_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(ctrl);
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++)
+    if (group[i] & 0x80)
+      mask |= 1u << i;
+  return mask;
+#endif
+}
+
+static int table_alloc(size_t size, uint8_t **ctrl, Node **slots) {
+  *ctrl = aligned_alloc(GROUP_WIDTH, size);
+  *slots = malloc(size * sizeof(Node));
+
+  if (*ctrl == NULL || *slots == NULL) {
+    free(*ctrl);
+    free(*slots);
+    return -1;
+  }
+
+  memset(*ctrl, CTRL_EMPTY, size);
+  return 0;
+}
+
+// Groups are probed triangularly, which visits every group once when the
+// group count is a power of two.
+static long table_find(uint8_t *ctrl, Node *slots, size_t size, uint64_t h,
+                       const Bytes *key) {
+  size_t groups_mask = size / GROUP_WIDTH - 1;
+  size_t group = h1(h) & groups_mask;
+
+  for (size_t i = 0; i <= groups_mask; i++) {
+    uint8_t *g = ctrl + group * GROUP_WIDTH;
+
+    uint32_t match = group_match(g, h2(h));
+    while (match) {
+      size_t slot = group * GROUP_WIDTH + __builtin_ctz(match);
+      if (bytes_equal(slots[slot].key, key) == 1)
+        return slot;
+      match &= match - 1;
+    }
+
+    if (group_match(g, CTRL_EMPTY))
+      return -1;
+
+    group = (group + i + 1) & groups_mask;
+  }
+
+  return -1;
+}
+
+// Returns the first free slot on the probe sequence. The caller has already
+// checked the key is absent.
+static long table_insert_slot(uint8_t *ctrl, size_t size, uint64_t h,
+                              size_t *used) {
+  size_t groups_mask = size / GROUP_WIDTH - 1;
+  size_t group = h1(h) & groups_mask;
+
+  for (size_t i = 0; i <= groups_mask; i++) {
+    uint8_t *g = ctrl + group * GROUP_WIDTH;
+
+    uint32_t free_mask = group_match_free(g);
+    if (free_mask) {
+      size_t slot = group * GROUP_WIDTH + __builtin_ctz(free_mask);
+      if (ctrl[slot] == CTRL_EMPTY)
+        (*used)++;
+      ctrl[slot] = h2(h);
+      return slot;
+    }
+
+    group = (group + i + 1) & groups_mask;
+  }
+
+  return -1;
+}
+
+// A slot in a group that still has an empty byte can go straight back to
+// empty: no probe sequence ever continued past that group.
+static void table_erase_slot(uint8_t *ctrl, size_t slot, size_t *used) {
+  uint8_t *g = ctrl + (slot & ~(size_t)(GROUP_WIDTH - 1));
+
+  if (group_match(g, CTRL_EMPTY)) {
+    ctrl[slot] = CTRL_EMPTY;
+    (*used)--;
+  } else {
+    ctrl[slot] = CTRL_DELETED;
+  }
+}
+
+HashTable *hash_table_create(size_t size) {
+  HashTable *hash_table;
+
+  if ((hash_table = (HashTable *)malloc(sizeof(HashTable))) == NULL) {
+    return NULL;
+  }
+
+  size = hash_table_round_size(size);
+  if (table_alloc(size, &hash_table->ctrl, &hash_table->slots) == -1) {
+    free(hash_table);
+    return NULL;
+  }
+
+  hash_table->size = size;
+  hash_table->count = 0;
+  hash_table->used = 0;
+
+  hash_table->rehash_ctrl = NULL;
+  hash_table->rehash_slots = NULL;
+  hash_table->rehash_size = 0;
+  hash_table->rehash_used = 0;
+  hash_table->rehash_index = -1;
+
+  hash_table->paused = 0;
+
+  hash_table->expiring = NULL;
+  hash_table->expiring_count = 0;
+  hash_table->expiring_cap = 0;
+
+  return hash_table;
+}
+
+// Grows when live entries pass half the slots, shrinks when they fill less
+// than one in SHRINK_RATIO, otherwise rebuilds at the same size to drop
+// tombstones. Either way the entries move over incrementally.
+static void hash_table_start_rehash(HashTable *hash_table) {
+  size_t new_size = hash_table->size;
+  if (hash_table->count >= hash_table->size / 2)
+    new_size *= 2;
+  else if (hash_table->count * SHRINK_RATIO < hash_table->size)
+    new_size = hash_table_round_size(hash_table->count * 4);
+
+  if (table_alloc(new_size, &hash_table->rehash_ctrl,
+                  &hash_table->rehash_slots) == -1)
+    return;
+
+  hash_table->rehash_size = new_size;
+  hash_table->rehash_used = 0;
+  hash_table->rehash_index = 0;
+}
+
+static void hash_table_finish_rehash(HashTable *hash_table) {
+  free(hash_table->ctrl);
+  free(hash_table->slots);
+
+  hash_table->ctrl = hash_table->rehash_ctrl;
+  hash_table->slots = hash_table->rehash_slots;
+  hash_table->size = hash_table->rehash_size;
+  hash_table->used = hash_table->rehash_used;
+
+  hash_table->rehash_ctrl = NULL;
+  hash_table->rehash_slots = NULL;
+  hash_table->rehash_size = 0;
+  hash_table->rehash_used = 0;
+  hash_table->rehash_index = -1;
+}
+
+// Rebuilds the new table at twice its size once new entries filled it before
+// the migration could finish. Nothing may iterate over the table.
+static int hash_table_grow_target(HashTable *hash_table) {
+  size_t size = hash_table->rehash_size * 2;
+  uint8_t *ctrl;
+  Node *slots;
+  size_t used = 0;
+
+  if (table_alloc(size, &ctrl, &slots) == -1)
+    return -1;
+
+  for (size_t i = 0; i < hash_table->rehash_size; i++) {
+    if (hash_table->rehash_ctrl[i] & 0x80)
+      continue;
+
+    Node *src = &hash_table->rehash_slots[i];
+    slots[table_insert_slot(ctrl, size, hash(src->key), &used)] = *src;
+  }
+
+  free(hash_table->rehash_ctrl);
+  free(hash_table->rehash_slots);
+
+  hash_table->rehash_ctrl = ctrl;
+  hash_table->rehash_slots = slots;
+  hash_table->rehash_size = size;
+  hash_table->rehash_used = used;
+  return 0;
+}
+
+// Moves the entries whose probe sequence starts at group `home` to the new
+// table. None of them sits past the first group with an empty slot, which
+// is also where lookups give up. Returns -1 if the new table can't take
+// them, what was moved so far stays moved.
+static int hash_table_rehash_home(HashTable *hash_table, size_t home) {
+  uint8_t *ctrl = hash_table->ctrl;
+  Node *slots = hash_table->slots;
+  size_t groups_mask = hash_table->size / GROUP_WIDTH - 1;
+  size_t group = home;
+
+  for (size_t i = 0; i <= groups_mask; i++) {
+    size_t base = group * GROUP_WIDTH;
+
+    uint32_t full = ~group_match_free(ctrl + base) & 0xFFFF;
+    while (full) {
+      size_t slot = base + __builtin_ctz(full);
+      uint64_t h = hash(slots[slot].key);
+      full &= full - 1;
+
+      if ((h1(h) & groups_mask) != home)
+        continue;
+
+      long dst = table_insert_slot(hash_table->rehash_ctrl,
+                                   hash_table->rehash_size, h,
+                                   &hash_table->rehash_used);
+      if (dst == -1) {
+        if (hash_table_grow_target(hash_table) == -1)
+          return -1;
+        dst = table_insert_slot(hash_table->rehash_ctrl,
+                                hash_table->rehash_size, h,
+                                &hash_table->rehash_used);
+      }
+
+      hash_table->rehash_slots[dst] = slots[slot];
+      table_erase_slot(ctrl, slot, &hash_table->used);
+    }
+
+    if (group_match(ctrl + base, CTRL_EMPTY))
+      break;
+
+    group = (group + i + 1) & groups_mask;
+  }
+
+  return 0;
+}
+
+// Migrates the entries of up to n home groups of the old table into the new
+// one. Returns 1 while there is still work left, 0 once the rehash has
+// finished.
+int hash_table_rehash(HashTable *hash_table, int n) {
+  if (!hash_table_is_rehashing(hash_table))
+    return 0;
+
+  size_t groups = hash_table->size / GROUP_WIDTH;
+
+  while (n-- > 0 && (size_t)hash_table->rehash_index < groups) {
+    if (hash_table_rehash_home(hash_table, hash_table->rehash_index) == -1)
+      return 1;
+
+    hash_table->rehash_index++;
+  }
+
+  if ((size_t)hash_table->rehash_index >= groups) {
+    hash_table_finish_rehash(hash_table);
+    return 0;
+  }
+
+  return 1;
+}
+
+int hash_table_rehash_us(HashTable *hash_table, long long us) {
+  if (!hash_table_is_rehashing(hash_table) || hash_table->paused)
+    return 0;
+
+  long long start = hash_table_time_us();
+  int steps = 0;
+
+  while (hash_table_rehash(hash_table, 100)) {
+    steps += 100;
+    if (hash_table_time_us() - start > us)
+      break;
+  }
+
+  return steps;
+}
+
+static void hash_table_rehash_step(HashTable *hash_table) {
+  if (hash_table->paused == 0)
+    hash_table_rehash(hash_table, 1);
+}
+
+// Whether an entry with hash h may still be in the old table. Entries are
+// migrated by the group their probe sequence starts at, everything below
+// rehash_index has moved.
+static int hash_table_in_old(HashTable *hash_table, uint64_t h) {
+  if (!hash_table_is_rehashing(hash_table))
+    return 1;
+
+  size_t groups_mask = hash_table->size / GROUP_WIDTH - 1;
+  return (long)(h1(h) & groups_mask) >= hash_table->rehash_index;
+}
+
+static Node *hash_table_find(HashTable *hash_table, Bytes *key) {
+  uint64_t h = hash(key);
+
+  if (hash_table_in_old(hash_table, h)) {
+    long slot = table_find(hash_table->ctrl, hash_table->slots,
+                           hash_table->size, h, key);
+    if (slot != -1)
+      return &hash_table->slots[slot];
+  }
+
+  if (!hash_table_is_rehashing(hash_table))
+    return NULL;
+
+  long slot = table_find(hash_table->rehash_ctrl, hash_table->rehash_slots,
+                         hash_table->rehash_size, h, key);
+  if (slot != -1)
+    return &hash_table->rehash_slots[slot];
+
+  return NULL;
+}
+
+// Makes room in the table new entries go to: starts a rehash, or grows the
+// new table when new entries outran the migration. Not while iterators are
+// out, they would miss entries that move.
+static void hash_table_make_room(HashTable *hash_table) {
+  if (!hash_table_is_rehashing(hash_table))
+    hash_table_start_rehash(hash_table);
+  else if (hash_table->paused == 0)
+    hash_table_grow_target(hash_table);
+}
+
+// Picks the table new entries go to, the one that survives the rehash
+static long hash_table_insert_slot(HashTable *hash_table, uint64_t h,
+                                   Node **slots) {
+  if (hash_table_is_rehashing(hash_table)) {
+    *slots = hash_table->rehash_slots;
+    return table_insert_slot(hash_table->rehash_ctrl, hash_table->rehash_size,
+                             h, &hash_table->rehash_used);
+  }
+
+  *slots = hash_table->slots;
+  return table_insert_slot(hash_table->ctrl, hash_table->size, h,
+                           &hash_table->used);
+}
+
+int hash_table_set(HashTable *hash_table, Bytes *key, r_obj *val) {
+
+  if (hash_table_is_rehashing(hash_table)) {
+    hash_table_rehash_step(hash_table);
+
+    if (hash_table_is_rehashing(hash_table) &&
+        hash_table->rehash_used + 1 > hash_table->rehash_size / 8 * 7)
+      hash_table_make_room(hash_table);
+  } else if (hash_table->used + 1 > hash_table->size / 8 * 7) {
+    hash_table_make_room(hash_table);
+  }
+
+  Node *entry = hash_table_find(hash_table, key);
+  if (entry) {
+    free_object(entry->value);
+    entry->value = val;
+
+    return 0;
+  }
+
+  uint64_t h = hash(key);
+  Bytes *key_copy;
+  Node *slots;
+
+  if ((key_copy = hash_key_dup(key, 0)) == NULL)
+    return -1;
+
+  long slot = hash_table_insert_slot(hash_table, h, &slots);
+  if (slot == -1) {
+    hash_table_make_room(hash_table);
+    slot = hash_table_insert_slot(hash_table, h, &slots);
+  }
+
+  // Paused with the new table full: the old one still takes entries whose
+  // home group has yet to move, the migration picks them up later
+  if (slot == -1 && hash_table_is_rehashing(hash_table) &&
+      hash_table_in_old(hash_table, h)) {
+    slots = hash_table->slots;
+    slot = table_insert_slot(hash_table->ctrl, hash_table->size, h,
+                             &hash_table->used);
+  }
+
+  // Full during a paused rehash, or out of memory: nothing was stored
+  if (slot == -1) {
+    free(key_copy);
+    return -1;
+  }
+
+  slots[slot].key = key_copy;
+  slots[slot].value = val;
+  hash_table->count++;
+  return 0;
+}
+
+r_obj *hash_table_get(HashTable *hash_table, Bytes *key) {
+
+  if (hash_table_is_rehashing(hash_table))
+    hash_table_rehash_step(hash_table);
+
+  Node *entry = hash_table_find(hash_table, key);
+  if (entry)
+    return entry->value;
+
+  return NULL;
+}
+
+Node *hash_table_find_entry(HashTable *hash_table, Bytes *key) {
+
+  if (hash_table_is_rehashing(hash_table))
+    hash_table_rehash_step(hash_table);
+
+  return hash_table_find(hash_table, key);
+}
+
+// Unlinks key; the value is handed to *taken when given, freed otherwise
+static int hash_table_del_from(HashTable *hash_table, uint8_t *ctrl,
+                               Node *slots, size_t size, size_t *used,
+                               uint64_t h, Bytes *key, r_obj **taken) {
+  long slot = table_find(ctrl, slots, size, h, key);
+  if (slot == -1)
+    return 0;
+
+  if (taken)
+    *taken = slots[slot].value;
+  else
+    free_object(slots[slot].value);
+  hash_key_free(hash_table, slots[slot].key);
+
+  table_erase_slot(ctrl, slot, used);
+  hash_table->count--;
+  return 1;
+}
+
+static int hash_table_remove(HashTable *hash_table, Bytes *key,
+                             r_obj **taken) {
+
+  if (hash_table_is_rehashing(hash_table))
+    hash_table_rehash_step(hash_table);
+
+  uint64_t h = hash(key);
+
+  if (hash_table_in_old(hash_table, h) &&
+      hash_table_del_from(hash_table, hash_table->ctrl, hash_table->slots,
+                          hash_table->size, &hash_table->used, h, key,
+                          taken) == 1) {
+    if (!hash_table_is_rehashing(hash_table) && !hash_table->paused &&
+        hash_table->size > GROUP_WIDTH &&
+        hash_table->count * SHRINK_RATIO < hash_table->size)
+      hash_table_start_rehash(hash_table);
+    return 1;
+  }
+
+  if (hash_table_is_rehashing(hash_table))
+    return hash_table_del_from(hash_table, hash_table->rehash_ctrl,
+                               hash_table->rehash_slots,
+                               hash_table->rehash_size,
+                               &hash_table->rehash_used, h, key, taken);
+
+  return 0;
+}
+
+int hash_table_del(HashTable *hash_table, Bytes *key) {
+  return hash_table_remove(hash_table, key, NULL);
+}
+
+r_obj *hash_table_take(HashTable *hash_table, Bytes *key) {
+  r_obj *val = NULL;
+  hash_table_remove(hash_table, key, &val);
+  return val;
+}
+
+static void table_free(uint8_t *ctrl, Node *slots, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    if (ctrl[i] & 0x80)
+      continue;
+
+    free(slots[i].key);
+    if (slots[i].value)
+      free_object(slots[i].value);
+  }
+
+  free(ctrl);
+  free(slots);
+}
+
+void hash_table_destroy(HashTable *hash_table) {
+  if (!hash_table)
+    return;
+
+  table_free(hash_table->ctrl, hash_table->slots, hash_table->size);
+
+  if (hash_table->rehash_ctrl)
+    table_free(hash_table->rehash_ctrl, hash_table->rehash_slots,
+               hash_table->rehash_size);
+
+  free(hash_table->expiring);
+  free(hash_table);
+}
+
+void hash_table_iterator_init(HashTable *hash_table, HashTableIterator *it) {
+  it->hash_table = hash_table;
+  it->table = 0;
+  it->index = 0;
+  it->entry = NULL;
+  it->next_entry = NULL;
+
+  hash_table->paused++;
+}
+
+Node *hash_table_next(HashTableIterator *it) {
+  HashTable *hash_table = it->hash_table;
+
+  while (1) {
+    uint8_t *ctrl = hash_table->ctrl;
+    Node *slots = hash_table->slots;
+    size_t size = hash_table->size;
+
+    if (it->table == 1) {
+      ctrl = hash_table->rehash_ctrl;
+      slots = hash_table->rehash_slots;
+      size = hash_table->rehash_size;
+    }
+
+    while (it->index < size) {
+      size_t i = it->index++;
+      if (!(ctrl[i] & 0x80))
+        return &slots[i];
+    }
+
+    if (it->table == 0 && hash_table_is_rehashing(hash_table)) {
+      it->table = 1;
+      it->index = 0;
+      continue;
+    }
+
+    return NULL;
+  }
+}
+
+void hash_table_iterator_release(HashTableIterator *it) {
+  it->hash_table->paused--;
+}
+
+Node *hash_table_random_entry(HashTable *hash_table) {
+  if (hash_table->count == 0)
+    return NULL;
+
+  if (hash_table_is_rehashing(hash_table))
+    hash_table_rehash_step(hash_table);
+
+  for (int tries = 0; tries < RANDOM_ENTRY_TRIES; tries++) {
+    uint8_t *ctrl = hash_table->ctrl;
+    Node *slots = hash_table->slots;
+    size_t size = hash_table->size;
+
+    if (hash_table_is_rehashing(hash_table) && (random() & 1)) {
+      ctrl = hash_table->rehash_ctrl;
+      slots = hash_table->rehash_slots;
+      size = hash_table->rehash_size;
+    }
+
+    size_t i = random() & (size - 1);
+    if (!(ctrl[i] & 0x80))
+      return &slots[i];
+  }
+
+  return NULL;
+}
+
+#endif // HASH_TABLE_OPEN_ADDRESSING
@@ -37,6 +37,8 @@ r_obj *create_hnsw_object(DistanceMetric metric, int M, int ef_construction,
     return NULL;
 
   o->type = HNSW;
+  o->refcount = 1;
+  o->encoding = OBJ_ENCODING_RAW;
   o->data = (void *)hnsw_create(metric, M, ef_construction, dimension);
 
   return o;
@@ -390,7 +392,9 @@ void hnsw_insert(HNSWIndex *index, const Bytes *key, Vector *v) {
     index->current_max_layer = level;
   }
 
-  hash_table_set(index->key_to_id, (Bytes *)key, create_int_object(node_id));
+  r_obj *id_o = create_int_object(node_id);
+  if (hash_table_set(index->key_to_id, (Bytes *)key, id_o) != 0)
+    free_object(id_o);
 
   index->memory_used += vector_memory + key_len + node_mem;
 }
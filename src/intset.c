@@ -0,0 +1,277 @@
+#include "../include/intset.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static uint32_t intset_value_encoding(int64_t v) {
+  if (v < INT32_MIN || v > INT32_MAX)
+    return INTSET_ENC_INT64;
+  if (v < INT16_MIN || v > INT16_MAX)
+    return INTSET_ENC_INT32;
+  return INTSET_ENC_INT16;
+}
+
+static int64_t intset_get_encoded(const IntSet *is, uint32_t pos,
+                                  uint32_t enc) {
+  if (enc == INTSET_ENC_INT64) {
+    int64_t v64;
+    memcpy(&v64, is->contents + (size_t)pos * sizeof(v64), sizeof(v64));
+    return v64;
+  }
+
+  if (enc == INTSET_ENC_INT32) {
+    int32_t v32;
+    memcpy(&v32, is->contents + (size_t)pos * sizeof(v32), sizeof(v32));
+    return v32;
+  }
+
+  int16_t v16;
+  memcpy(&v16, is->contents + (size_t)pos * sizeof(v16), sizeof(v16));
+  return v16;
+}
+
+static void intset_set(IntSet *is, uint32_t pos, int64_t value) {
+  if (is->encoding == INTSET_ENC_INT64) {
+    int64_t v64 = value;
+    memcpy(is->contents + (size_t)pos * sizeof(v64), &v64, sizeof(v64));
+  } else if (is->encoding == INTSET_ENC_INT32) {
+    int32_t v32 = (int32_t)value;
+    memcpy(is->contents + (size_t)pos * sizeof(v32), &v32, sizeof(v32));
+  } else {
+    int16_t v16 = (int16_t)value;
+    memcpy(is->contents + (size_t)pos * sizeof(v16), &v16, sizeof(v16));
+  }
+}
+
+int64_t intset_get(const IntSet *is, uint32_t pos) {
+  return intset_get_encoded(is, pos, is->encoding);
+}
+
+IntSet *intset_new(void) {
+  IntSet *is;
+
+  if ((is = (IntSet *)malloc(sizeof(IntSet))) == NULL)
+    return NULL;
+
+  is->encoding = INTSET_ENC_INT16;
+  is->length = 0;
+  return is;
+}
+
+static IntSet *intset_resize(IntSet *is, uint32_t len) {
+  return realloc(is, sizeof(IntSet) + (size_t)len * is->encoding);
+}
+
+// Binary search. Returns 1 with *pos at the value if it is there, 0 with
+// *pos where it would be inserted otherwise.
+static int intset_search(const IntSet *is, int64_t value, uint32_t *pos) {
+  if (is->length == 0) {
+    *pos = 0;
+    return 0;
+  }
+
+  // Appends and prepends are common, they skip the search
+  if (value > intset_get(is, is->length - 1)) {
+    *pos = is->length;
+    return 0;
+  }
+  if (value < intset_get(is, 0)) {
+    *pos = 0;
+    return 0;
+  }
+
+  uint32_t lo = 0, hi = is->length;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int64_t cur = intset_get(is, mid);
+
+    if (cur == value) {
+      *pos = mid;
+      return 1;
+    }
+
+    if (cur < value)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  *pos = lo;
+  return 0;
+}
+
+// The value doesn't fit the current width, so it is either below or above
+// every element: the array is widened in place from the back and the value
+// goes at one of the ends
+static IntSet *intset_upgrade_and_add(IntSet *is, int64_t value) {
+  uint32_t old_enc = is->encoding;
+  uint32_t len = is->length;
+  IntSet *grown;
+
+  is->encoding = intset_value_encoding(value);
+  if ((grown = intset_resize(is, len + 1)) == NULL) {
+    is->encoding = old_enc;
+    return NULL;
+  }
+  is = grown;
+
+  uint32_t prepend = value < 0 ? 1 : 0;
+  for (uint32_t i = len; i-- > 0;)
+    intset_set(is, i + prepend, intset_get_encoded(is, i, old_enc));
+
+  intset_set(is, prepend ? 0 : len, value);
+  is->length = len + 1;
+  return is;
+}
+
+// Returns the set, which may have moved. On failure the set is left as it
+// was and *added is 0.
+IntSet *intset_add(IntSet *is, int64_t value, int *added) {
+  IntSet *grown;
+  uint32_t pos;
+
+  *added = 0;
+
+  if (intset_value_encoding(value) > is->encoding) {
+    if ((grown = intset_upgrade_and_add(is, value)) == NULL)
+      return is;
+
+    *added = 1;
+    return grown;
+  }
+
+  if (intset_search(is, value, &pos))
+    return is;
+
+  if ((grown = intset_resize(is, is->length + 1)) == NULL)
+    return is;
+  is = grown;
+
+  memmove(is->contents + (size_t)(pos + 1) * is->encoding,
+          is->contents + (size_t)pos * is->encoding,
+          (size_t)(is->length - pos) * is->encoding);
+
+  intset_set(is, pos, value);
+  is->length++;
+  *added = 1;
+  return is;
+}
+
+// The encoding is kept, sets only ever get wider
+IntSet *intset_remove(IntSet *is, int64_t value, int *removed) {
+  uint32_t pos;
+
+  *removed = 0;
+
+  if (intset_value_encoding(value) > is->encoding ||
+      !intset_search(is, value, &pos))
+    return is;
+
+  memmove(is->contents + (size_t)pos * is->encoding,
+          is->contents + (size_t)(pos + 1) * is->encoding,
+          (size_t)(is->length - pos - 1) * is->encoding);
+  is->length--;
+  *removed = 1;
+
+  // Shrinking can't fail to keep the data, but realloc may still refuse
+  IntSet *shrunk = intset_resize(is, is->length);
+  return shrunk != NULL ? shrunk : is;
+}
+
+int intset_find(const IntSet *is, int64_t value) {
+  uint32_t pos;
+
+  return intset_value_encoding(value) <= is->encoding &&
+         intset_search(is, value, &pos);
+}
+
+// Index of the first element at or after `pos` that is >= value, length if
+// there is none. Intersections walk each set forward with this: one SIMD
+// compare covers the next block when the sets are about as dense, then it
+// gallops (1, 2, 4, ... elements ahead) and binary searches the last step,
+// so a much larger set costs O(log distance) per probe.
+uint32_t intset_seek(const IntSet *is, uint32_t pos, int64_t value) {
+  uint32_t len = is->length;
+
+  if (pos >= len || intset_get(is, len - 1) < value)
+    return len;
+  if (intset_get(is, pos) >= value)
+    return pos;
+
+  // From here on the element at pos is below value and the last one is not,
+  // so value fits the encoding
+
+#ifdef __SSE2__
+  if (is->encoding == INTSET_ENC_INT16 && pos + 8 <= len) {
+    __m128i block = _mm_loadu_si128(
+        (const __m128i *)(is->contents + (size_t)pos * sizeof(int16_t)));
+    __m128i lt = _mm_cmplt_epi16(block, _mm_set1_epi16((int16_t)value));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(lt);
+
+    // Sorted, so the lanes below value are a prefix
+    if (mask != 0xFFFF)
+      return pos + __builtin_popcount(mask) / 2;
+    pos += 7;
+  } else if (is->encoding == INTSET_ENC_INT32 && pos + 4 <= len) {
+    __m128i block = _mm_loadu_si128(
+        (const __m128i *)(is->contents + (size_t)pos * sizeof(int32_t)));
+    __m128i lt = _mm_cmplt_epi32(block, _mm_set1_epi32((int32_t)value));
+    uint32_t mask = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(lt));
+
+    if (mask != 0xF)
+      return pos + __builtin_popcount(mask);
+    pos += 3;
+  }
+#endif
+
+  // Invariant: element at lo < value <= element at hi
+  uint32_t lo = pos, hi;
+  uint32_t step = 1;
+
+  while (1) {
+    hi = lo + step;
+    if (hi >= len - 1) {
+      hi = len - 1;
+      break;
+    }
+    if (intset_get(is, hi) >= value)
+      break;
+
+    lo = hi;
+    step <<= 1;
+  }
+
+  while (hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if (intset_get(is, mid) < value)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  return hi;
+}
+
+// Checks a blob read from disk: known encoding, matching size, elements
+// strictly ascending
+int intset_valid(const IntSet *is, size_t len) {
+  if (len < sizeof(IntSet))
+    return 0;
+
+  if (is->encoding != INTSET_ENC_INT16 && is->encoding != INTSET_ENC_INT32 &&
+      is->encoding != INTSET_ENC_INT64)
+    return 0;
+
+  if (intset_blob_len(is) != len)
+    return 0;
+
+  for (uint32_t i = 1; i < is->length; i++)
+    if (intset_get(is, i - 1) >= intset_get(is, i))
+      return 0;
+
+  return 1;
+}
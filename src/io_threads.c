@@ -0,0 +1,133 @@
+#include "../include/io_threads.h"
+#include "../include/parser.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// I/O threads only touch per-client state: the query buffer, the parsed
+// argument array and the output buffer. The main thread blocks in
+// io_threads_run until every thread has finished its slice, so nothing here
+// ever runs concurrently with command execution.
+
+typedef struct IOThread_ {
+  pthread_t tid;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  Client **clients;
+  int count;
+  io_op op;
+
+  atomic_int pending;
+} IOThread;
+
+static IOThread io_threads[IO_THREADS_MAX];
+static int io_threads_active = 1;
+
+// Reads whatever is available and parses the first complete command so the
+// main thread can execute it straight away.
+static void io_read_client(Client *c) {
+  c->io_status = read_from_client(c);
+  c->parsed_consumed = 0;
+
+  if (c->io_status != 0 || c->blocked || client_output_paused(c) ||
+      c->query_pos >= c->query_length)
+    return;
+
+  size_t consumed = parse_resp_request(c, c->query_buffer + c->query_pos,
+                                       c->query_length - c->query_pos);
+
+  if (consumed == 0 || consumed == (size_t)-1) {
+    reset_client_args(c);
+    return;
+  }
+
+  c->parsed_consumed = consumed;
+}
+
+static void io_process(Client **clients, int count, io_op op, int stride,
+                       int offset) {
+  for (int i = offset; i < count; i += stride) {
+    if (op == IO_OP_READ)
+      io_read_client(clients[i]);
+    else
+      flush_buffer(clients[i]->output_buffer);
+  }
+}
+
+static void *io_thread_main(void *arg) {
+  IOThread *t = (IOThread *)arg;
+  int id = (int)(t - io_threads);
+
+  while (1) {
+    pthread_mutex_lock(&t->lock);
+    while (atomic_load(&t->pending) == 0)
+      pthread_cond_wait(&t->cond, &t->lock);
+    pthread_mutex_unlock(&t->lock);
+
+    io_process(t->clients, t->count, t->op, io_threads_active, id);
+
+    atomic_store(&t->pending, 0);
+  }
+
+  return NULL;
+}
+
+int io_threads_init(int count) {
+  if (count < 1)
+    count = 1;
+  if (count > IO_THREADS_MAX)
+    count = IO_THREADS_MAX;
+
+  // Slot 0 is the main thread itself
+  for (int i = 1; i < count; i++) {
+    IOThread *t = &io_threads[i];
+
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    atomic_init(&t->pending, 0);
+
+    if (pthread_create(&t->tid, NULL, io_thread_main, t) != 0) {
+      perror("pthread_create");
+      count = i;
+      break;
+    }
+  }
+
+  io_threads_active = count;
+  return count;
+}
+
+int io_threads_count(void) { return io_threads_active; }
+
+// Splits `clients` round-robin over all I/O threads, takes the first share on
+// the calling thread and waits for the others to finish.
+void io_threads_run(Client **clients, int count, io_op op) {
+  if (count == 0)
+    return;
+
+  int threads = io_threads_active;
+  if (threads > count)
+    threads = count;
+
+  for (int i = 1; i < threads; i++) {
+    IOThread *t = &io_threads[i];
+
+    pthread_mutex_lock(&t->lock);
+    t->clients = clients;
+    t->count = count;
+    t->op = op;
+    atomic_store(&t->pending, 1);
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+  }
+
+  io_process(clients, count, op, io_threads_active, 0);
+
+  for (int i = 1; i < threads; i++) {
+    while (atomic_load(&io_threads[i].pending) != 0)
+      ;
+  }
+}
@@ -0,0 +1,79 @@
+#include "../include/latency.h"
+
+#include <time.h>
+
+int latency_tracking = 1;
+
+// latency_now() ticks per microsecond, measured once at startup
+static double cycles_per_usec = 1000.0;
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void latency_init(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  struct timespec pause = {0, 10 * 1000 * 1000};
+
+  uint64_t ns = monotonic_ns();
+  uint64_t cycles = latency_now();
+  nanosleep(&pause, NULL);
+  ns = monotonic_ns() - ns;
+  cycles = latency_now() - cycles;
+
+  if (ns > 0 && cycles > 0)
+    cycles_per_usec = (double)cycles * 1000.0 / (double)ns;
+#endif
+}
+
+void latency_merge(LatencyHistogram *dst, const LatencyHistogram *src) {
+  dst->calls += __atomic_load_n(&src->calls, __ATOMIC_RELAXED);
+  dst->total += __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+
+  for (int i = 0; i < LATENCY_BUCKETS; i++)
+    dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+}
+
+double latency_usec(uint64_t cycles) {
+  return (double)cycles / cycles_per_usec;
+}
+
+uint64_t latency_cycles(double usec) {
+  return (uint64_t)(usec * cycles_per_usec);
+}
+
+// Upper bound of a bucket
+double latency_bucket_usec(int bucket) {
+  if (bucket < LATENCY_SUB_COUNT)
+    return latency_usec(bucket + 1);
+
+  int exp = bucket / LATENCY_SUB_COUNT + LATENCY_SUB_BITS - 1;
+  uint64_t sub = LATENCY_SUB_COUNT + bucket % LATENCY_SUB_COUNT;
+
+  return latency_usec((sub + 1) << (exp - LATENCY_SUB_BITS));
+}
+
+// percentile in [0, 100]
+double latency_percentile(const LatencyHistogram *h, double percentile) {
+  if (h->calls == 0)
+    return 0;
+
+  double exact = (double)h->calls * percentile / 100.0;
+  // The smallest rank covering the percentile, at least the first call
+  uint64_t rank = (uint64_t)exact;
+  if (rank < exact)
+    rank++;
+  if (rank == 0)
+    rank = 1;
+
+  uint64_t seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank)
+      return latency_bucket_usec(i);
+  }
+
+  return latency_bucket_usec(LATENCY_BUCKETS - 1);
+}
@@ -1,8 +1,11 @@
 #include "../include/list.h"
+#include "../include/lzf.h"
 #include "../include/recis.h"
 #include "stdlib.h"
 #include <stdio.h>
 
+int list_compress_depth = LIST_COMPRESS_DEPTH;
+
 r_obj *create_list_object() {
   r_obj *o;
   if ((o = (r_obj *)malloc(sizeof(r_obj))) == NULL) {
@@ -10,6 +13,8 @@ r_obj *create_list_object() {
   }
 
   o->type = LIST;
+  o->refcount = 1;
+  o->encoding = OBJ_ENCODING_RAW;
   o->data = list_create();
 
   if (o->data == NULL) {
@@ -29,113 +34,363 @@ List *list_create() {
 
   list->head = NULL;
   list->tail = NULL;
+  list->open = NULL;
   list->size = 0;
+  list->chunks = 0;
   return list;
 }
 
-int list_ins_node_head(List *list, r_obj *value) {
-  ListNode *new_node;
+static ListChunk *list_chunk_create(void) {
+  ListChunk *chunk;
 
-  if ((new_node = (ListNode *)malloc(sizeof(ListNode))) == NULL) {
-    return -1;
+  if ((chunk = (ListChunk *)malloc(sizeof(ListChunk))) == NULL)
+    return NULL;
+
+  if ((chunk->lp = listpack_new()) == NULL) {
+    free(chunk);
+    return NULL;
   }
 
-  new_node->value = value;
+  chunk->prev = NULL;
+  chunk->next = NULL;
+  chunk->lzf = NULL;
+  chunk->count = 0;
+  return chunk;
+}
 
-  if (list_size(list) == 0) {
-    list->head = list->tail = new_node;
-    new_node->prev = new_node->next = NULL;
-  } else {
-    new_node->prev = NULL;
-    new_node->next = list->head;
-    list->head->prev = new_node;
-    list->head = new_node;
+static void list_chunk_free(ListChunk *chunk) {
+  free(chunk->lp);
+  free(chunk->lzf);
+  free(chunk);
+}
+
+static void list_chunk_unlink(List *list, ListChunk *chunk) {
+  if (chunk->prev)
+    chunk->prev->next = chunk->next;
+  else
+    list->head = chunk->next;
+
+  if (chunk->next)
+    chunk->next->prev = chunk->prev;
+  else
+    list->tail = chunk->prev;
+
+  if (list->open == chunk)
+    list->open = NULL;
+
+  list->size -= chunk->count;
+  list->chunks--;
+
+  list_chunk_free(chunk);
+}
+
+// Whether the chunk is more than list_compress_depth chunks away from both
+// ends
+static int list_chunk_interior(List *list, ListChunk *chunk) {
+  if (list_compress_depth <= 0)
+    return 0;
+
+  ListChunk *head = list->head;
+  ListChunk *tail = list->tail;
+
+  for (int i = 0; i < list_compress_depth; i++) {
+    if (head == chunk || tail == chunk)
+      return 0;
+    if (head == NULL || tail == NULL)
+      return 0;
+
+    head = head->next;
+    tail = tail->prev;
   }
 
-  list->size++;
-  return 0;
+  return head != NULL && tail != NULL;
 }
 
-int list_ins_node_tail(List *list, r_obj *value) {
-  ListNode *new_node;
+// Keeps the listpack as it is when compressing doesn't save anything
+static void list_chunk_compress(ListChunk *chunk) {
+  if (chunk->lp == NULL)
+    return;
 
-  if ((new_node = (ListNode *)malloc(sizeof(ListNode))) == NULL) {
-    return -1;
+  size_t raw = listpack_blob_len(chunk->lp);
+  if (raw < LIST_COMPRESS_MIN_BYTES)
+    return;
+
+  ListChunkLzf *lzf;
+  if ((lzf = (ListChunkLzf *)malloc(sizeof(ListChunkLzf) + raw)) == NULL)
+    return;
+
+  // Has to save at least a few bytes to pay for the header
+  size_t bytes =
+      lzf_compress((unsigned char *)chunk->lp, raw, lzf->data, raw - 8);
+  if (bytes == 0) {
+    free(lzf);
+    return;
   }
 
-  new_node->value = value;
+  ListChunkLzf *shrunk;
+  if ((shrunk = realloc(lzf, sizeof(ListChunkLzf) + bytes)) != NULL)
+    lzf = shrunk;
 
-  if (list_size(list) == 0) {
-    list->tail = list->head = new_node;
-    new_node->prev = new_node->next = NULL;
-  } else {
-    new_node->next = NULL;
-    new_node->prev = list->tail;
-    list->tail->next = new_node;
-    list->tail = new_node;
+  lzf->raw = (uint32_t)raw;
+  lzf->bytes = (uint32_t)bytes;
+
+  free(chunk->lp);
+  chunk->lp = NULL;
+  chunk->lzf = lzf;
+}
+
+// Puts the open chunk back in compressed form if it is still interior
+static void list_chunk_close(List *list) {
+  ListChunk *chunk = list->open;
+
+  if (chunk == NULL)
+    return;
+
+  list->open = NULL;
+  if (list_chunk_interior(list, chunk))
+    list_chunk_compress(chunk);
+}
+
+// Returns the chunk's listpack, decompressing it first if needed. An
+// interior chunk stays decompressed until the next one is needed, so the
+// data read from it stays valid until the next call. NULL when out of
+// memory.
+static Listpack *list_chunk_raw(List *list, ListChunk *chunk) {
+  if (chunk->lp != NULL)
+    return chunk->lp;
+
+  list_chunk_close(list);
+
+  Listpack *lp;
+  if ((lp = (Listpack *)malloc(chunk->lzf->raw)) == NULL)
+    return NULL;
+
+  if (lzf_decompress(chunk->lzf->data, chunk->lzf->bytes, (unsigned char *)lp,
+                     chunk->lzf->raw) != chunk->lzf->raw) {
+    free(lp);
+    return NULL;
   }
 
+  free(chunk->lzf);
+  chunk->lzf = NULL;
+  chunk->lp = lp;
+
+  if (list_chunk_interior(list, chunk))
+    list->open = chunk;
+
+  return lp;
+}
+
+// An empty chunk takes anything, so oversized elements still find a home
+static int list_chunk_fits(ListChunk *chunk, uint32_t len) {
+  return chunk->count == 0 ||
+         chunk->lp->bytes + listpack_entry_size(len) <= LIST_CHUNK_BYTES;
+}
+
+// A new end chunk pushes the one list_compress_depth chunks in from that
+// end into the interior
+static void list_compress_from(List *list, ListChunk *chunk, int forward) {
+  if (list_compress_depth <= 0)
+    return;
+
+  for (int i = 0; i < list_compress_depth && chunk; i++)
+    chunk = forward ? chunk->next : chunk->prev;
+
+  if (chunk != NULL && chunk != list->open && list_chunk_interior(list, chunk))
+    list_chunk_compress(chunk);
+}
+
+int list_push_head(List *list, const char *data, uint32_t len) {
+  ListChunk *chunk = list->head;
+
+  if (chunk != NULL && list_chunk_raw(list, chunk) == NULL)
+    return -1;
+
+  if (chunk == NULL || !list_chunk_fits(chunk, len)) {
+    if ((chunk = list_chunk_create()) == NULL)
+      return -1;
+
+    chunk->next = list->head;
+    if (list->head)
+      list->head->prev = chunk;
+    else
+      list->tail = chunk;
+    list->head = chunk;
+    list->chunks++;
+
+    list_compress_from(list, chunk, 1);
+  }
+
+  Listpack *lp;
+  if ((lp = listpack_prepend(chunk->lp, data, len)) == NULL)
+    return -1;
+
+  chunk->lp = lp;
+  chunk->count++;
   list->size++;
   return 0;
 }
 
-r_obj *list_pop_tail(List *list) {
-  if (list_size(list) == 0)
-    return NULL;
+int list_push_tail(List *list, const char *data, uint32_t len) {
+  ListChunk *chunk = list->tail;
 
-  ListNode *node = list->tail;
-  r_obj *value = node->value;
+  if (chunk != NULL && list_chunk_raw(list, chunk) == NULL)
+    return -1;
 
-  if (list->head == list->tail) {
-    list->head = NULL;
-    list->tail = NULL;
-  } else {
-    list->tail = node->prev;
-    list->tail->next = NULL;
+  if (chunk == NULL || !list_chunk_fits(chunk, len)) {
+    if ((chunk = list_chunk_create()) == NULL)
+      return -1;
+
+    chunk->prev = list->tail;
+    if (list->tail)
+      list->tail->next = chunk;
+    else
+      list->head = chunk;
+    list->tail = chunk;
+    list->chunks++;
+
+    list_compress_from(list, chunk, 0);
   }
 
-  free(node);
-  list->size--;
+  Listpack *lp;
+  if ((lp = listpack_append(chunk->lp, data, len)) == NULL)
+    return -1;
 
-  return value;
+  chunk->lp = lp;
+  chunk->count++;
+  list->size++;
+  return 0;
 }
 
-r_obj *list_pop_head(List *list) {
-  if (list_size(list) == 0)
-    return NULL;
-  ListNode *node = list->head;
-  r_obj *value = node->value;
+// Finds the chunk holding element `index` (0 <= index < size) and the
+// element's position within it
+static ListChunk *list_locate(List *list, size_t index, uint32_t *offset) {
+  ListChunk *chunk;
 
-  if (list->head == list->tail) {
-    list->head = NULL;
-    list->tail = NULL;
+  if (index < list->size / 2) {
+    for (chunk = list->head; index >= chunk->count; chunk = chunk->next)
+      index -= chunk->count;
   } else {
-    list->head = node->next;
-    list->head->prev = NULL;
+    size_t from_tail = list->size - 1 - index;
+
+    for (chunk = list->tail; from_tail >= chunk->count; chunk = chunk->prev)
+      from_tail -= chunk->count;
+
+    index = chunk->count - 1 - from_tail;
   }
 
-  free(node);
-  list->size--;
+  *offset = (uint32_t)index;
+  return chunk;
+}
+
+// Element at index, negative indexes count from the tail. The data points
+// into the list and is only valid until the next call on it. Returns 0 if
+// out of range.
+int list_index(List *list, long index, Bytes *out) {
+  if (index < 0)
+    index += (long)list->size;
+  if (index < 0 || (size_t)index >= list->size)
+    return 0;
+
+  uint32_t offset;
+  ListChunk *chunk = list_locate(list, (size_t)index, &offset);
+  Listpack *lp;
 
-  return value;
+  if ((lp = list_chunk_raw(list, chunk)) == NULL)
+    return 0;
+
+  listpack_get(listpack_seek(lp, offset), out);
+  return 1;
 }
 
-ListNode *list_get_node_at(List *list, size_t index, int from_tail) {
-  if (index >= list_size(list))
-    return NULL;
+// Removes `head` elements from the front and `tail` from the back. Chunks
+// that go entirely are freed without looking at their elements.
+void list_trim(List *list, size_t head, size_t tail) {
+  while (head > 0 && list->head) {
+    ListChunk *chunk = list->head;
 
-  ListNode *member;
-  if (from_tail) {
-    for (member = list->tail; index > 0; index--) {
-      member = member->prev;
+    if (head >= chunk->count) {
+      head -= chunk->count;
+      list_chunk_unlink(list, chunk);
+      continue;
     }
-  } else {
-    for (member = list->head; index > 0; index--) {
-      member = member->next;
+
+    if (list_chunk_raw(list, chunk) == NULL)
+      break;
+
+    chunk->lp =
+        listpack_delete_range(chunk->lp, listpack_first(chunk->lp), head);
+    chunk->count -= head;
+    list->size -= head;
+    head = 0;
+  }
+
+  while (tail > 0 && list->tail) {
+    ListChunk *chunk = list->tail;
+
+    if (tail >= chunk->count) {
+      tail -= chunk->count;
+      list_chunk_unlink(list, chunk);
+      continue;
+    }
+
+    if (list_chunk_raw(list, chunk) == NULL)
+      break;
+
+    chunk->lp = listpack_delete_range(
+        chunk->lp, listpack_seek(chunk->lp, (long)(chunk->count - tail)),
+        tail);
+    chunk->count -= tail;
+    list->size -= tail;
+    tail = 0;
+  }
+}
+
+// Positions the iterator at element `index`, past the end if out of range
+void list_iterator_init(List *list, size_t index, ListIterator *it) {
+  it->list = list;
+  it->chunk = NULL;
+  it->p = NULL;
+
+  if (index >= list->size)
+    return;
+
+  uint32_t offset;
+  ListChunk *chunk = list_locate(list, index, &offset);
+  Listpack *lp;
+
+  if ((lp = list_chunk_raw(list, chunk)) == NULL)
+    return;
+
+  it->chunk = chunk;
+  it->p = listpack_seek(lp, offset);
+}
+
+// The data points into the list and is only valid until the next call, the
+// list must not change while iterating. Moving on to the next chunk only
+// happens here, after the caller is done with the previous element, as it
+// may compress the chunk that element came from.
+int list_next(ListIterator *it, Bytes *out) {
+  while (it->chunk != NULL && it->p == NULL) {
+    Listpack *lp;
+
+    it->chunk = it->chunk->next;
+    if (it->chunk == NULL)
+      break;
+
+    if ((lp = list_chunk_raw(it->list, it->chunk)) == NULL) {
+      it->chunk = NULL;
+      break;
     }
+    it->p = listpack_first(lp);
   }
 
-  return member;
+  if (it->chunk == NULL)
+    return 0;
+
+  listpack_get(it->p, out);
+  it->p = listpack_next(it->chunk->lp, it->p);
+  return 1;
 }
 
 void list_destroy(List *list) {
@@ -143,11 +398,13 @@ void list_destroy(List *list) {
   if (list == NULL)
     return;
 
-  while (list->size > 0) {
-    r_obj *value = list_pop_tail(list);
+  ListChunk *chunk = list->head;
+  while (chunk) {
+    ListChunk *next = chunk->next;
+
+    list_chunk_free(chunk);
 
-    if (value)
-      free_object(value);
+    chunk = next;
   }
 
   free(list);
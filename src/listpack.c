@@ -0,0 +1,344 @@
+#include "../include/listpack.h"
+#include <stdlib.h>
+#include <string.h>
+
+// <len> encodings: 0xxxxxxx up to 127 bytes, 10xxxxxx xxxxxxxx up to 16383,
+// then 0xC0 followed by a 32-bit length
+#define LISTPACK_LEN_7BIT_MAX 0x7F
+#define LISTPACK_LEN_14BIT_MAX 0x3FFF
+#define LISTPACK_LEN_32BIT 0xC0
+
+static size_t listpack_header_size(uint32_t len) {
+  if (len <= LISTPACK_LEN_7BIT_MAX)
+    return 1;
+  if (len <= LISTPACK_LEN_14BIT_MAX)
+    return 2;
+  return 1 + sizeof(uint32_t);
+}
+
+static size_t listpack_backlen_size(size_t n) {
+  size_t size = 1;
+  while (n > 0x7F) {
+    n >>= 7;
+    size++;
+  }
+  return size;
+}
+
+// Bytes an entry holding len bytes of data takes up
+size_t listpack_entry_size(uint32_t len) {
+  size_t n = listpack_header_size(len) + len;
+  return n + listpack_backlen_size(n);
+}
+
+static uint32_t listpack_decode_len(const unsigned char *p, size_t *header) {
+  if (p[0] <= LISTPACK_LEN_7BIT_MAX) {
+    *header = 1;
+    return p[0];
+  }
+
+  if (p[0] < LISTPACK_LEN_32BIT) {
+    *header = 2;
+    return ((uint32_t)(p[0] & 0x3F) << 8) | p[1];
+  }
+
+  uint32_t len;
+  memcpy(&len, p + 1, sizeof(len));
+  *header = 1 + sizeof(uint32_t);
+  return len;
+}
+
+// The group holding the lowest 7 bits sits last, right before the next
+// entry. Every byte but the first has its top bit set, so reading backwards
+// stops at the first one.
+static void listpack_write_backlen(unsigned char *p, size_t n) {
+  size_t size = listpack_backlen_size(n);
+
+  for (size_t i = size; i-- > 0;) {
+    p[i] = (unsigned char)(n & 0x7F);
+    if (i != 0)
+      p[i] |= 0x80;
+    n >>= 7;
+  }
+}
+
+// Reads the backlen that ends right before `end`
+static size_t listpack_read_backlen(const unsigned char *end, size_t *size) {
+  size_t n = 0;
+  int shift = 0;
+
+  *size = 0;
+  while (1) {
+    unsigned char b = *--end;
+    (*size)++;
+
+    n |= (size_t)(b & 0x7F) << shift;
+    shift += 7;
+
+    if (!(b & 0x80))
+      return n;
+  }
+}
+
+static void listpack_write_entry(unsigned char *p, const char *data,
+                                 uint32_t len) {
+  size_t header = listpack_header_size(len);
+
+  if (header == 1) {
+    p[0] = (unsigned char)len;
+  } else if (header == 2) {
+    p[0] = (unsigned char)(0x80 | (len >> 8));
+    p[1] = (unsigned char)(len & 0xFF);
+  } else {
+    p[0] = LISTPACK_LEN_32BIT;
+    memcpy(p + 1, &len, sizeof(len));
+  }
+
+  memcpy(p + header, data, len);
+  listpack_write_backlen(p + header + len, header + len);
+}
+
+static size_t listpack_current_size(const unsigned char *p) {
+  size_t header;
+  uint32_t len = listpack_decode_len(p, &header);
+  return header + len + listpack_backlen_size(header + len);
+}
+
+static Listpack *listpack_resize(Listpack *lp, size_t bytes) {
+  return realloc(lp, sizeof(Listpack) + bytes);
+}
+
+Listpack *listpack_new(void) {
+  Listpack *lp;
+
+  if ((lp = (Listpack *)malloc(sizeof(Listpack))) == NULL)
+    return NULL;
+
+  lp->bytes = 0;
+  lp->count = 0;
+  return lp;
+}
+
+unsigned char *listpack_first(Listpack *lp) {
+  return lp->count ? lp->entries : NULL;
+}
+
+unsigned char *listpack_last(Listpack *lp) {
+  return listpack_prev(lp, lp->entries + lp->bytes);
+}
+
+unsigned char *listpack_next(Listpack *lp, unsigned char *p) {
+  p += listpack_current_size(p);
+  return p < lp->entries + lp->bytes ? p : NULL;
+}
+
+// Entry before p, p may also be the end of the entries
+unsigned char *listpack_prev(Listpack *lp, unsigned char *p) {
+  if (p <= lp->entries)
+    return NULL;
+
+  size_t backlen;
+  size_t n = listpack_read_backlen(p, &backlen);
+  return p - backlen - n;
+}
+
+// Entry at index, negative indexes count from the tail. NULL if out of range.
+unsigned char *listpack_seek(Listpack *lp, long index) {
+  if (index < 0)
+    index += (long)lp->count;
+  if (index < 0 || index >= (long)lp->count)
+    return NULL;
+
+  unsigned char *p;
+
+  // Walk from whichever end is closer
+  if ((size_t)index <= lp->count / 2) {
+    p = lp->entries;
+    while (index-- > 0)
+      p += listpack_current_size(p);
+  } else {
+    p = listpack_last(lp);
+    for (long i = (long)lp->count - 1; i > index; i--)
+      p = listpack_prev(lp, p);
+  }
+
+  return p;
+}
+
+// Points out at the entry's data, which is not NUL terminated
+void listpack_get(unsigned char *p, Bytes *out) {
+  size_t header;
+
+  out->length = listpack_decode_len(p, &header);
+  out->flags = 0;
+  out->data = (char *)p + header;
+}
+
+// Compares entries from p on with data, skipping `skip` entries after each
+// one that didn't match: 1 looks only at the fields of field/value pairs
+unsigned char *listpack_find(Listpack *lp, unsigned char *p, const char *data,
+                             uint32_t len, int skip) {
+  unsigned char *end = lp->entries + lp->bytes;
+
+  while (p != NULL && p < end) {
+    size_t header;
+    uint32_t cur = listpack_decode_len(p, &header);
+
+    if (cur == len && memcmp(p + header, data, len) == 0)
+      return p;
+
+    p += header + cur + listpack_backlen_size(header + cur);
+    for (int i = 0; i < skip && p < end; i++)
+      p += listpack_current_size(p);
+  }
+
+  return NULL;
+}
+
+// Inserts before *p, or at the end when *p is NULL. *p is left at the new
+// entry.
+Listpack *listpack_insert(Listpack *lp, unsigned char **p, const char *data,
+                          uint32_t len) {
+  size_t offset = *p ? (size_t)(*p - lp->entries) : lp->bytes;
+  size_t size = listpack_entry_size(len);
+
+  if ((size_t)lp->bytes + size > UINT32_MAX)
+    return NULL;
+
+  Listpack *grown;
+  if ((grown = listpack_resize(lp, lp->bytes + size)) == NULL)
+    return NULL;
+  lp = grown;
+
+  memmove(lp->entries + offset + size, lp->entries + offset,
+          lp->bytes - offset);
+  listpack_write_entry(lp->entries + offset, data, len);
+
+  lp->bytes += (uint32_t)size;
+  lp->count++;
+
+  *p = lp->entries + offset;
+  return lp;
+}
+
+Listpack *listpack_append(Listpack *lp, const char *data, uint32_t len) {
+  unsigned char *p = NULL;
+  return listpack_insert(lp, &p, data, len);
+}
+
+Listpack *listpack_prepend(Listpack *lp, const char *data, uint32_t len) {
+  unsigned char *p = lp->entries;
+  return listpack_insert(lp, &p, data, len);
+}
+
+// Overwrites the entry at *p, which is left pointing at it
+Listpack *listpack_replace(Listpack *lp, unsigned char **p, const char *data,
+                           uint32_t len) {
+  size_t offset = (size_t)(*p - lp->entries);
+  size_t old_size = listpack_current_size(*p);
+  size_t new_size = listpack_entry_size(len);
+  size_t tail = lp->bytes - offset - old_size;
+
+  if (new_size > old_size) {
+    if ((size_t)lp->bytes + new_size - old_size > UINT32_MAX)
+      return NULL;
+
+    Listpack *grown;
+    if ((grown = listpack_resize(lp, lp->bytes + new_size - old_size)) == NULL)
+      return NULL;
+    lp = grown;
+  }
+
+  unsigned char *entry = lp->entries + offset;
+  memmove(entry + new_size, entry + old_size, tail);
+  listpack_write_entry(entry, data, len);
+  lp->bytes = (uint32_t)(offset + new_size + tail);
+
+  if (new_size < old_size) {
+    Listpack *shrunk = listpack_resize(lp, lp->bytes);
+    if (shrunk != NULL)
+      lp = shrunk;
+  }
+
+  *p = lp->entries + offset;
+  return lp;
+}
+
+// Removes the entry at *p and leaves *p at the one that followed it, NULL
+// if it was the last. Never fails.
+Listpack *listpack_delete(Listpack *lp, unsigned char **p) {
+  size_t offset = (size_t)(*p - lp->entries);
+  size_t size = listpack_current_size(*p);
+
+  memmove(lp->entries + offset, lp->entries + offset + size,
+          lp->bytes - offset - size);
+  lp->bytes -= (uint32_t)size;
+  lp->count--;
+
+  Listpack *shrunk = listpack_resize(lp, lp->bytes);
+  if (shrunk != NULL)
+    lp = shrunk;
+
+  *p = offset < lp->bytes ? lp->entries + offset : NULL;
+  return lp;
+}
+
+// Removes n entries starting at p, or as many as there are. Never fails.
+Listpack *listpack_delete_range(Listpack *lp, unsigned char *p, uint32_t n) {
+  unsigned char *end = lp->entries + lp->bytes;
+  unsigned char *q = p;
+  uint32_t deleted = 0;
+
+  while (deleted < n && q < end) {
+    q += listpack_current_size(q);
+    deleted++;
+  }
+
+  memmove(p, q, (size_t)(end - q));
+  lp->bytes -= (uint32_t)(q - p);
+  lp->count -= deleted;
+
+  Listpack *shrunk = listpack_resize(lp, lp->bytes);
+  return shrunk != NULL ? shrunk : lp;
+}
+
+// Checks a blob read from disk: every entry fits and is followed by a
+// matching backlen, the count is right
+int listpack_valid(Listpack *lp, size_t len) {
+  if (len < sizeof(Listpack) || listpack_blob_len(lp) != len)
+    return 0;
+
+  unsigned char *p = lp->entries;
+  unsigned char *end = lp->entries + lp->bytes;
+  uint32_t count = 0;
+
+  while (p < end) {
+    size_t avail = (size_t)(end - p);
+    size_t header = p[0] <= LISTPACK_LEN_7BIT_MAX ? 1
+                    : p[0] < LISTPACK_LEN_32BIT   ? 2
+                                                  : 1 + sizeof(uint32_t);
+    if (header > avail)
+      return 0;
+
+    uint32_t data_len = listpack_decode_len(p, &header);
+    if (header + (size_t)data_len > avail)
+      return 0;
+
+    size_t n = header + data_len;
+    size_t size = n + listpack_backlen_size(n);
+    if (size > avail)
+      return 0;
+
+    // Compared byte for byte, a bad backlen could otherwise lead a read
+    // past the entry
+    unsigned char expected[sizeof(size_t) * 2];
+    listpack_write_backlen(expected, n);
+    if (memcmp(p + n, expected, size - n) != 0)
+      return 0;
+
+    p += size;
+    count++;
+  }
+
+  return count == lp->count;
+}
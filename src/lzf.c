@@ -0,0 +1,168 @@
+#include "../include/lzf.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZF_HASH_BITS 13
+#define LZF_MAX_LIT (1 << 5)
+#define LZF_MAX_OFF (1 << 13)
+#define LZF_MAX_REF ((1 << 8) + (1 << 3))
+
+static inline uint32_t lzf_hash(const unsigned char *p) {
+  uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+  return (v * 2654435761u) >> (32 - LZF_HASH_BITS);
+}
+
+size_t lzf_compress(const unsigned char *in, size_t in_len, unsigned char *out,
+                    size_t out_len) {
+  // Last position + 1 seen for each hash of three bytes, 0 when unused
+  uint32_t table[1 << LZF_HASH_BITS];
+  const unsigned char *ip = in;
+  const unsigned char *in_end = in + in_len;
+  unsigned char *op = out;
+  unsigned char *out_end = out + out_len;
+  unsigned char *lit_ctrl;
+  int lit = 0;
+
+  if (in_len == 0 || out_len == 0)
+    return 0;
+
+  memset(table, 0, sizeof(table));
+
+  // Every literal run starts with a reserved control byte, given back if
+  // a reference follows before any literal was written
+  lit_ctrl = op++;
+
+  while (ip < in_end) {
+    if (ip + 2 < in_end) {
+      uint32_t h = lzf_hash(ip);
+      const unsigned char *ref = table[h] ? in + table[h] - 1 : NULL;
+      table[h] = (uint32_t)(ip - in) + 1;
+
+      if (ref != NULL && (size_t)(ip - ref) <= LZF_MAX_OFF && ref[0] == ip[0] &&
+          ref[1] == ip[1] && ref[2] == ip[2]) {
+        size_t off = (size_t)(ip - ref) - 1;
+        size_t max = (size_t)(in_end - ip);
+        size_t len = 3;
+
+        if (max > LZF_MAX_REF)
+          max = LZF_MAX_REF;
+        while (len < max && ref[len] == ip[len])
+          len++;
+
+        if (lit)
+          *lit_ctrl = (unsigned char)(lit - 1);
+        else
+          op--;
+
+        // Reference plus the control byte of the next literal run
+        if (op + 4 > out_end)
+          return 0;
+
+        size_t l = len - 2;
+        if (l < 7) {
+          *op++ = (unsigned char)((l << 5) | (off >> 8));
+        } else {
+          *op++ = (unsigned char)((7 << 5) | (off >> 8));
+          *op++ = (unsigned char)(l - 7);
+        }
+        *op++ = (unsigned char)(off & 0xff);
+
+        ip += len;
+
+        // Index the last two positions the reference covers, like liblzf's
+        // fast mode, every one of them would cost more than it finds
+        for (const unsigned char *p = ip - 2; p < ip && p + 2 < in_end; p++)
+          table[lzf_hash(p)] = (uint32_t)(p - in) + 1;
+        lit = 0;
+        lit_ctrl = op++;
+        continue;
+      }
+    }
+
+    if (op >= out_end)
+      return 0;
+    *op++ = *ip++;
+
+    if (++lit == LZF_MAX_LIT) {
+      *lit_ctrl = (unsigned char)(lit - 1);
+      lit = 0;
+
+      if (op >= out_end)
+        return 0;
+      lit_ctrl = op++;
+    }
+  }
+
+  if (lit)
+    *lit_ctrl = (unsigned char)(lit - 1);
+  else
+    op--;
+
+  return (size_t)(op - out);
+}
+
+// Copies 8 bytes at a time, so may write up to 7 bytes past len when there
+// is room for it. Source and destination must be at least 8 bytes apart.
+static inline void lzf_copy(unsigned char *op, const unsigned char *ip,
+                            size_t len, int slack) {
+  if (!slack) {
+    while (len--)
+      *op++ = *ip++;
+    return;
+  }
+
+  for (size_t i = 0; i < len; i += 8)
+    memcpy(op + i, ip + i, 8);
+}
+
+size_t lzf_decompress(const unsigned char *in, size_t in_len,
+                      unsigned char *out, size_t out_len) {
+  const unsigned char *ip = in;
+  const unsigned char *in_end = in + in_len;
+  unsigned char *op = out;
+  unsigned char *out_end = out + out_len;
+
+  while (ip < in_end) {
+    unsigned int ctrl = *ip++;
+
+    if (ctrl < LZF_MAX_LIT) {
+      size_t len = ctrl + 1;
+
+      if (len > (size_t)(in_end - ip) || len > (size_t)(out_end - op))
+        return 0;
+
+      lzf_copy(op, ip, len, in_end - ip >= LZF_MAX_LIT &&
+                                out_end - op >= LZF_MAX_LIT);
+      op += len;
+      ip += len;
+      continue;
+    }
+
+    size_t len = ctrl >> 5;
+    if (len == 7) {
+      if (ip >= in_end)
+        return 0;
+      len += *ip++;
+    }
+    len += 2;
+
+    if (ip >= in_end)
+      return 0;
+
+    size_t off = ((size_t)(ctrl & 0x1f) << 8) + *ip++ + 1;
+    if (off > (size_t)(op - out) || len > (size_t)(out_end - op))
+      return 0;
+
+    const unsigned char *ref = op - off;
+    if (off >= 8) {
+      lzf_copy(op, ref, len, (size_t)(out_end - op) >= len + 8);
+      op += len;
+    } else {
+      // Close overlapping reference, repeats the last `off` bytes
+      while (len--)
+        *op++ = *ref++;
+    }
+  }
+
+  return (size_t)(op - out);
+}
@@ -1,4 +1,5 @@
 #include "../include/networking.h"
+#include "../include/recis.h"
 #include <asm-generic/errno-base.h>
 #include <asm-generic/errno.h>
 #include <errno.h>
@@ -12,63 +13,260 @@ OutputBuffer *create_output_buffer(int fd) {
   OutputBuffer *ob;
   if ((ob = (OutputBuffer *)malloc(sizeof(OutputBuffer))) == NULL)
     return NULL;
-  ob->fd = fd;
+
+  // Chunks are only allocated once there is something to reply
+  ob->head = NULL;
+  ob->tail = NULL;
   ob->length = 0;
-  ob->capacity = 32 * 1024;
-  ob->data = calloc(ob->capacity, sizeof(char));
-  if (ob->data == NULL) {
-    free(ob);
+  ob->fd = fd;
+  ob->spare = NULL;
+
+  ob->inflight = 0;
+  ob->iov = NULL;
+  memset(&ob->msg, 0, sizeof(ob->msg));
+
+  return ob;
+}
+
+static ReplyChunk *chunk_create(OutputBuffer *ob, size_t capacity) {
+  ReplyChunk *chunk = ob->spare;
+
+  if (chunk != NULL)
+    ob->spare = NULL;
+  else if ((chunk = malloc(sizeof(ReplyChunk) + capacity)) == NULL)
     return NULL;
+  else
+    chunk->capacity = capacity;
+
+  chunk->next = NULL;
+  chunk->ref = NULL;
+  chunk->data = chunk->buf;
+  chunk->length = 0;
+  chunk->sent = 0;
+  return chunk;
+}
+
+// Only full sized chunks are worth keeping around
+static void chunk_release(OutputBuffer *ob, ReplyChunk *chunk) {
+  if (chunk->ref != NULL)
+    free_object(chunk->ref);
+
+  if (ob->spare == NULL && chunk->capacity == OB_CHUNK_SIZE)
+    ob->spare = chunk;
+  else
+    free(chunk);
+}
+
+static void chunk_push(OutputBuffer *ob, ReplyChunk *chunk) {
+  if (ob->tail != NULL)
+    ob->tail->next = chunk;
+  else
+    ob->head = chunk;
+
+  ob->tail = chunk;
+}
+
+// Drops every queued reply, the spare chunk stays
+void output_buffer_reset(OutputBuffer *ob) {
+  ReplyChunk *chunk = ob->head;
+
+  while (chunk != NULL) {
+    ReplyChunk *next = chunk->next;
+    chunk_release(ob, chunk);
+    chunk = next;
   }
 
-  return ob;
+  ob->head = NULL;
+  ob->tail = NULL;
+  ob->length = 0;
 }
 
-void flush_buffer(OutputBuffer *ob) {
-  if (ob->length == 0)
-    return;
+void free_output_buffer(OutputBuffer *ob) {
+  output_buffer_reset(ob);
+  free(ob->spare);
+  free(ob->iov);
+  free(ob);
+}
 
-  ssize_t written = write(ob->fd, ob->data, ob->length);
+void append_to_output_buffer(OutputBuffer *ob, const char *data, size_t len) {
+  while (len > 0) {
+    ReplyChunk *tail = ob->tail;
 
-  if (written == -1) {
-    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-      return;
+    if (tail == NULL || tail->ref != NULL || tail->length == tail->capacity) {
+      size_t capacity = OB_CHUNK_SIZE;
+      if (tail != NULL && tail->ref != NULL && len <= OB_CHUNK_SIZE_SMALL)
+        capacity = OB_CHUNK_SIZE_SMALL;
+
+      if ((tail = chunk_create(ob, capacity)) == NULL)
+        return;
+      chunk_push(ob, tail);
     }
-    ob->length = 0;
-    return;
+
+    size_t n = tail->capacity - tail->length;
+    if (n > len)
+      n = len;
+
+    memcpy(tail->buf + tail->length, data, n);
+    tail->length += n;
+    ob->length += n;
+    data += n;
+    len -= n;
   }
+}
 
-  if (written < ob->length) {
-    size_t remaining = ob->length - written;
-    memmove(ob->data, ob->data + written, remaining);
-    ob->length = remaining;
-  } else {
-    ob->length = 0;
+// Queues `data`, which belongs to the immutable value `o`. Large values are
+// not copied, the chunk holds a reference on `o` until they are written.
+void append_ref_to_output_buffer(OutputBuffer *ob, r_obj *o, const char *data,
+                                 size_t len) {
+  if (len < OB_REF_MIN_LEN) {
+    append_to_output_buffer(ob, data, len);
+    return;
   }
+
+  ReplyChunk *chunk;
+  if ((chunk = malloc(sizeof(ReplyChunk))) == NULL)
+    return;
+
+  incr_ref_count(o);
+
+  chunk->next = NULL;
+  chunk->ref = o;
+  chunk->data = data;
+  chunk->length = len;
+  chunk->sent = 0;
+  chunk->capacity = 0;
+
+  chunk_push(ob, chunk);
+  ob->length += len;
 }
 
-void append_to_output_buffer(OutputBuffer *ob, const char *data, size_t len) {
-  if (ob->length + len <= ob->capacity) {
-    memcpy(ob->data + ob->length, data, len);
-    ob->length += len;
+// Moves every chunk of src to the end of dst
+void output_buffer_splice(OutputBuffer *dst, OutputBuffer *src) {
+  if (src->head == NULL)
     return;
+
+  if (dst->tail != NULL)
+    dst->tail->next = src->head;
+  else
+    dst->head = src->head;
+
+  dst->tail = src->tail;
+  dst->length += src->length;
+
+  src->head = NULL;
+  src->tail = NULL;
+  src->length = 0;
+}
+
+// Fills iov with the unsent part of the first chunks, returns the count and
+// their total length in `batch`
+static int output_buffer_iov(OutputBuffer *ob, struct iovec *iov, int max,
+                             size_t *batch) {
+  int count = 0;
+  *batch = 0;
+
+  for (ReplyChunk *chunk = ob->head; chunk != NULL && count < max;
+       chunk = chunk->next) {
+    if (chunk->sent == chunk->length)
+      continue;
+
+    iov[count].iov_base = (char *)chunk->data + chunk->sent;
+    iov[count].iov_len = chunk->length - chunk->sent;
+    *batch += iov[count].iov_len;
+    count++;
   }
 
-  flush_buffer(ob);
+  return count;
+}
+
+// Drops the first `written` bytes, the last copy chunk is kept for the next
+// replies
+static void output_buffer_consume(OutputBuffer *ob, size_t written) {
+  ob->length -= written;
 
-  if (ob->length + len > ob->capacity) {
-    size_t new_cap = ob->capacity * 2;
-    if (new_cap < ob->length + len)
-      new_cap = ob->length + len + 1024;
+  while (ob->head != NULL) {
+    ReplyChunk *chunk = ob->head;
+    size_t left = chunk->length - chunk->sent;
 
-    char *new_buf = realloc(ob->data, new_cap);
-    if (!new_buf) {
+    if (written < left) {
+      chunk->sent += written;
       return;
     }
-    ob->data = new_buf;
-    ob->capacity = new_cap;
+
+    written -= left;
+
+    if (chunk->next == NULL && chunk->ref == NULL) {
+      chunk->length = 0;
+      chunk->sent = 0;
+      return;
+    }
+
+    ob->head = chunk->next;
+    if (ob->head == NULL)
+      ob->tail = NULL;
+
+    chunk_release(ob, chunk);
   }
+}
 
-  memcpy(ob->data + ob->length, data, len);
-  ob->length += len;
+// A buffer with fd -1 only collects a reply in memory, it is never written.
+// While an asynchronous send is pending nothing is written either, it would
+// reorder the replies. Whatever the socket doesn't take stays queued, the
+// event loop then waits for it to become writable.
+void flush_buffer(OutputBuffer *ob) {
+  if (ob->fd == -1 || ob->inflight)
+    return;
+
+  while (ob->length > 0) {
+    struct iovec iov[OB_IOV_MAX];
+    struct msghdr msg;
+    size_t batch;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = output_buffer_iov(ob, iov, OB_IOV_MAX, &batch);
+
+    ssize_t written = sendmsg(ob->fd, &msg, MSG_NOSIGNAL);
+
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+
+      // The connection is gone, nobody will read the rest
+      output_buffer_reset(ob);
+      return;
+    }
+
+    output_buffer_consume(ob, written);
+
+    if ((size_t)written < batch)
+      return;
+  }
+}
+
+// Prepares ob->msg over the queued chunks for an asynchronous sendmsg.
+// Returns 0 if there is nothing to send or a send is already pending.
+int output_buffer_begin_send(OutputBuffer *ob) {
+  if (ob->inflight || ob->length == 0)
+    return 0;
+
+  if (ob->iov == NULL &&
+      (ob->iov = malloc(OB_IOV_MAX * sizeof(struct iovec))) == NULL)
+    return 0;
+
+  size_t batch;
+  memset(&ob->msg, 0, sizeof(ob->msg));
+  ob->msg.msg_iov = ob->iov;
+  ob->msg.msg_iovlen = output_buffer_iov(ob, ob->iov, OB_IOV_MAX, &batch);
+
+  ob->inflight = 1;
+  return 1;
+}
+
+// Accounts for a completed send, anything left goes with the next one
+void output_buffer_sent(OutputBuffer *ob, size_t written) {
+  ob->inflight = 0;
+  output_buffer_consume(ob, written);
 }
@@ -4,6 +4,10 @@
 #include <string.h>
 #include <sys/types.h>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #include "../include/parser.h"
 
 static const char *skip_spaces(const char *s) {
@@ -12,45 +16,124 @@ static const char *skip_spaces(const char *s) {
   return s;
 }
 
-// read until carriage return + new line
+// Protocol limits, anything above is rejected as a protocol error
+#define RESP_MAX_ARGS (1024 * 1024)
+#define RESP_MAX_BULK_LEN (512LL * 1024 * 1024)
+#define RESP_MAX_HEADER_LEN 32
+// A header alone can't make the server reserve more slots than this, the
+// rest are added as the arguments actually arrive
+#define RESP_ARGS_PREALLOC 1024
+
+// Returns the offset of the first '\r' in buffer[pos, len), or len
+static size_t find_cr(const char *buffer, size_t pos, size_t len) {
+#if defined(__AVX2__)
+  const __m256i cr = _mm256_set1_epi8('\r');
+
+  while (pos + 32 <= len) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(buffer + pos));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, cr));
+    if (mask)
+      return pos + __builtin_ctz(mask);
+    pos += 32;
+  }
+#elif defined(__SSE2__)
+  const __m128i cr = _mm_set1_epi8('\r');
+
+  while (pos + 16 <= len) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(buffer + pos));
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, cr));
+    if (mask)
+      return pos + __builtin_ctz(mask);
+    pos += 16;
+  }
+#endif
 
-size_t read_until_crlf(const char *buffer, size_t input_len, size_t *pos,
-                       char *out, size_t max_out_len) {
-  size_t p = *pos;
-  size_t i = 0;
+  while (pos < len && buffer[pos] != '\r')
+    pos++;
+  return pos;
+}
 
-  while (p < input_len) {
-    if (buffer[p] == '\r') {
-      if (p + 1 < input_len && buffer[p + 1] == '\n') {
-        out[i] = '\0';
-        *pos = p + 2;
-        return 1;
-      } else {
-        return -1;
-      }
-    } else if (buffer[p] == '\n') {
+// Parses the decimal number of a `*N` or `$N` header in place, starting at
+// *pos and ending with "\r\n". Returns 1 and moves *pos past the line, 0 if
+// the line is not complete yet, -1 on anything but 1 to 19 digits no larger
+// than max.
+int parse_resp_length(const char *buffer, size_t len, size_t *pos,
+                      long long max, long long *out) {
+  size_t start = *pos;
+  size_t limit = len;
+
+  if (limit - start > RESP_MAX_HEADER_LEN + 2)
+    limit = start + RESP_MAX_HEADER_LEN + 2;
+
+  size_t cr = find_cr(buffer, start, limit);
+
+  if (cr == limit)
+    return limit == len ? 0 : -1;
+
+  // The '\n' may simply not have arrived yet
+  if (cr + 1 == len)
+    return 0;
+
+  if (buffer[cr + 1] != '\n' || cr == start || cr - start > 19)
+    return -1;
+
+  unsigned long long value = 0;
+
+  for (size_t i = start; i < cr; i++) {
+    unsigned digit = (unsigned char)buffer[i] - '0';
+    if (digit > 9)
       return -1;
-    }
 
-    if (i < max_out_len - 1) {
-      out[i++] = buffer[p];
-    }
-    p++;
+    value = value * 10 + digit;
+    if (value > (unsigned long long)max)
+      return -1;
   }
 
+  *out = (long long)value;
+  *pos = cr + 2;
+  return 1;
+}
+
+// Makes room for `count` arguments in both the view array and arg_values
+static int reserve_args(Client *client, size_t count) {
+  if (count <= client->arg_values_cap)
+    return 0;
+
+  size_t cap = client->arg_values_cap ? client->arg_values_cap : 4;
+  while (cap < count)
+    cap *= 2;
+
+  Bytes **arg_values = realloc(client->arg_values, sizeof(Bytes *) * cap);
+  if (arg_values == NULL)
+    return -1;
+  client->arg_values = arg_values;
+
+  Bytes *arg_views = realloc(client->arg_views, sizeof(Bytes) * cap);
+  if (arg_views == NULL)
+    return -1;
+  client->arg_views = arg_views;
+
+  client->arg_values_cap = cap;
   return 0;
 }
 
+// Arguments are (pointer, length) views into the query buffer. Once the
+// command is complete each view gets a '\0' over the byte that follows it
+// (the '\r' or a separator), so commands can keep treating them as C strings.
+static void publish_args(Client *client) {
+  for (int i = 0; i < client->arg_count; i++) {
+    Bytes *view = &client->arg_views[i];
+    view->data[view->length] = '\0';
+    client->arg_values[i] = view;
+  }
+}
+
 size_t parse_resp_request(Client *client, char *buffer, size_t len) {
   if (len == 0)
     return 0;
 
-  if (client->arg_values == NULL) {
-    client->arg_values_cap = 4;
-    client->arg_values = malloc(sizeof(Bytes *) * client->arg_values_cap);
-    if (client->arg_values == NULL)
-      return -1;
-  }
+  if (reserve_args(client, 4) != 0)
+    return -1;
   client->arg_count = 0;
 
   if (buffer[0] != '*') {
@@ -74,39 +157,31 @@ size_t parse_resp_request(Client *client, char *buffer, size_t len) {
         pos++;
       size_t token_len = pos - start_idx;
 
-      if (client->arg_count >= client->arg_values_cap) {
-        client->arg_values_cap *= 2;
-        client->arg_values = realloc(client->arg_values,
-                                     sizeof(Bytes *) * client->arg_values_cap);
-      }
+      if (reserve_args(client, client->arg_count + 1) != 0)
+        return -1;
 
-      client->arg_values[client->arg_count++] =
-          create_bytes_object(token_start, (uint32_t)token_len);
+      Bytes *view = &client->arg_views[client->arg_count++];
+      view->data = token_start;
+      view->length = (uint32_t)token_len;
     }
 
+    publish_args(client);
     return line_len;
   }
 
   size_t pos = 1;
-  char num_str[32];
+  long long num_args;
 
-  int rc = read_until_crlf(buffer, len, &pos, num_str, 32);
-  if (rc == 0)
-    return 0;
-  if (rc == -1)
-    return -1;
+  int rc = parse_resp_length(buffer, len, &pos, RESP_MAX_ARGS, &num_args);
+  if (rc != 1)
+    return rc == 0 ? 0 : (size_t)-1;
 
-  int num_args = atoi(num_str);
-  if (num_args < 0)
+  size_t prealloc = num_args < RESP_ARGS_PREALLOC ? num_args
+                                                  : RESP_ARGS_PREALLOC;
+  if (reserve_args(client, prealloc) != 0)
     return -1;
 
-  if (num_args > client->arg_values_cap) {
-    client->arg_values_cap = num_args;
-    client->arg_values =
-        realloc(client->arg_values, sizeof(Bytes *) * client->arg_values_cap);
-  }
-
-  for (int i = 0; i < num_args; i++) {
+  for (long long i = 0; i < num_args; i++) {
     if (pos >= len)
       return 0;
 
@@ -114,26 +189,28 @@ size_t parse_resp_request(Client *client, char *buffer, size_t len) {
       return -1;
     pos++;
 
-    char len_str[32];
-    rc = read_until_crlf(buffer, len, &pos, len_str, 32);
-    if (rc == 0)
+    long long arg_len;
+    rc = parse_resp_length(buffer, len, &pos, RESP_MAX_BULK_LEN, &arg_len);
+    if (rc != 1)
+      return rc == 0 ? 0 : (size_t)-1;
+
+    if (len - pos < (size_t)arg_len + 2)
       return 0;
-    if (rc == -1)
-      return -1;
 
-    int arg_len = atoi(len_str);
-    if (arg_len < 0)
+    if (buffer[pos + arg_len] != '\r' || buffer[pos + arg_len + 1] != '\n')
       return -1;
 
-    if (pos + arg_len + 2 > len)
-      return 0;
+    if (reserve_args(client, client->arg_count + 1) != 0)
+      return -1;
 
-    client->arg_values[client->arg_count++] =
-        create_bytes_object(buffer + pos, (uint32_t)arg_len);
+    Bytes *view = &client->arg_views[client->arg_count++];
+    view->data = buffer + pos;
+    view->length = (uint32_t)arg_len;
 
     pos += arg_len + 2;
   }
 
+  publish_args(client);
   return pos;
 }
 
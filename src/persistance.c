@@ -1,146 +1,192 @@
 #include "../include/persistance.h"
+#include "../include/hash.h"
 #include "../include/list.h"
 #include "../include/recis.h"
 #include "../include/set.h"
+#include "../include/timer.h"
 #include "../include/zset.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #define RDB_TYPE_STRING 0
 #define RDB_TYPE_LIST 1
 #define RDB_TYPE_SET 2
 #define RDB_TYPE_HASH 3
 #define RDB_TYPE_ZSET 6
+// The IntSet as it is in memory: encoding, length, then the elements
+#define RDB_TYPE_SET_INTSET 11
+// The Listpack as it is in memory: byte count, entry count, then entries
+#define RDB_TYPE_HASH_LISTPACK 16
+// The ZPack as it is in memory: counts, entries, then member bytes
+#define RDB_TYPE_ZSET_ZPACK 17
 
-void rdb_save(HashTable *db, HashTable *expires, char *filename) {
-  FILE *fp = fopen(filename, "wb"); // write binary
+static void rdb_save_table(FILE *fp, HashTable *db) {
+  HashTableIterator it;
+  hash_table_iterator_init(db, &it);
 
-  if (!fp) {
-    printf("[ERROR] Couldn't open file for writing: %s\n", filename);
-    return;
-  }
+  Node *node;
+  while ((node = hash_table_next(&it)) != NULL) {
+    Bytes *key = node->key;
+    r_obj *val = (r_obj *)node->value;
 
-  for (size_t i = 0; i < db->size; i++) {
-    Node *node = db->buckets[i];
-    while (node) {
-      Bytes *key = node->key;
-      r_obj *val = (r_obj *)node->value;
+    long long when = hash_key_expire(key);
+    uint64_t expire_time = when == -1 ? 0 : (uint64_t)when;
 
-      r_obj *expire_entry = hash_table_get(expires, key);
-      uint64_t expire_time = 0;
+    unsigned char type = (unsigned char)val->type;
+    if (val->type == SET && val->encoding == OBJ_ENCODING_INTSET)
+      type = RDB_TYPE_SET_INTSET;
+    else if (val->type == HASH && val->encoding == OBJ_ENCODING_LISTPACK)
+      type = RDB_TYPE_HASH_LISTPACK;
+    else if (val->type == ZSET && val->encoding == OBJ_ENCODING_ZPACK)
+      type = RDB_TYPE_ZSET_ZPACK;
+    fwrite(&type, sizeof(unsigned char), 1, fp);
 
-      if (expire_entry != NULL) {
-        expire_time = (long long)expire_entry->data;
-      }
+    fwrite(&expire_time, sizeof(uint64_t), 1, fp);
 
-      unsigned char type = (unsigned char)val->type;
-      fwrite(&type, sizeof(unsigned char), 1, fp);
+    uint32_t key_len = key->length;
 
-      fwrite(&expire_time, sizeof(uint64_t), 1, fp);
+    fwrite(&key_len, sizeof(uint32_t), 1, fp);
 
-      uint32_t key_len = key->length;
+    fwrite(key->data, key_len, 1, fp);
 
-      fwrite(&key_len, sizeof(uint32_t), 1, fp);
+    if (val->type == STRING) {
+      Bytes tmp;
+      char buf[OBJ_INT_BUF];
+      Bytes *b = string_object_bytes(val, &tmp, buf);
 
-      fwrite(key->data, key_len, 1, fp);
+      char *str_val = b->data;
+      uint32_t val_len = b->length;
 
-      if (val->type == STRING) {
-        Bytes *b = (Bytes *)val->data;
+      fwrite(&val_len, sizeof(uint32_t), 1, fp);
+      fwrite(str_val, val_len, 1, fp);
+    } else if (type == RDB_TYPE_SET_INTSET) {
+      IntSet *is = (IntSet *)val->data;
 
-        char *str_val = b->data;
-        uint32_t val_len = b->length;
+      fwrite(is, intset_blob_len(is), 1, fp);
+    } else if (type == RDB_TYPE_HASH_LISTPACK) {
+      Listpack *lp = (Listpack *)val->data;
 
-        fwrite(&val_len, sizeof(uint32_t), 1, fp);
-        fwrite(str_val, val_len, 1, fp);
-      } else if (val->type == SET) {
-        HashTable *set_ht = (Set *)val->data;
+      fwrite(lp, listpack_blob_len(lp), 1, fp);
+    } else if (type == RDB_TYPE_ZSET_ZPACK) {
+      ZPack *zp = (ZPack *)val->data;
 
-        uint64_t count = (uint64_t)set_ht->count;
-        fwrite(&count, sizeof(uint64_t), 1, fp);
+      fwrite(zp, zpack_blob_len(zp), 1, fp);
+    } else if (val->type == SET) {
+      Set *set = (Set *)val->data;
 
-        for (size_t j = 0; j < set_ht->size; j++) {
-          Node *set_node = set_ht->buckets[j];
-          while (set_node) {
-            Bytes *member = set_node->key;
-            uint32_t member_len = member->length;
+      uint64_t count = (uint64_t)set->count;
+      fwrite(&count, sizeof(uint64_t), 1, fp);
 
-            fwrite(&member_len, sizeof(uint32_t), 1, fp);
-            fwrite(member->data, member_len, 1, fp);
+      SetIterator set_it;
+      set_iterator_init(set, &set_it);
 
-            set_node = set_node->next;
-          }
-        }
-      } else if (val->type == HASH) {
-        HashTable *ht = (HashTable *)val->data;
+      Bytes *member;
+      while ((member = set_next(&set_it)) != NULL) {
+        uint32_t member_len = member->length;
 
-        uint64_t count = (uint64_t)ht->count;
-        fwrite(&count, sizeof(uint64_t), 1, fp);
+        fwrite(&member_len, sizeof(uint32_t), 1, fp);
+        fwrite(member->data, member_len, 1, fp);
+      }
 
-        for (size_t j = 0; j < ht->size; j++) {
-          Node *set_node = ht->buckets[j];
-          while (set_node) {
-            Bytes *field = set_node->key;
-            uint32_t field_len = field->length;
+      set_iterator_release(&set_it);
+    } else if (val->type == HASH) {
+      uint64_t count = (uint64_t)hash_object_size(val);
+      fwrite(&count, sizeof(uint64_t), 1, fp);
 
-            fwrite(&field_len, sizeof(uint32_t), 1, fp);
-            fwrite(field->data, field_len, 1, fp);
+      HashObjectIterator hash_it;
+      hash_object_iterator_init(val, &hash_it);
 
-            r_obj *value_o = (r_obj *)set_node->value;
-            Bytes *value_bytes = (Bytes *)value_o->data;
-            uint32_t value_len = value_bytes->length;
+      Bytes field, value;
+      while (hash_object_next(&hash_it, &field, &value)) {
+        uint32_t field_len = field.length;
 
-            fwrite(&value_len, sizeof(uint32_t), 1, fp);
-            fwrite(value_bytes->data, value_len, 1, fp);
+        fwrite(&field_len, sizeof(uint32_t), 1, fp);
+        fwrite(field.data, field_len, 1, fp);
 
-            set_node = set_node->next;
-          }
-        }
+        uint32_t value_len = value.length;
 
-      } else if (val->type == LIST) {
-        List *list = (List *)val->data;
+        fwrite(&value_len, sizeof(uint32_t), 1, fp);
+        fwrite(value.data, value_len, 1, fp);
+      }
 
-        uint64_t size = (uint64_t)list->size;
-        fwrite(&size, sizeof(uint64_t), 1, fp);
+      hash_object_iterator_release(&hash_it);
 
-        ListNode *member;
-        for (member = list->head; member != NULL; member = member->next) {
-          r_obj *item_o = member->value;
-          Bytes *item_bytes = item_o->data;
-          uint32_t item_len = item_bytes->length;
+    } else if (val->type == LIST) {
+      List *list = (List *)val->data;
 
-          fwrite(&item_len, sizeof(uint32_t), 1, fp);
-          fwrite(item_bytes->data, item_len, 1, fp);
-        }
-      } else if (val->type == ZSET) {
-        ZSet *zs = (ZSet *)val->data;
-        ZSkipList *zsl = zs->zsl;
+      uint64_t size = (uint64_t)list->size;
+      fwrite(&size, sizeof(uint64_t), 1, fp);
 
-        uint64_t length = (uint64_t)zsl->length;
-        fwrite(&length, sizeof(uint64_t), 1, fp);
+      ListIterator list_it;
+      Bytes item;
 
-        ZSkipListNode *node = zsl->head->level[0].forward;
-        while (node) {
-          Bytes *element = node->element;
-          uint32_t mem_len = element->length;
-          fwrite(&mem_len, sizeof(uint32_t), 1, fp);
-          fwrite(element->data, mem_len, 1, fp);
+      list_iterator_init(list, 0, &list_it);
+      while (list_next(&list_it, &item)) {
+        uint32_t item_len = item.length;
 
-          fwrite(&node->score, sizeof(double), 1, fp);
+        fwrite(&item_len, sizeof(uint32_t), 1, fp);
+        fwrite(item.data, item_len, 1, fp);
+      }
+    } else if (val->type == ZSET) {
+      ZSet *zs = (ZSet *)val->data;
+      ZSkipList *zsl = zs->zsl;
 
-          node = node->level[0].forward;
-        }
+      uint64_t length = (uint64_t)zsl->length;
+      fwrite(&length, sizeof(uint64_t), 1, fp);
+
+      ZSkipListNode *node = zsl->head->level[0].forward;
+      while (node) {
+        Bytes *element = node->element;
+        uint32_t mem_len = element->length;
+        fwrite(&mem_len, sizeof(uint32_t), 1, fp);
+        fwrite(element->data, mem_len, 1, fp);
+
+        fwrite(&node->score, sizeof(double), 1, fp);
+
+        node = node->level[0].forward;
       }
-      node = node->next;
     }
   }
+
+  hash_table_iterator_release(&it);
+}
+
+// Writes several keyspaces (one per shard) into a single file
+void rdb_save_all(HashTable **dbs, int count, char *filename) {
+  FILE *fp = fopen(filename, "wb"); // write binary
+
+  if (!fp) {
+    printf("[ERROR] Couldn't open file for writing: %s\n", filename);
+    return;
+  }
+
+  for (int i = 0; i < count; i++)
+    rdb_save_table(fp, dbs[i]);
+
   fclose(fp);
   printf("RDB save completed.");
 }
 
-void rdb_load(HashTable *db, HashTable *expires, char *filename) {
+void rdb_save(HashTable *db, char *filename) {
+  rdb_save_all(&db, 1, filename);
+}
+
+// The table copies the key. A value that could not be stored is dropped.
+static void rdb_load_store(HashTable *db, char *key, uint32_t key_len,
+                           r_obj *o) {
+  Bytes *key_o = create_bytes_object(key, key_len);
+
+  if (key_o == NULL || hash_table_set(db, key_o, o) != 0) {
+    printf("[ERROR] Out of memory loading key: %s\n", key);
+    free_object(o);
+  }
+  if (key_o != NULL)
+    free_bytes_object(key_o);
+}
+
+void rdb_load(HashTable *db, char *filename) {
   FILE *fp = fopen(filename, "rb");
   if (!fp) {
     printf("[ERROR] Couldn't open file for reading: %s\n", filename);
@@ -148,6 +194,7 @@ void rdb_load(HashTable *db, HashTable *expires, char *filename) {
   }
 
   printf("[RDB] Loading data from disk...\n");
+  clock_update();
 
   unsigned char type;
   while (fread(&type, sizeof(unsigned char), 1, fp)) {
@@ -172,16 +219,19 @@ void rdb_load(HashTable *db, HashTable *expires, char *filename) {
       fread(val_str, val_len, 1, fp);
       val_str[val_len] = '\0';
 
-      r_obj *o = create_string_object(val_str, val_len);
+      r_obj *o = create_string_value_object(val_str, val_len);
 
-      hash_table_set(db, create_bytes_object(val_str, val_len), o);
+      rdb_load_store(db, key, key_len, o);
       free(val_str);
     } else if (type == RDB_TYPE_SET) {
       uint64_t count;
       if (fread(&count, sizeof(uint64_t), 1, fp) != 1)
         break;
 
-      r_obj *o = create_set_object();
+      // Sets of integers written before they had their own encoding
+      // become intsets again unless they are too large
+      r_obj *o = count <= SET_MAX_INTSET_ENTRIES ? create_intset_object()
+                                                 : create_set_object();
 
       for (uint64_t i = 0; i < count; i++) {
         uint32_t member_len;
@@ -191,17 +241,54 @@ void rdb_load(HashTable *db, HashTable *expires, char *filename) {
         fread(member, member_len, 1, fp);
         member[member_len] = '\0';
 
-        set_add((Set *)o->data, create_bytes_object(member, member_len));
+        // The member is copied into the set
+        Bytes member_bytes = {member_len, 0, member};
+        set_object_add(o, &member_bytes);
         free(member);
       }
 
-      hash_table_set(db, create_bytes_object(key, key_len), o);
+      rdb_load_store(db, key, key_len, o);
+    } else if (type == RDB_TYPE_SET_INTSET) {
+      IntSet header;
+      if (fread(&header, sizeof(IntSet), 1, fp) != 1)
+        break;
+
+      if (header.encoding != INTSET_ENC_INT16 &&
+          header.encoding != INTSET_ENC_INT32 &&
+          header.encoding != INTSET_ENC_INT64) {
+        printf("[ERROR] Corrupt intset for key: %s\n", key);
+        break;
+      }
+
+      size_t len = intset_blob_len(&header);
+      IntSet *is;
+      if ((is = (IntSet *)malloc(len)) == NULL)
+        break;
+
+      *is = header;
+      if (len > sizeof(IntSet) &&
+          fread(is->contents, len - sizeof(IntSet), 1, fp) != 1) {
+        free(is);
+        break;
+      }
+
+      if (!intset_valid(is, len)) {
+        printf("[ERROR] Corrupt intset for key: %s\n", key);
+        free(is);
+        break;
+      }
+
+      r_obj *o = create_intset_object();
+      free(o->data);
+      o->data = is;
+
+      rdb_load_store(db, key, key_len, o);
     } else if (type == RDB_TYPE_HASH) {
       uint64_t count;
       if (fread(&count, sizeof(uint64_t), 1, fp) != 1)
         break;
 
-      r_obj *o = create_hash_object();
+      r_obj *o = create_hash_listpack_object();
 
       for (uint64_t i = 0; i < count; i++) {
         uint32_t field_len;
@@ -218,13 +305,41 @@ void rdb_load(HashTable *db, HashTable *expires, char *filename) {
         fread(value, value_len, 1, fp);
         value[value_len] = '\0';
 
-        hash_table_set((HashTable *)o->data,
-                       create_bytes_object(field, field_len),
-                       create_string_object(value, value_len));
+        Bytes field_bytes = {field_len, 0, field};
+        hash_object_set(o, &field_bytes, value, value_len);
         free(field);
         free(value);
       }
-      hash_table_set(db, create_bytes_object(key, key_len), o);
+      rdb_load_store(db, key, key_len, o);
+    } else if (type == RDB_TYPE_HASH_LISTPACK) {
+      Listpack header;
+      if (fread(&header, sizeof(Listpack), 1, fp) != 1)
+        break;
+
+      size_t len = listpack_blob_len(&header);
+      Listpack *lp;
+      if ((lp = (Listpack *)malloc(len)) == NULL)
+        break;
+
+      *lp = header;
+      if (len > sizeof(Listpack) &&
+          fread(lp->entries, len - sizeof(Listpack), 1, fp) != 1) {
+        free(lp);
+        break;
+      }
+
+      if (!listpack_valid(lp, len) || listpack_count(lp) % 2 != 0) {
+        printf("[ERROR] Corrupt listpack for key: %s\n", key);
+        free(lp);
+        break;
+      }
+
+      r_obj *o = create_hash_listpack_object();
+      free(o->data);
+      o->data = lp;
+      hash_object_check_limits(o);
+
+      rdb_load_store(db, key, key_len, o);
     } else if (type == RDB_TYPE_LIST) {
       uint64_t size;
       if (fread(&size, sizeof(uint64_t), 1, fp) != 1)
@@ -242,16 +357,16 @@ void rdb_load(HashTable *db, HashTable *expires, char *filename) {
 
         val_str[val_len] = '\0';
 
-        list_ins_node_tail(list, create_string_object(val_str, val_len));
+        list_push_tail(list, val_str, val_len);
+        free(val_str);
       }
-      hash_table_set(db, create_bytes_object(key, key_len), o);
+      rdb_load_store(db, key, key_len, o);
     } else if (type == RDB_TYPE_ZSET) {
       uint64_t length;
       if (fread(&length, sizeof(uint64_t), 1, fp) != 1)
         break;
 
-      r_obj *o = create_zset_object();
-      ZSet *zs = (ZSet *)o->data;
+      r_obj *o = create_zset_zpack_object();
 
       for (uint64_t i = 0; i < length; i++) {
         uint32_t mem_len;
@@ -263,21 +378,53 @@ void rdb_load(HashTable *db, HashTable *expires, char *filename) {
         double score;
         fread(&score, sizeof(double), 1, fp);
 
-        zset_add(zs, create_bytes_object(member, mem_len), score);
+        // The member is copied into the set
+        Bytes member_bytes = {mem_len, 0, member};
+        zset_object_add(o, &member_bytes, score);
         free(member);
       }
-      hash_table_set(db, create_bytes_object(key, key_len), o);
+      rdb_load_store(db, key, key_len, o);
+    } else if (type == RDB_TYPE_ZSET_ZPACK) {
+      ZPack header;
+      if (fread(&header, sizeof(ZPack), 1, fp) != 1)
+        break;
+
+      size_t len = zpack_blob_len(&header);
+      ZPack *zp;
+      if ((zp = (ZPack *)malloc(len)) == NULL)
+        break;
+
+      *zp = header;
+      if (len > sizeof(ZPack) &&
+          fread(zp->entries, len - sizeof(ZPack), 1, fp) != 1) {
+        free(zp);
+        break;
+      }
+
+      if (!zpack_valid(zp, len)) {
+        printf("[ERROR] Corrupt zpack for key: %s\n", key);
+        free(zp);
+        break;
+      }
+
+      r_obj *o = create_zset_zpack_object();
+      free(o->data);
+      o->data = zp;
+      zset_object_check_limits(o);
+
+      rdb_load_store(db, key, key_len, o);
     }
     if (expire_time > 0) {
-      time_t now = time(NULL);
-      uint64_t current_ms = (uint64_t)now * 1000;
+      Bytes *key_o = create_bytes_object(key, key_len);
 
-      if (expire_time < current_ms) {
-        hash_table_del(db, create_bytes_object(key, key_len));
+      // Deadlines are wall clock milliseconds, same as get_time_ms
+      if ((long long)expire_time <= get_time_ms()) {
+        hash_table_del(db, key_o);
       } else {
-        hash_table_set(expires, create_bytes_object(key, key_len),
-                       create_int_object(expire_time));
+        hash_table_set_expire(db, key_o, (long long)expire_time);
       }
+
+      free_bytes_object(key_o);
     }
 
     free(key);
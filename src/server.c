@@ -1,11 +1,14 @@
 #include <arpa/inet.h>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -13,16 +16,31 @@
 #include <unistd.h>
 
 #include "../include/command.h"
+#include "../include/expire.h"
+#include "../include/hash.h"
+#include "../include/io_threads.h"
+#include "../include/list.h"
 #include "../include/networking.h"
 #include "../include/parser.h"
 #include "../include/persistance.h"
 #include "../include/recis.h"
+#include "../include/shard.h"
+#include "../include/timer.h"
+#include "../include/uring.h"
+#include "../include/zset.h"
 
 #define PORT 6379
 #define BUFFER_SIZE 1024
-#define MAX_EVENTS 10
+#define MAX_EVENTS 1024
 
-#define EXPIRE_SAMPLE_COUNT 20
+// The cron runs server_hz times a second on every shard, each of its jobs
+// stops after cron_budget_us so it never holds commands back for longer
+#define CRON_HZ_DEFAULT 10
+#define CRON_HZ_MAX 500
+#define CRON_BUDGET_US_DEFAULT 1000
+
+static int server_hz = CRON_HZ_DEFAULT;
+static long long cron_budget_us = CRON_BUDGET_US_DEFAULT;
 
 void set_nonblocking(int fd) {
   int flags = fcntl(fd, F_GETFL, 0);
@@ -36,33 +54,281 @@ void set_nonblocking(int fd) {
   }
 }
 
-void active_expire_cycle(HashTable *db, HashTable *expires) {
-  if (expires->count == 0)
+#ifndef NET_IO_URING
+// Accepts every pending connection, the listening socket is edge triggered
+static void accept_clients(int server_fd, int epfd) {
+  while (1) {
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+
+    int client_fd =
+        accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
+
+    if (client_fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("accept");
+      return;
+    }
+
+    set_nonblocking(client_fd);
+
+    Client *new_client = create_client(client_fd);
+    new_client->poll_events = EPOLLIN;
+
+    struct epoll_event ev;
+    ev.events = new_client->poll_events;
+    ev.data.ptr = new_client;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+      perror("epoll_ctl: client");
+      close(client_fd);
+      free_client(new_client);
+      continue;
+    }
+
+    printf("New client connected from: FD %d\n", client_fd);
+  }
+}
+#endif // !NET_IO_URING
+
+// Closes the socket and drops the queued replies. The Client itself stays
+// until free_closed_clients finds nothing referring to it anymore.
+static void disconnect_client(Shard *shard, Client *c) {
+  if (c->fd == -1)
+    return;
+
+#ifdef NET_IO_URING
+  // Ends the multishot receive still armed on the socket
+  shutdown(c->fd, SHUT_RDWR);
+#else
+  epoll_ctl(shard->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+#endif
+  close(c->fd);
+  printf("client dissconnected: FD :%d", c->fd);
+
+  // A reply from another shard may still be on its way to this client
+  c->fd = -1;
+  c->output_buffer->fd = -1;
+
+  // Chunks under an asynchronous send go once it completes
+  if (!c->output_buffer->inflight)
+    output_buffer_reset(c->output_buffer);
+
+  if (shard->closed_count == shard->closed_cap) {
+    size_t cap = shard->closed_cap ? shard->closed_cap * 2 : 64;
+    Client **grown = realloc(shard->closed, cap * sizeof(Client *));
+    if (grown == NULL)
+      return;
+
+    shard->closed = grown;
+    shard->closed_cap = cap;
+  }
+
+  shard->closed[shard->closed_count++] = c;
+}
+
+// Runs at the end of each loop iteration, once the lists of ready clients
+// are done with the disconnected ones
+static void free_closed_clients(Shard *shard) {
+  if (shard->closed_count == 0)
     return;
 
-  uint64_t now = get_time_ms();
+  size_t kept = 0;
+
+  for (size_t n = 0; n < shard->soft_limited_count; n++) {
+    Client *c = shard->soft_limited[n];
+
+    if (c->fd != -1)
+      shard->soft_limited[kept++] = c;
+  }
+  shard->soft_limited_count = kept;
+
+  kept = 0;
 
-  for (int i = 0; i < EXPIRE_SAMPLE_COUNT; i++) {
-    size_t idx = rand() % expires->size;
-    Node *node = expires->buckets[idx];
+  for (size_t n = 0; n < shard->closed_count; n++) {
+    Client *c = shard->closed[n];
 
-    while (node) {
-      Node *next = node->next;
+    // Still waiting for a forwarded command or an io_uring completion
+    if (c->blocked || c->output_buffer->inflight || c->recv_armed) {
+      shard->closed[kept++] = c;
+      continue;
+    }
+
+    free_client(c);
+  }
+  shard->closed_count = kept;
+}
 
-      long long *kill_time = (long long *)node->value->data;
+static void execute_command(Shard *shard, Client *c, Command *cmd) {
+  int owner = shard_route(shard, cmd, c);
+
+  if (owner == SHARD_ALL) {
+    shard_run_exclusive(shard, cmd, c);
+  } else if (owner != shard->id) {
+    shard_forward(shard, owner, cmd, c);
+  } else {
+    CommandContext ctx = {c, shard->db, shard->vector_indices,
+                          c->output_buffer, &shard->expire_index};
+    shard_call(shard, cmd, &ctx);
+  }
+}
 
-      if (now > *kill_time) {
-        printf("[Active expire]: Deleting '%s'\n", node->key->data);
-        hash_table_del(db, node->key);
-        hash_table_del(expires, node->key);
+// Runs every complete command in the query buffer. An I/O thread may already
+// have parsed the first one. Stops early while a command is forwarded to
+// another shard, or while too many replies wait for the socket. Returns -1 on
+// a protocol error.
+static int process_client_input(Shard *shard, Client *c) {
+  c->pipeline_paused = 0;
+
+  while (c->query_pos < c->query_length && !c->blocked) {
+    if (client_output_paused(c)) {
+      c->pipeline_paused = 1;
+      break;
+    }
+
+    char *current_ptr = c->query_buffer + c->query_pos;
+    size_t remaining_len = c->query_length - c->query_pos;
+
+    size_t consumed = c->parsed_consumed;
+    c->parsed_consumed = 0;
+
+    if (consumed == 0)
+      consumed = parse_resp_request(c, current_ptr, remaining_len);
+
+    if (consumed == (size_t)-1) {
+      reset_client_args(c);
+      return -1;
+    }
+
+    if (consumed == 0) {
+      reset_client_args(c);
+      break;
+    }
+
+    if (c->arg_count > 0) {
+      Bytes *cmd_name = c->arg_values[0];
+      Command *cmd = command_lookup(cmd_name->data, cmd_name->length);
+
+      if (cmd == NULL) {
+        append_to_output_buffer(c->output_buffer, "-ERR unknown command\r\n",
+                                22);
+      } else if (command_check_arity(cmd, c->arg_count, c->output_buffer)) {
+        execute_command(shard, c, cmd);
       }
+    }
+
+    c->query_pos += consumed;
+
+    reset_client_args(c);
+  }
+
+  client_compact_query(c);
 
-      node = next;
+  return 0;
+}
+
+// Checked after each flush, a client that doesn't read its replies must not
+// hold on to unbounded memory
+static int output_limits_exceeded(Shard *shard, Client *c) {
+  long long since = c->soft_limit_since;
+
+  if (client_check_output_limits(c, get_time_ms()) != 0) {
+    printf("client FD %d over the %s output buffer limit, %zu bytes pending\n",
+           c->fd, client_class_name(c->class), c->output_buffer->length);
+    return 1;
+  }
+
+  // A client that stopped reading gets no more events, the loop has to come
+  // back to it
+  if (since == 0 && c->soft_limit_since != 0) {
+    if (shard->soft_limited_count == shard->soft_limited_cap) {
+      size_t cap = shard->soft_limited_cap ? shard->soft_limited_cap * 2 : 64;
+      Client **grown = realloc(shard->soft_limited, cap * sizeof(Client *));
+      if (grown == NULL)
+        return 0;
+
+      shard->soft_limited = grown;
+      shard->soft_limited_cap = cap;
     }
+
+    shard->soft_limited[shard->soft_limited_count++] = c;
   }
+
+  return 0;
 }
 
-int main() {
+static void check_soft_limited(Shard *shard) {
+  size_t kept = 0;
+
+  for (size_t n = 0; n < shard->soft_limited_count; n++) {
+    Client *c = shard->soft_limited[n];
+
+    if (c->fd == -1)
+      continue;
+
+    if (output_limits_exceeded(shard, c)) {
+      disconnect_client(shard, c);
+      continue;
+    }
+
+    if (c->soft_limit_since != 0)
+      shard->soft_limited[kept++] = c;
+  }
+
+  shard->soft_limited_count = kept;
+}
+
+// Runs while a backlog of expired keys is left, a budget at a time so
+// commands still get in between
+static void active_expire_fast(void *data) {
+  Shard *shard = (Shard *)data;
+
+  if (active_expire_cycle(shard->db, &shard->expire_index, cron_budget_us))
+    timer_add(&shard->timers, &shard->expire_fast,
+              timer_now_ms() + ACTIVE_EXPIRE_FAST_INTERVAL_MS);
+}
+
+static void rehash_cycle(Shard *shard, long long budget_us) {
+  HashTable *tables[] = {shard->db, shard->vector_indices};
+  long long start = timer_now_us();
+
+  for (size_t i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+    long long left = budget_us - (timer_now_us() - start);
+    if (left <= 0)
+      break;
+
+    hash_table_rehash_us(tables[i], left);
+  }
+}
+
+// Background work of a shard: expiry, table migration, stats and clients
+// over their soft output limit. Tables also migrate a bucket on each access,
+// the cron finishes the ones that went idle.
+static void server_cron(void *data) {
+  Shard *shard = (Shard *)data;
+  long long now = timer_now_ms();
+
+  if (active_expire_cycle(shard->db, &shard->expire_index, cron_budget_us) &&
+      !timer_pending(&shard->expire_fast))
+    timer_add(&shard->timers, &shard->expire_fast,
+              now + ACTIVE_EXPIRE_FAST_INTERVAL_MS);
+  rehash_cycle(shard, cron_budget_us);
+  shard_sample_stats(shard, now);
+  check_soft_limited(shard);
+
+  timer_add(&shard->timers, &shard->cron, now + 1000 / server_hz);
+}
+
+static void cron_start(Shard *shard) {
+  long long now = timer_now_ms();
+
+  timer_wheel_init(&shard->timers, now);
+  timer_init(&shard->cron, server_cron, shard);
+  timer_init(&shard->expire_fast, active_expire_fast, shard);
+  timer_add(&shard->timers, &shard->cron, now + 1000 / server_hz);
+}
+
+static int create_listener(int reuseport) {
   int server_fd = socket(AF_INET, SOCK_STREAM, 0);
   if (server_fd < 0) {
     perror("Socket failed");
@@ -76,6 +342,14 @@ int main() {
     exit(EXIT_FAILURE);
   }
 
+  // Every shard listens on the port, the kernel spreads the connections
+  if (reuseport &&
+      setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+    perror("setsockopt(SO_REUSEPORT)");
+    close(server_fd);
+    exit(EXIT_FAILURE);
+  }
+
   struct sockaddr_in server_addr;
 
   server_addr.sin_family = AF_INET;
@@ -95,130 +369,620 @@ int main() {
     exit(EXIT_FAILURE);
   }
 
-  HashTable *db = hash_table_create(1024);
-  HashTable *expires = hash_table_create(16);
-  HashTable *vector_indices = hash_table_create(16);
+  set_nonblocking(server_fd);
+  return server_fd;
+}
 
-  rdb_load(db, expires, "dump.rdb");
+#ifdef NET_IO_URING
 
-  set_nonblocking(server_fd);
+#define URING_ENTRIES 4096
+#define URING_BUFFER_COUNT 1024
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+
+// user_data is the Client pointer with the operation in the low bits
+#define URING_OP_ACCEPT 1
+#define URING_OP_RECV 2
+#define URING_OP_SEND 3
+#define URING_OP_WAKE 4
+#define URING_OP_TIMEOUT 5
+#define URING_OP_MASK 7
+
+static void shard_setup(Shard *shard) {
+  shard->server_fd = create_listener(shard_count > 1);
+  shard->epfd = -1;
+}
+
+static struct io_uring_sqe *uring_sqe(Uring *ring) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe == NULL) {
+    fprintf(stderr, "io_uring submission queue full\n");
+    exit(EXIT_FAILURE);
+  }
+  return sqe;
+}
+
+static void uring_arm_recv(Uring *ring, Client *c) {
+  c->recv_armed = 1;
+  uring_prep_recv_multishot(uring_sqe(ring), c->fd, URING_BUFFER_GROUP,
+                            (uint64_t)(uintptr_t)c | URING_OP_RECV);
+}
+
+// Queues the pending replies of c, sends go out with the next submit
+static void uring_send_client(Uring *ring, Client *c) {
+  OutputBuffer *ob = c->output_buffer;
+
+  if (c->fd == -1 || !output_buffer_begin_send(ob))
+    return;
+
+  uring_prep_sendmsg(uring_sqe(ring), c->fd, &ob->msg,
+                     (uint64_t)(uintptr_t)c | URING_OP_SEND);
+}
+
+static void ready_push(Client ***ready, size_t *count, size_t *cap,
+                       Client *c) {
+  if (*count == *cap) {
+    size_t new_cap = *cap ? *cap * 2 : MAX_EVENTS;
+    Client **grown = realloc(*ready, new_cap * sizeof(Client *));
+    if (grown == NULL)
+      return;
+    *ready = grown;
+    *cap = new_cap;
+  }
+
+  (*ready)[(*count)++] = c;
+}
+
+// Same loop as the epoll one, but accepts, receives and sends are io_uring
+// operations. Accept and receive are multishot, received data lands in
+// provided buffers, and all sends of an iteration go out with the single
+// io_uring_enter that also waits for the next completions.
+static void *shard_loop(void *arg) {
+  Shard *shard = (Shard *)arg;
+
+  Uring ring;
+  if (uring_init(&ring, URING_ENTRIES) < 0 ||
+      uring_setup_buffers(&ring, URING_BUFFER_COUNT, URING_BUFFER_SIZE,
+                          URING_BUFFER_GROUP) < 0)
+    exit(EXIT_FAILURE);
+
+  uint64_t wakeups;
+
+  uring_prep_accept_multishot(uring_sqe(&ring), shard->server_fd,
+                              URING_OP_ACCEPT);
 
-  int epfd = epoll_create1(0); // 0 = no flags, or use EPOLL_CLOEXEC
-  if (epfd == -1) {
+  if (shard_count > 1)
+    uring_prep_read(uring_sqe(&ring), shard->event_fd, &wakeups,
+                    sizeof(wakeups), (uint64_t)(uintptr_t)shard | URING_OP_WAKE);
+
+  Client **ready = NULL;
+  size_t ready_cap = 0;
+
+  // Deadline of the pending timeout operation, 0 if none is armed
+  struct __kernel_timespec wait_timeout;
+  long long timeout_deadline = 0;
+
+  cron_start(shard);
+  shard_enter(shard);
+
+  while (1) {
+    // Wakes the loop up for the next timer unless an earlier wakeup is
+    // already pending
+    long long now = timer_now_ms();
+    int timeout = timer_wheel_timeout(&shard->timers, now);
+
+    if (timeout > 0 &&
+        (timeout_deadline == 0 || now + timeout < timeout_deadline)) {
+      wait_timeout.tv_sec = timeout / 1000;
+      wait_timeout.tv_nsec = (timeout % 1000) * 1000000LL;
+      uring_prep_timeout(uring_sqe(&ring), &wait_timeout, URING_OP_TIMEOUT);
+      timeout_deadline = now + timeout;
+    }
+
+    shard_wake_peers(shard);
+    shard_leave(shard);
+
+    uring_submit_and_wait(&ring, timeout == 0 ? 0 : 1);
+
+    shard_enter(shard);
+
+    clock_update();
+    timer_wheel_run(&shard->timers, clock_mono_us / 1000);
+
+    size_t ready_count = 0;
+    struct io_uring_cqe *cqe;
+
+    while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+      uint64_t data = cqe->user_data;
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      uring_cqe_seen(&ring);
+
+      Client *c = (Client *)(uintptr_t)(data & ~(uint64_t)URING_OP_MASK);
+
+      switch (data & URING_OP_MASK) {
+      case URING_OP_ACCEPT:
+        if (res >= 0) {
+          Client *new_client = create_client(res);
+          uring_arm_recv(&ring, new_client);
+          printf("New client connected from: FD %d\n", res);
+        }
+
+        if (!(flags & IORING_CQE_F_MORE))
+          uring_prep_accept_multishot(uring_sqe(&ring), shard->server_fd,
+                                      URING_OP_ACCEPT);
+        break;
+
+      case URING_OP_RECV:
+        if (flags & IORING_CQE_F_BUFFER) {
+          unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+          if (res > 0 && c->fd != -1 &&
+              client_append_query(c, uring_buffer(&ring, bid), res) != 0)
+            res = -ENOMEM;
+
+          uring_recycle_buffer(&ring, bid);
+        }
+
+        if (!(flags & IORING_CQE_F_MORE))
+          c->recv_armed = 0;
+
+        // Completions can still arrive after a disconnect
+        if (c->fd == -1)
+          break;
+
+        if (res > 0) {
+          ready_push(&ready, &ready_count, &ready_cap, c);
+          if (!(flags & IORING_CQE_F_MORE))
+            uring_arm_recv(&ring, c);
+        } else if (res == -ENOBUFS) {
+          // Every provided buffer was in use, data stays in the socket
+          uring_arm_recv(&ring, c);
+        } else {
+          disconnect_client(shard, c);
+        }
+        break;
+
+      case URING_OP_SEND:
+        // The send a disconnect left the replies queued for
+        if (c->fd == -1) {
+          output_buffer_sent(c->output_buffer, 0);
+          output_buffer_reset(c->output_buffer);
+          break;
+        }
+
+        if (res < 0) {
+          disconnect_client(shard, c);
+        } else {
+          // Short sends and replies queued meanwhile go out together
+          output_buffer_sent(c->output_buffer, res);
+
+          if (output_limits_exceeded(shard, c)) {
+            disconnect_client(shard, c);
+            break;
+          }
+
+          uring_send_client(&ring, c);
+
+          // A pipeline paused on its replies can run again
+          if (c->pipeline_paused && !client_output_paused(c))
+            ready_push(&ready, &ready_count, &ready_cap, c);
+        }
+        break;
+
+      case URING_OP_TIMEOUT:
+        timeout_deadline = 0;
+        break;
+
+      case URING_OP_WAKE:
+        uring_prep_read(uring_sqe(&ring), shard->event_fd, &wakeups,
+                        sizeof(wakeups),
+                        (uint64_t)(uintptr_t)shard | URING_OP_WAKE);
+        break;
+      }
+    }
+
+    shard_drain(shard);
+
+    for (size_t n = 0; n < ready_count; n++) {
+      Client *c = ready[n];
+
+      if (c->fd == -1)
+        continue;
+
+      if (process_client_input(shard, c) != 0) {
+        disconnect_client(shard, c);
+        continue;
+      }
+
+      // Only a client whose previous send is still pending is behind
+      if (c->output_buffer->inflight && output_limits_exceeded(shard, c)) {
+        disconnect_client(shard, c);
+        continue;
+      }
+
+      uring_send_client(&ring, c);
+    }
+
+    // Clients whose forwarded command came back continue their pipeline
+    for (size_t n = 0; n < shard->resumed_count; n++) {
+      Client *c = shard->resumed[n];
+
+      if (c->fd == -1)
+        continue;
+
+      if (process_client_input(shard, c) != 0) {
+        disconnect_client(shard, c);
+        continue;
+      }
+
+      // Only a client whose previous send is still pending is behind
+      if (c->output_buffer->inflight && output_limits_exceeded(shard, c)) {
+        disconnect_client(shard, c);
+        continue;
+      }
+
+      uring_send_client(&ring, c);
+    }
+
+    shard->resumed_count = 0;
+    free_closed_clients(shard);
+  }
+
+  shard_leave(shard);
+  return NULL;
+}
+
+#else
+
+static void shard_setup(Shard *shard) {
+  shard->server_fd = create_listener(shard_count > 1);
+
+  shard->epfd = epoll_create1(0); // 0 = no flags, or use EPOLL_CLOEXEC
+  if (shard->epfd == -1) {
     perror("epoll_create1");
-    return 1;
+    exit(EXIT_FAILURE);
   }
 
-  Client *server_client = create_client(server_fd);
-  printf("epoll instance created: %d\n", epfd);
+  printf("epoll instance created: %d\n", shard->epfd);
 
   struct epoll_event ev;
   ev.events = EPOLLIN | EPOLLET;
-  ev.data.ptr = server_client;
-  /* ev.data.fd = server_fd; */
+  ev.data.ptr = NULL;
 
-  if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
+  if (epoll_ctl(shard->epfd, EPOLL_CTL_ADD, shard->server_fd, &ev) == -1) {
     perror("epoll_ctl: server_socket");
-    return 1;
+    exit(EXIT_FAILURE);
+  }
+
+  if (shard_count == 1)
+    return;
+
+  // Other shards signal new messages in our inbox through the eventfd
+  ev.events = EPOLLIN;
+  ev.data.ptr = shard;
+
+  if (epoll_ctl(shard->epfd, EPOLL_CTL_ADD, shard->event_fd, &ev) == -1) {
+    perror("epoll_ctl: eventfd");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Runs after a client's replies were flushed. Drops it if it fell too far
+// behind, otherwise watches for EPOLLOUT only while replies are left over and
+// stops reading while it is paused on them, so a slow reader gets pushed back
+// through TCP instead of growing its buffers.
+static void update_client_events(Shard *shard, Client *c) {
+  if (c->fd == -1)
+    return;
+
+  if (output_limits_exceeded(shard, c)) {
+    disconnect_client(shard, c);
+    return;
+  }
+
+  // A paused pipeline resumes from the EPOLLOUT handler, even when the
+  // socket already took every reply
+  uint32_t events = 0;
+  if (!client_output_paused(c))
+    events |= EPOLLIN;
+  if (c->output_buffer->length > 0 || c->pipeline_paused)
+    events |= EPOLLOUT;
+
+  if (events == c->poll_events)
+    return;
+
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = c;
+
+  if (epoll_ctl(shard->epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1) {
+    perror("epoll_ctl: client");
+    return;
   }
 
+  c->poll_events = events;
+}
+
+static void *shard_loop(void *arg) {
+  Shard *shard = (Shard *)arg;
+
   struct epoll_event events[MAX_EVENTS];
+  Client *ready[MAX_EVENTS];
+  Client *writable[MAX_EVENTS];
+
+  cron_start(shard);
+  shard_enter(shard);
 
   while (1) {
-    int nfds = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    shard_wake_peers(shard);
+    shard_leave(shard);
+
+    // Sleeps until the next timer at the latest
+    int timeout = timer_wheel_timeout(&shard->timers, timer_now_ms());
+    int nfds = epoll_wait(shard->epfd, events, MAX_EVENTS, timeout);
+
+    shard_enter(shard);
+
     if (nfds == -1) {
+      if (errno == EINTR)
+        continue;
       perror("epoll_wait");
       break;
     }
 
-    // check TTL
-    active_expire_cycle(db, expires);
+    clock_update();
+    timer_wheel_run(&shard->timers, clock_mono_us / 1000);
+
+    int ready_count = 0;
+    int writable_count = 0;
 
     for (int n = 0; n < nfds; ++n) {
-      /* int current_fd = events[n].data.fd; */
+      void *ptr = events[n].data.ptr;
+
+      if (ptr == NULL) {
+        accept_clients(shard->server_fd, shard->epfd);
+      } else if (ptr == shard) {
+        uint64_t wakeups;
+        if (read(shard->event_fd, &wakeups, sizeof(wakeups)) == -1 &&
+            errno != EAGAIN)
+          perror("read eventfd");
+      } else if (events[n].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        ready[ready_count++] = (Client *)ptr;
+      } else {
+        writable[writable_count++] = (Client *)ptr;
+      }
+    }
 
-      Client *c = (Client *)events[n].data.ptr;
-      int current_fd = c->fd;
+    shard_drain(shard);
 
-      if (c == server_client) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
+    // Reads and the first parse happen on the I/O threads, commands run here
+    io_threads_run(ready, ready_count, IO_OP_READ);
 
-        int client_fd =
-            accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
+    int live_count = 0;
 
-        if (client_fd == -1) {
-          perror("accept");
-          continue;
-        }
+    for (int n = 0; n < ready_count; n++) {
+      Client *c = ready[n];
 
-        set_nonblocking(client_fd);
+      if (c->io_status != 0 || process_client_input(shard, c) != 0) {
+        disconnect_client(shard, c);
+        continue;
+      }
 
-        Client *new_client = create_client(client_fd);
+      ready[live_count++] = c;
+    }
 
-        struct epoll_event ev;
-        ev.events = EPOLLIN;
-        ev.data.ptr = new_client;
+    io_threads_run(ready, live_count, IO_OP_WRITE);
 
-        if (epoll_ctl(epfd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
-          perror("epoll_ctl: client");
-          close(client_fd);
-        }
+    for (int n = 0; n < live_count; n++)
+      update_client_events(shard, ready[n]);
 
-        printf("New client connected from: FD %d\n", client_fd);
-      } else {
+    // Sockets that drained enough to take the rest of earlier replies. A
+    // pipeline paused on its replies runs again once they are out.
+    for (int n = 0; n < writable_count; n++) {
+      Client *c = writable[n];
 
-        if (read_from_client(c) != 0) {
-          epoll_ctl(epfd, EPOLL_CTL_DEL, current_fd, NULL);
-          close(current_fd);
-          printf("client dissconnected: FD :%d", current_fd);
-          continue;
-        }
+      if (c->fd == -1)
+        continue;
 
-        while (c->query_pos < c->query_length) {
-          char *current_ptr = c->query_buffer + c->query_pos;
-          size_t remaining_len = c->query_length - c->query_pos;
+      flush_buffer(c->output_buffer);
 
-          size_t consumed = parse_resp_request(c, current_ptr, remaining_len);
+      if (process_client_input(shard, c) != 0) {
+        disconnect_client(shard, c);
+        continue;
+      }
 
-          if (consumed > 0) {
-            if (c->arg_count > 0) {
-              Bytes **arg_values = c->arg_values;
-              int arg_count = c->arg_count;
-              OutputBuffer *ob = c->output_buffer;
+      flush_buffer(c->output_buffer);
+      update_client_events(shard, c);
+    }
 
-              Bytes *cmd_name = arg_values[0];
-              Command *cmd = command_lookup(cmd_name->data, cmd_name->length);
+    // Clients whose forwarded command came back continue their pipeline
+    for (size_t n = 0; n < shard->resumed_count; n++) {
+      Client *c = shard->resumed[n];
 
-              if (cmd == NULL) {
-                append_to_output_buffer(ob, "-ERR unknown command\r\n", 22);
-              } else {
-                CommandContext ctx = {c, db, expires, vector_indices, ob};
-                cmd->proc(&ctx);
-              }
+      if (c->fd == -1)
+        continue;
 
-              c->query_pos += consumed;
+      if (process_client_input(shard, c) != 0) {
+        disconnect_client(shard, c);
+        continue;
+      }
 
-              reset_client_args(c);
-            }
-          } else if (consumed == 0) {
-            break;
-          } else {
-            close(current_fd);
-            break;
-          }
-        }
+      flush_buffer(c->output_buffer);
+      update_client_events(shard, c);
+    }
 
-        if (c->query_pos == c->query_length) {
-          c->query_pos = 0;
-          c->query_length = 0;
-        }
+    shard->resumed_count = 0;
+    free_closed_clients(shard);
+  }
 
-        flush_buffer(c->output_buffer);
-      }
+  shard_leave(shard);
+  return NULL;
+}
+
+#endif // NET_IO_URING
+
+// Parses a byte count with an optional kb, mb or gb suffix, -1 if invalid
+static long long parse_memory(const char *str) {
+  char *end;
+  long long value = strtoll(str, &end, 10);
+
+  if (end == str || value < 0)
+    return -1;
+
+  if (*end == '\0' || strcasecmp(end, "b") == 0)
+    return value;
+  if (strcasecmp(end, "kb") == 0)
+    return value * 1024;
+  if (strcasecmp(end, "mb") == 0)
+    return value * 1024 * 1024;
+  if (strcasecmp(end, "gb") == 0)
+    return value * 1024 * 1024 * 1024;
+
+  return -1;
+}
+
+// --client-output-buffer-limit <class> <hard> <soft> <soft seconds>
+static int parse_output_limit(char **argv) {
+  client_class class = client_class_by_name(argv[0]);
+  long long hard = parse_memory(argv[1]);
+  long long soft = parse_memory(argv[2]);
+  char *end;
+  long long seconds = strtoll(argv[3], &end, 10);
+
+  if (class == CLIENT_CLASS_COUNT || hard < 0 || soft < 0 || *end != '\0' ||
+      seconds < 0)
+    return -1;
+
+  client_output_limits[class].hard = hard;
+  client_output_limits[class].soft = soft;
+  client_output_limits[class].soft_seconds = seconds;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int io_threads = 1;
+  int shard_threads = 1;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--io-threads") == 0 && i + 1 < argc) {
+      io_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+      shard_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--client-output-buffer-limit") == 0 &&
+               i + 4 < argc && parse_output_limit(&argv[i + 1]) == 0) {
+      i += 4;
+    } else if (strcmp(argv[i], "--latency-tracking") == 0 && i + 1 < argc) {
+      latency_tracking = strcasecmp(argv[++i], "no") != 0;
+    } else if (strcmp(argv[i], "--slowlog-log-slower-than") == 0 &&
+               i + 1 < argc) {
+      slowlog_log_slower_than = atoll(argv[++i]);
+    } else if (strcmp(argv[i], "--slowlog-max-len") == 0 && i + 1 < argc) {
+      slowlog_max_len = (size_t)atoll(argv[++i]);
+    } else if (strcmp(argv[i], "--hz") == 0 && i + 1 < argc) {
+      server_hz = atoi(argv[++i]);
+      if (server_hz < 1)
+        server_hz = 1;
+      if (server_hz > CRON_HZ_MAX)
+        server_hz = CRON_HZ_MAX;
+    } else if (strcmp(argv[i], "--cron-budget") == 0 && i + 1 < argc) {
+      cron_budget_us = atoll(argv[++i]);
+    } else if (strcmp(argv[i], "--active-expire-index") == 0 &&
+               i + 1 < argc) {
+      expire_index_enabled = strcasecmp(argv[++i], "yes") == 0;
+    } else if (strcmp(argv[i], "--hash-max-listpack-entries") == 0 &&
+               i + 1 < argc) {
+      hash_max_listpack_entries = atoi(argv[++i]);
+      if (hash_max_listpack_entries < 0)
+        hash_max_listpack_entries = 0;
+    } else if (strcmp(argv[i], "--hash-max-listpack-value") == 0 &&
+               i + 1 < argc) {
+      hash_max_listpack_value = atoi(argv[++i]);
+      if (hash_max_listpack_value < 0)
+        hash_max_listpack_value = 0;
+    } else if (strcmp(argv[i], "--list-compress-depth") == 0 && i + 1 < argc) {
+      list_compress_depth = atoi(argv[++i]);
+      if (list_compress_depth < 0)
+        list_compress_depth = 0;
+    } else if (strcmp(argv[i], "--zset-max-zpack-entries") == 0 &&
+               i + 1 < argc) {
+      zset_max_zpack_entries = atoi(argv[++i]);
+      if (zset_max_zpack_entries < 0)
+        zset_max_zpack_entries = 0;
+    } else if (strcmp(argv[i], "--zset-max-zpack-value") == 0 &&
+               i + 1 < argc) {
+      zset_max_zpack_value = atoi(argv[++i]);
+      if (zset_max_zpack_value < 0)
+        zset_max_zpack_value = 0;
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--io-threads N] [--shards N]\n"
+              "          [--client-output-buffer-limit <class> <hard> <soft> "
+              "<seconds>]\n"
+              "          [--latency-tracking yes|no]\n"
+              "          [--slowlog-log-slower-than <usec>] "
+              "[--slowlog-max-len <n>]\n"
+              "          [--hz <n>] [--cron-budget <usec>]\n"
+              "          [--active-expire-index yes|no]\n"
+              "          [--hash-max-listpack-entries <n>] "
+              "[--hash-max-listpack-value <bytes>]\n"
+              "          [--list-compress-depth <n>]\n"
+              "          [--zset-max-zpack-entries <n>] "
+              "[--zset-max-zpack-value <bytes>]\n",
+              argv[0]);
+      exit(EXIT_FAILURE);
     }
   }
 
-  close(server_fd);
+  hash_seed_init();
+  shared_objects_init();
+  latency_init();
+  slowlog_configure();
+
+  if (command_table_init() < 0) {
+    fprintf(stderr, "Couldn't build the command table\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (shards_init(shard_threads) < 0) {
+    fprintf(stderr, "Couldn't allocate the shards\n");
+    exit(EXIT_FAILURE);
+  }
+
+  rdb_load(shards[0].db, "dump.rdb");
+  shards_distribute();
+
+  if (expire_index_enabled) {
+    for (int i = 0; i < shard_count; i++)
+      expire_index_rebuild(&shards[i].expire_index, shards[i].db);
+  }
+
+  // Each shard already owns a core, I/O threads only help a single loop
+  if (shard_count > 1)
+    io_threads = 1;
+
+#ifdef NET_IO_URING
+  // Reads and writes are already asynchronous
+  io_threads = 1;
+#endif
+
+  io_threads = io_threads_init(io_threads);
+  printf("I/O threads: %d, shards: %d\n", io_threads, shard_count);
+
+  for (int i = 0; i < shard_count; i++)
+    shard_setup(&shards[i]);
+
+  // Shard 0 runs on the main thread
+  for (int i = 1; i < shard_count; i++) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, shard_loop, &shards[i]) != 0) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  shard_loop(&shards[0]);
+
+  close(shards[0].server_fd);
   return 0;
 }
@@ -1,9 +1,27 @@
 #include "../include/set.h"
 #include "../include/hash_table.h"
 #include "../include/recis.h"
+#include <inttypes.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-static char *SET_DUMMY_VALUE = "1";
+// Sizes are powers of two, the bucket is the masked hash
+#define set_slot(h, size) ((size_t)(h) & ((size) - 1))
+
+#define SET_MIN_SIZE 4
+#define SET_REHASH_EMPTY_VISITS 10
+// Same policy as the chained hash table: grow at one member per bucket,
+// shrink once fewer than one bucket in SET_SHRINK_RATIO is used
+#define SET_SHRINK_RATIO 8
+#define SET_SHRINK_MIN_SIZE 16
+
+static size_t set_round_size(size_t size) {
+  size_t n = SET_MIN_SIZE;
+  while (n < size)
+    n <<= 1;
+  return n;
+}
 
 r_obj *create_set_object() {
   r_obj *o;
@@ -12,8 +30,30 @@ r_obj *create_set_object() {
     return NULL;
 
   o->type = SET;
+  o->refcount = 1;
+  o->encoding = OBJ_ENCODING_RAW;
+
+  o->data = set_create(16);
+
+  if (o->data == NULL) {
+    free(o);
+    return NULL;
+  }
+
+  return o;
+}
+
+r_obj *create_intset_object() {
+  r_obj *o;
+
+  if ((o = (r_obj *)malloc(sizeof(r_obj))) == NULL)
+    return NULL;
+
+  o->type = SET;
+  o->refcount = 1;
+  o->encoding = OBJ_ENCODING_INTSET;
 
-  o->data = hash_table_create(16);
+  o->data = intset_new();
 
   if (o->data == NULL) {
     free(o);
@@ -23,21 +63,382 @@ r_obj *create_set_object() {
   return o;
 }
 
+// Empty set in the encoding that suits its first member
+r_obj *create_set_object_for(Bytes *member) {
+  long long value;
+
+  if (string_is_int64(member->data, member->length, &value))
+    return create_intset_object();
+
+  return create_set_object();
+}
+
+// Moves the members of an intset object into a hash set
+static int set_object_convert(r_obj *o) {
+  IntSet *is = (IntSet *)o->data;
+  Set *set;
+
+  if ((set = set_create(intset_len(is) + 1)) == NULL)
+    return -1;
+
+  for (uint32_t i = 0; i < intset_len(is); i++) {
+    char buf[OBJ_INT_BUF];
+    Bytes member;
+
+    member.length = (uint32_t)snprintf(buf, sizeof(buf), "%" PRId64,
+                                       intset_get(is, i));
+    member.flags = 0;
+    member.data = buf;
+    set_add(set, &member);
+  }
+
+  free(is);
+  o->data = set;
+  o->encoding = OBJ_ENCODING_RAW;
+  return 0;
+}
+
+// Returns 1 if the member was added, 0 if it was already there
+int set_object_add(r_obj *o, Bytes *member) {
+  if (o->encoding == OBJ_ENCODING_INTSET) {
+    long long value;
+
+    if (string_is_int64(member->data, member->length, &value)) {
+      IntSet *is = (IntSet *)o->data;
+      int added;
+
+      o->data = is = intset_add(is, value, &added);
+
+      if (added && intset_len(is) > SET_MAX_INTSET_ENTRIES)
+        set_object_convert(o);
+
+      return added;
+    }
+
+    if (set_object_convert(o) < 0)
+      return 0;
+  }
+
+  return set_add((Set *)o->data, member);
+}
+
+int set_object_rem(r_obj *o, Bytes *member) {
+  if (o->encoding == OBJ_ENCODING_INTSET) {
+    long long value;
+    int removed;
+
+    if (!string_is_int64(member->data, member->length, &value))
+      return 0;
+
+    o->data = intset_remove((IntSet *)o->data, value, &removed);
+    return removed;
+  }
+
+  return set_rem((Set *)o->data, member);
+}
+
+int set_object_is_member(r_obj *o, Bytes *member) {
+  if (o->encoding == OBJ_ENCODING_INTSET) {
+    long long value;
+
+    return string_is_int64(member->data, member->length, &value) &&
+           intset_find((IntSet *)o->data, value);
+  }
+
+  return set_is_member((Set *)o->data, member);
+}
+
+size_t set_object_size(r_obj *o) {
+  if (o->encoding == OBJ_ENCODING_INTSET)
+    return intset_len((IntSet *)o->data);
+
+  return set_size((Set *)o->data);
+}
+
+void set_object_iterator_init(r_obj *o, SetObjectIterator *it) {
+  it->o = o;
+  it->pos = 0;
+
+  if (o->encoding != OBJ_ENCODING_INTSET)
+    set_iterator_init((Set *)o->data, &it->it);
+}
+
+Bytes *set_object_next(SetObjectIterator *it) {
+  if (it->o->encoding != OBJ_ENCODING_INTSET)
+    return set_next(&it->it);
+
+  IntSet *is = (IntSet *)it->o->data;
+  if (it->pos >= intset_len(is))
+    return NULL;
+
+  it->tmp.length = (uint32_t)snprintf(it->buf, sizeof(it->buf), "%" PRId64,
+                                      intset_get(is, it->pos++));
+  it->tmp.flags = 0;
+  it->tmp.data = it->buf;
+  return &it->tmp;
+}
+
+void set_object_iterator_release(SetObjectIterator *it) {
+  if (it->o->encoding != OBJ_ENCODING_INTSET)
+    set_iterator_release(&it->it);
+}
+
+Set *set_create(size_t size) {
+  Set *set;
+
+  if ((set = (Set *)malloc(sizeof(Set))) == NULL)
+    return NULL;
+
+  size = set_round_size(size);
+  if ((set->buckets = calloc(size, sizeof(SetEntry *))) == NULL) {
+    free(set);
+    return NULL;
+  }
+
+  set->size = size;
+  set->count = 0;
+
+  set->rehash_buckets = NULL;
+  set->rehash_size = 0;
+  set->rehash_index = -1;
+
+  set->paused = 0;
+
+  return set;
+}
+
+static void set_free_buckets(SetEntry **buckets, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    SetEntry *entry = buckets[i];
+    while (entry) {
+      SetEntry *next = entry->next;
+      free(entry);
+      entry = next;
+    }
+  }
+
+  free(buckets);
+}
+
+void set_destroy(Set *set) {
+  if (!set)
+    return;
+
+  set_free_buckets(set->buckets, set->size);
+
+  if (set->rehash_buckets)
+    set_free_buckets(set->rehash_buckets, set->rehash_size);
+
+  free(set);
+}
+
+static void set_start_rehash(Set *set, size_t new_size) {
+  SetEntry **new_buckets = calloc(new_size, sizeof(SetEntry *));
+  if (new_buckets == NULL)
+    return;
+
+  set->rehash_buckets = new_buckets;
+  set->rehash_size = new_size;
+  set->rehash_index = 0;
+}
+
+// Moves up to n buckets to the new table, see hash_table_rehash
+static void set_rehash(Set *set, int n) {
+  size_t empty_visits = n * SET_REHASH_EMPTY_VISITS;
+
+  while (n-- > 0 && (size_t)set->rehash_index < set->size) {
+    while (set->buckets[set->rehash_index] == NULL) {
+      set->rehash_index++;
+      if ((size_t)set->rehash_index >= set->size)
+        break;
+      if (--empty_visits == 0)
+        return;
+    }
+
+    if ((size_t)set->rehash_index >= set->size)
+      break;
+
+    SetEntry *entry = set->buckets[set->rehash_index];
+    while (entry) {
+      SetEntry *next = entry->next;
+      size_t slot = set_slot(hash(&entry->member), set->rehash_size);
+
+      entry->next = set->rehash_buckets[slot];
+      set->rehash_buckets[slot] = entry;
+
+      entry = next;
+    }
+
+    set->buckets[set->rehash_index] = NULL;
+    set->rehash_index++;
+  }
+
+  if ((size_t)set->rehash_index >= set->size) {
+    free(set->buckets);
+
+    set->buckets = set->rehash_buckets;
+    set->size = set->rehash_size;
+
+    set->rehash_buckets = NULL;
+    set->rehash_size = 0;
+    set->rehash_index = -1;
+  }
+}
+
+static void set_rehash_step(Set *set) {
+  if (set->rehash_index != -1 && set->paused == 0)
+    set_rehash(set, 1);
+}
+
+static SetEntry *set_find(Set *set, Bytes *member, uint64_t h) {
+  SetEntry *entry = set->buckets[set_slot(h, set->size)];
+  while (entry) {
+    if (bytes_equal(member, &entry->member) == 1)
+      return entry;
+    entry = entry->next;
+  }
+
+  if (set->rehash_index == -1)
+    return NULL;
+
+  entry = set->rehash_buckets[set_slot(h, set->rehash_size)];
+  while (entry) {
+    if (bytes_equal(member, &entry->member) == 1)
+      return entry;
+    entry = entry->next;
+  }
+
+  return NULL;
+}
+
+// Returns 1 if the member was added, 0 if it was already there
 int set_add(Set *set, Bytes *member) {
-  if (hash_table_get(set, member) != NULL)
+  if (set->rehash_index != -1)
+    set_rehash_step(set);
+  else if (set->count >= set->size)
+    set_start_rehash(set, set->size * 2);
+
+  uint64_t h = hash(member);
+  if (set_find(set, member, h) != NULL)
     return 0;
 
-  hash_table_set(set, member, create_string_object(SET_DUMMY_VALUE, 1));
+  SetEntry *entry;
+  if ((entry = (SetEntry *)malloc(sizeof(SetEntry) + member->length + 1)) ==
+      NULL)
+    return 0;
+
+  entry->member.length = member->length;
+  entry->member.flags = 0;
+  entry->member.data = (char *)(entry + 1);
+  memcpy(entry->member.data, member->data, member->length);
+  entry->member.data[member->length] = '\0';
+
+  // New members always go to the table that survives the rehash
+  SetEntry **buckets = set->buckets;
+  size_t size = set->size;
+  if (set->rehash_index != -1) {
+    buckets = set->rehash_buckets;
+    size = set->rehash_size;
+  }
+
+  size_t slot = set_slot(h, size);
+  entry->next = buckets[slot];
+  buckets[slot] = entry;
+
+  set->count++;
   return 1;
 }
 
+static int set_rem_from(Set *set, SetEntry **buckets, size_t size,
+                        Bytes *member, uint64_t h) {
+  SetEntry **link = &buckets[set_slot(h, size)];
+
+  while (*link) {
+    SetEntry *entry = *link;
+
+    if (bytes_equal(member, &entry->member) == 1) {
+      *link = entry->next;
+      free(entry);
+
+      set->count--;
+      return 1;
+    }
+
+    link = &entry->next;
+  }
+
+  return 0;
+}
+
+// Returns 1 if the member was removed, 0 if it wasn't there
 int set_rem(Set *set, Bytes *member) {
-  if (hash_table_get(set, member) == NULL)
-    return 0;
+  set_rehash_step(set);
+
+  uint64_t h = hash(member);
+  int removed = set_rem_from(set, set->buckets, set->size, member, h);
+
+  if (!removed && set->rehash_index != -1)
+    removed = set_rem_from(set, set->rehash_buckets, set->rehash_size, member,
+                           h);
 
-  return hash_table_del(set, member);
+  if (removed && set->rehash_index == -1 && set->paused == 0 &&
+      set->size > SET_SHRINK_MIN_SIZE &&
+      set->count * SET_SHRINK_RATIO < set->size)
+    set_start_rehash(set, set_round_size(set->count * 2));
+
+  return removed;
 }
 
 int set_is_member(Set *set, Bytes *member) {
-  return hash_table_get(set, member) != NULL;
+  set_rehash_step(set);
+
+  return set_find(set, member, hash(member)) != NULL;
 }
+
+// Iterators pause incremental rehashing until released, so members never
+// move between tables under an active iteration
+void set_iterator_init(Set *set, SetIterator *it) {
+  it->set = set;
+  it->table = 0;
+  it->index = 0;
+  it->entry = NULL;
+  it->next_entry = NULL;
+
+  set->paused++;
+}
+
+Bytes *set_next(SetIterator *it) {
+  Set *set = it->set;
+
+  while (1) {
+    if (it->entry == NULL) {
+      SetEntry **buckets = set->buckets;
+      size_t size = set->size;
+
+      if (it->table == 1) {
+        buckets = set->rehash_buckets;
+        size = set->rehash_size;
+      }
+
+      if (it->index >= size) {
+        if (it->table == 0 && set->rehash_index != -1) {
+          it->table = 1;
+          it->index = 0;
+          continue;
+        }
+        return NULL;
+      }
+
+      it->entry = buckets[it->index++];
+    } else {
+      it->entry = it->next_entry;
+    }
+
+    if (it->entry) {
+      it->next_entry = it->entry->next;
+      return &it->entry->member;
+    }
+  }
+}
+
+void set_iterator_release(SetIterator *it) { it->set->paused--; }
@@ -0,0 +1,470 @@
+#include "../include/recis.h"
+#include "../include/shard.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Every shard runs its own event loop on its own thread and is the only one
+// touching its tables. A command whose keys all live on another shard is
+// handed over through that shard's inbox and the client waits for the reply.
+// Commands spanning several shards take shard_lock for writing: every other
+// loop is parked outside of command execution, the keys are moved into the
+// coordinating shard, the command runs there and the keys are moved back.
+
+#define SHARD_MSG_REQUEST 0
+#define SHARD_MSG_REPLY 1
+
+typedef struct ShardMessage_ {
+  int type;
+  int from;
+  Client *client;
+  // Only used to name the client in the slow log
+  int client_fd;
+
+  // Request
+  Command *cmd;
+  int arg_count;
+  Bytes **arg_values;
+
+  // Reply, chunks get spliced into the client's output buffer
+  OutputBuffer *reply;
+} ShardMessage;
+
+Shard *shards = NULL;
+int shard_count = 1;
+
+// Held for reading by every loop while it runs commands, for writing by a
+// shard running a cross-shard command
+static pthread_rwlock_t shard_lock;
+
+static int queue_push(ShardQueue *q, void *item) {
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+  if (tail - head == SHARD_QUEUE_SIZE)
+    return 0;
+
+  q->items[tail & (SHARD_QUEUE_SIZE - 1)] = item;
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+  return 1;
+}
+
+static void *queue_pop(ShardQueue *q) {
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+  if (head == tail)
+    return NULL;
+
+  void *item = q->items[head & (SHARD_QUEUE_SIZE - 1)];
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+  return item;
+}
+
+int shards_init(int count) {
+  if (count < 1)
+    count = 1;
+  if (count > SHARDS_MAX)
+    count = SHARDS_MAX;
+
+  if ((shards = calloc(count, sizeof(Shard))) == NULL)
+    return -1;
+
+  shard_count = count;
+
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  // A waiting cross-shard command must not starve behind busy loops
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&shard_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+
+  for (int i = 0; i < count; i++) {
+    Shard *s = &shards[i];
+
+    s->id = i;
+    s->db = hash_table_create(1024);
+    s->vector_indices = hash_table_create(16);
+
+    s->command_latency = calloc(command_count, sizeof(LatencyHistogram));
+
+    if (s->db == NULL || s->vector_indices == NULL ||
+        s->command_latency == NULL || slowlog_init(&s->slowlog) < 0)
+      return -1;
+
+    if (count == 1)
+      continue;
+
+    if ((s->event_fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+      perror("eventfd");
+      return -1;
+    }
+
+    for (int j = 0; j < count; j++) {
+      if (j == i)
+        continue;
+
+      if ((s->inbox[j] = calloc(1, sizeof(ShardQueue))) == NULL)
+        return -1;
+    }
+  }
+
+  return count;
+}
+
+// Uses the top bits of the hash, the tables index with the low ones
+int shard_for_key(Bytes *key) {
+  return (int)(((hash(key) >> 32) * (uint64_t)shard_count) >> 32);
+}
+
+// Returns the shard owning every key of the command, or SHARD_ALL
+int shard_route(Shard *self, Command *cmd, Client *c) {
+  if (shard_count == 1)
+    return self->id;
+
+  if (cmd->flags & CMD_GLOBAL)
+    return SHARD_ALL;
+
+  if (cmd->first_key == 0 || cmd->first_key >= c->arg_count)
+    return self->id;
+
+  int last = command_last_key(cmd, c->arg_count);
+  int owner = shard_for_key(c->arg_values[cmd->first_key]);
+
+  for (int i = cmd->first_key + cmd->key_step; i <= last; i += cmd->key_step) {
+    if (shard_for_key(c->arg_values[i]) != owner)
+      return SHARD_ALL;
+  }
+
+  return owner;
+}
+
+// The table counts are plain fields, other shards only read these copies
+static void shard_publish_keyspace(Shard *self) {
+  __atomic_store_n(&self->stat_keys, self->db->count, __ATOMIC_RELAXED);
+  __atomic_store_n(&self->stat_expires, self->db->expiring_count,
+                   __ATOMIC_RELAXED);
+}
+
+// For every shard, only while the other loops are parked or not started
+static void shards_publish_keyspace(void) {
+  for (int i = 0; i < shard_count; i++)
+    shard_publish_keyspace(&shards[i]);
+}
+
+// Runs the command and records how long it took
+void shard_call(Shard *self, Command *cmd, CommandContext *ctx) {
+  latency_add(&self->stat_commands, 1);
+
+  if (!latency_tracking && slowlog_threshold == UINT64_MAX) {
+    cmd->proc(ctx);
+    shard_publish_keyspace(self);
+    return;
+  }
+
+  uint64_t start = latency_now();
+
+  cmd->proc(ctx);
+
+  uint64_t cycles = latency_now() - start;
+  shard_publish_keyspace(self);
+
+  if (latency_tracking)
+    latency_record(&self->command_latency[cmd - CommandTable], cycles);
+
+  if (cycles >= slowlog_threshold)
+    slowlog_push(&self->slowlog, ctx->client, cycles);
+}
+
+// Called from the cron, keeps a moving average of the commands per second.
+// Also publishes what active expiry removed.
+void shard_sample_stats(Shard *self, long long now_ms) {
+  uint64_t commands = self->stat_commands;
+  long long elapsed = now_ms - self->ops_last_ms;
+
+  shard_publish_keyspace(self);
+
+  if (self->ops_last_ms != 0 && elapsed > 0) {
+    self->ops_samples[self->ops_sample_index] =
+        (commands - self->ops_last_commands) * 1000 / elapsed;
+    self->ops_sample_index = (self->ops_sample_index + 1) % SHARD_STATS_SAMPLES;
+
+    uint64_t sum = 0;
+    for (int i = 0; i < SHARD_STATS_SAMPLES; i++)
+      sum += self->ops_samples[i];
+
+    __atomic_store_n(&self->stat_ops_per_sec, sum / SHARD_STATS_SAMPLES,
+                     __ATOMIC_RELAXED);
+  }
+
+  self->ops_last_commands = commands;
+  self->ops_last_ms = now_ms;
+}
+
+void shard_enter(Shard *self) {
+  (void)self;
+  if (shard_count > 1)
+    pthread_rwlock_rdlock(&shard_lock);
+}
+
+void shard_leave(Shard *self) {
+  (void)self;
+  if (shard_count > 1)
+    pthread_rwlock_unlock(&shard_lock);
+}
+
+static void shard_wake(int target) {
+  uint64_t one = 1;
+  if (write(shards[target].event_fd, &one, sizeof(one)) == -1)
+    perror("write eventfd");
+}
+
+// Wakes every shard that got messages since the last call
+void shard_wake_peers(Shard *self) {
+  uint64_t mask = self->wake_mask;
+  self->wake_mask = 0;
+
+  while (mask) {
+    shard_wake(__builtin_ctzll(mask));
+    mask &= mask - 1;
+  }
+}
+
+static void shard_send(Shard *self, int target, ShardMessage *msg) {
+  ShardQueue *q = shards[target].inbox[self->id];
+
+  // The target may itself be blocked sending to us, keep our inbox moving
+  while (!queue_push(q, msg)) {
+    shard_wake(target);
+    shard_drain(self);
+
+    shard_leave(self);
+    sched_yield();
+    shard_enter(self);
+  }
+
+  self->wake_mask |= 1ULL << target;
+}
+
+// Hands the parsed command over to its owner, the client stops processing
+// its pipeline until the reply comes back
+void shard_forward(Shard *self, int target, Command *cmd, Client *c) {
+  ShardMessage *msg;
+  Bytes **arg_values;
+
+  if ((msg = malloc(sizeof(ShardMessage))) == NULL ||
+      (arg_values = malloc(c->arg_count * sizeof(Bytes *))) == NULL) {
+    free(msg);
+    append_to_output_buffer(c->output_buffer, "-ERR out of memory\r\n", 20);
+    return;
+  }
+
+  // The arguments are views into the client's query buffer, the owner gets
+  // its own copies
+  for (int i = 0; i < c->arg_count; i++) {
+    if ((arg_values[i] = bytes_dup(c->arg_values[i])) == NULL) {
+      while (i-- > 0)
+        free_bytes_object(arg_values[i]);
+      free(arg_values);
+      free(msg);
+      append_to_output_buffer(c->output_buffer, "-ERR out of memory\r\n", 20);
+      return;
+    }
+  }
+
+  msg->type = SHARD_MSG_REQUEST;
+  msg->from = self->id;
+  msg->client = c;
+  msg->client_fd = c->fd;
+  msg->cmd = cmd;
+  msg->arg_count = c->arg_count;
+  msg->arg_values = arg_values;
+  msg->reply = NULL;
+
+  c->blocked = 1;
+  shard_send(self, target, msg);
+}
+
+static void shard_execute_request(Shard *self, ShardMessage *msg) {
+  OutputBuffer *ob = create_output_buffer(-1);
+
+  Client remote;
+  memset(&remote, 0, sizeof(remote));
+  // Replies go to ob, the fd only names the client in the slow log
+  remote.fd = msg->client_fd;
+  remote.arg_count = msg->arg_count;
+  remote.arg_values = msg->arg_values;
+  remote.output_buffer = ob;
+
+  if (ob != NULL) {
+    CommandContext ctx = {&remote, self->db, self->vector_indices, ob,
+                          &self->expire_index};
+    shard_call(self, msg->cmd, &ctx);
+  }
+
+  for (int i = 0; i < msg->arg_count; i++) {
+    if (msg->arg_values[i] != NULL)
+      free_bytes_object(msg->arg_values[i]);
+  }
+  free(msg->arg_values);
+  msg->arg_values = NULL;
+
+  msg->type = SHARD_MSG_REPLY;
+  msg->reply = ob;
+
+  shard_send(self, msg->from, msg);
+}
+
+static void shard_deliver_reply(Shard *self, ShardMessage *msg) {
+  Client *c = msg->client;
+  c->blocked = 0;
+
+  // The client may have disconnected while its command was away
+  if (c->fd != -1) {
+    if (msg->reply == NULL)
+      append_to_output_buffer(c->output_buffer, "-ERR out of memory\r\n",
+                              20);
+    else
+      output_buffer_splice(c->output_buffer, msg->reply);
+
+    if (self->resumed_count == self->resumed_cap) {
+      size_t cap = self->resumed_cap ? self->resumed_cap * 2 : 64;
+      Client **resumed = realloc(self->resumed, cap * sizeof(Client *));
+
+      if (resumed != NULL) {
+        self->resumed = resumed;
+        self->resumed_cap = cap;
+      }
+    }
+
+    if (self->resumed_count < self->resumed_cap)
+      self->resumed[self->resumed_count++] = c;
+  }
+
+  if (msg->reply != NULL)
+    free_output_buffer(msg->reply);
+  free(msg);
+}
+
+// Runs forwarded requests and collects replies for our own clients
+void shard_drain(Shard *self) {
+  for (int j = 0; j < shard_count; j++) {
+    if (j == self->id)
+      continue;
+
+    ShardMessage *msg;
+    while ((msg = queue_pop(self->inbox[j])) != NULL) {
+      if (msg->type == SHARD_MSG_REQUEST)
+        shard_execute_request(self, msg);
+      else
+        shard_deliver_reply(self, msg);
+    }
+  }
+}
+
+static void shard_move_key(Shard *from, Shard *to, Bytes *key) {
+  r_obj *val;
+  Node *entry;
+
+  // The deadline lives in the key, which the take frees
+  if ((entry = hash_table_find_entry(from->db, key)) != NULL) {
+    long long when = hash_key_expire(entry->key);
+
+    // Out of memory the key goes back where it was
+    Shard *owner = to;
+    val = hash_table_take(from->db, key);
+    if (hash_table_set(to->db, key, val) != 0 &&
+        hash_table_set((owner = from)->db, key, val) != 0) {
+      free_object(val);
+      owner = NULL;
+    }
+    // The index of the shard the key left keeps a stale entry, it is
+    // dropped when it comes up
+    if (owner != NULL && when != -1) {
+      hash_table_set_expire(owner->db, key, when);
+      expire_index_add(&owner->expire_index, key, when);
+    }
+  }
+  if ((val = hash_table_take(from->vector_indices, key)) != NULL &&
+      hash_table_set(to->vector_indices, key, val) != 0 &&
+      hash_table_set(from->vector_indices, key, val) != 0)
+    free_object(val);
+}
+
+// Moves the keys of the command into self (gather) or back to their owners
+static void shard_move_keys(Shard *self, Command *cmd, Client *c,
+                            int gather) {
+  if (cmd->first_key == 0 || cmd->first_key >= c->arg_count)
+    return;
+
+  int last = command_last_key(cmd, c->arg_count);
+
+  for (int i = cmd->first_key; i <= last; i += cmd->key_step) {
+    Bytes *key = c->arg_values[i];
+    int owner = shard_for_key(key);
+
+    if (owner == self->id)
+      continue;
+
+    if (gather)
+      shard_move_key(&shards[owner], self, key);
+    else
+      shard_move_key(self, &shards[owner], key);
+  }
+}
+
+// Runs a command over keys of several shards with every other loop parked
+void shard_run_exclusive(Shard *self, Command *cmd, Client *c) {
+  pthread_rwlock_unlock(&shard_lock);
+  pthread_rwlock_wrlock(&shard_lock);
+
+  shard_move_keys(self, cmd, c, 1);
+
+  CommandContext ctx = {c, self->db, self->vector_indices,
+                        c->output_buffer, &self->expire_index};
+  shard_call(self, cmd, &ctx);
+
+  shard_move_keys(self, cmd, c, 0);
+  shards_publish_keyspace();
+
+  pthread_rwlock_unlock(&shard_lock);
+  pthread_rwlock_rdlock(&shard_lock);
+}
+
+// Spreads keys loaded into shard 0 over their owners, before the loops start
+void shards_distribute(void) {
+  if (shard_count == 1) {
+    shards_publish_keyspace();
+    return;
+  }
+
+  Shard *first = &shards[0];
+
+  HashTableIterator it;
+  hash_table_iterator_init(first->db, &it);
+
+  Node *node;
+  while ((node = hash_table_next(&it)) != NULL) {
+    int owner = shard_for_key(node->key);
+    if (owner == 0)
+      continue;
+
+    // Taking the entry frees its key
+    Bytes *key = bytes_dup(node->key);
+    if (key == NULL) {
+      fprintf(stderr, "Out of memory spreading keys over the shards\n");
+      break;
+    }
+    shard_move_key(first, &shards[owner], key);
+    free_bytes_object(key);
+  }
+
+  hash_table_iterator_release(&it);
+  shards_publish_keyspace();
+}
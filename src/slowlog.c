@@ -0,0 +1,130 @@
+#include "../include/slowlog.h"
+#include "../include/latency.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+long long slowlog_log_slower_than = 10000;
+size_t slowlog_max_len = 128;
+uint64_t slowlog_threshold = UINT64_MAX;
+
+// Entry ids are global so the logs of every shard can be merged in order
+static _Atomic long long slowlog_next_id = 0;
+
+// Needs latency_init to have run
+void slowlog_configure(void) {
+  if (slowlog_log_slower_than < 0 || slowlog_max_len == 0)
+    slowlog_threshold = UINT64_MAX;
+  else
+    slowlog_threshold = latency_cycles((double)slowlog_log_slower_than);
+}
+
+int slowlog_init(Slowlog *log) {
+  log->next = 0;
+  log->length = 0;
+
+  if (slowlog_max_len == 0) {
+    log->entries = NULL;
+    return 0;
+  }
+
+  if ((log->entries = calloc(slowlog_max_len, sizeof(SlowlogEntry))) == NULL)
+    return -1;
+
+  return 0;
+}
+
+static void slowlog_entry_free(SlowlogEntry *entry) {
+  for (int i = 0; i < entry->argc; i++) {
+    if (entry->argv[i] != NULL)
+      free_bytes_object(entry->argv[i]);
+  }
+
+  free(entry->argv);
+  entry->argv = NULL;
+  entry->argc = 0;
+}
+
+// Copies an argument, cutting long ones as "<head>... (N more bytes)"
+static Bytes *slowlog_arg(Bytes *arg) {
+  if (arg->length <= SLOWLOG_ENTRY_MAX_STRING)
+    return bytes_dup(arg);
+
+  char buf[SLOWLOG_ENTRY_MAX_STRING + 64];
+  memcpy(buf, arg->data, SLOWLOG_ENTRY_MAX_STRING);
+  int len = snprintf(buf + SLOWLOG_ENTRY_MAX_STRING, 64,
+                     "... (%u more bytes)",
+                     arg->length - SLOWLOG_ENTRY_MAX_STRING);
+
+  return create_bytes_object(buf, SLOWLOG_ENTRY_MAX_STRING + len);
+}
+
+static void slowlog_peer(int fd, char *addr, size_t size) {
+  struct sockaddr_in peer;
+  socklen_t peer_len = sizeof(peer);
+  char ip[INET_ADDRSTRLEN];
+
+  if (fd == -1 || getpeername(fd, (struct sockaddr *)&peer, &peer_len) == -1 ||
+      peer.sin_family != AF_INET ||
+      inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip)) == NULL) {
+    addr[0] = '\0';
+    return;
+  }
+
+  snprintf(addr, size, "%s:%u", ip, ntohs(peer.sin_port));
+}
+
+// Called with the arguments of the command that just ran, before they are
+// released
+void slowlog_push(Slowlog *log, Client *c, uint64_t cycles) {
+  if (log->entries == NULL)
+    return;
+
+  SlowlogEntry *entry = &log->entries[log->next];
+  slowlog_entry_free(entry);
+
+  int argc = c->arg_count;
+  if (argc > SLOWLOG_ENTRY_MAX_ARGC)
+    argc = SLOWLOG_ENTRY_MAX_ARGC;
+
+  if ((entry->argv = malloc(argc * sizeof(Bytes *))) == NULL)
+    return;
+
+  entry->argc = argc;
+  for (int i = 0; i < argc; i++) {
+    // The last slot says how many arguments were left out
+    if (i == argc - 1 && argc < c->arg_count) {
+      char buf[64];
+      int len = snprintf(buf, sizeof(buf), "... (%d more arguments)",
+                         c->arg_count - argc + 1);
+      entry->argv[i] = create_bytes_object(buf, len);
+    } else {
+      entry->argv[i] = slowlog_arg(c->arg_values[i]);
+    }
+  }
+
+  entry->id = atomic_fetch_add_explicit(&slowlog_next_id, 1,
+                                        memory_order_relaxed);
+  entry->time = (long long)time(NULL);
+  entry->duration_usec = (long long)latency_usec(cycles);
+  entry->fd = c->fd;
+  slowlog_peer(c->fd, entry->addr, sizeof(entry->addr));
+
+  log->next = (log->next + 1) % slowlog_max_len;
+  if (log->length < slowlog_max_len)
+    log->length++;
+}
+
+void slowlog_reset(Slowlog *log) {
+  for (size_t i = 0; i < log->length; i++)
+    slowlog_entry_free(&log->entries[i]);
+
+  log->next = 0;
+  log->length = 0;
+}
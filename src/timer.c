@@ -0,0 +1,206 @@
+#include "../include/timer.h"
+
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#define TIMER_LEVEL_SHIFT(l) ((l) * TIMER_WHEEL_BITS)
+#define TIMER_LEVEL_SPAN(l) (1LL << TIMER_LEVEL_SHIFT((l) + 1))
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+_Thread_local long long clock_unix_ms = 0;
+_Thread_local long long clock_mono_us = 0;
+
+void clock_update(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  clock_unix_ms = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  clock_mono_us = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+long long timer_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+long long timer_now_ms(void) { return timer_now_us() / 1000; }
+
+void timer_wheel_init(TimerWheel *w, long long now) {
+  memset(w, 0, sizeof(*w));
+  w->now = now;
+}
+
+void timer_init(Timer *t, timer_proc proc, void *data) {
+  t->next = NULL;
+  t->pprev = NULL;
+  t->expires = 0;
+  t->proc = proc;
+  t->data = data;
+}
+
+// Puts the timer on the lowest level whose span covers its deadline
+static void timer_place(TimerWheel *w, Timer *t) {
+  long long expires = t->expires < w->now ? w->now : t->expires;
+  long long delta = expires - w->now;
+  int level = 0;
+
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >= TIMER_LEVEL_SPAN(level))
+    level++;
+
+  // Too far out, parked at the end of the last level until it comes closer
+  if (delta >= TIMER_LEVEL_SPAN(level))
+    expires = w->now + TIMER_LEVEL_SPAN(level) - 1;
+
+  int slot = (int)(expires >> TIMER_LEVEL_SHIFT(level)) & TIMER_WHEEL_MASK;
+  Timer **head = &w->slots[level][slot];
+
+  t->level = level;
+  t->slot = slot;
+  t->next = *head;
+  if (t->next != NULL)
+    t->next->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+
+  w->occupied[level] |= 1ULL << slot;
+}
+
+void timer_add(TimerWheel *w, Timer *t, long long expires) {
+  if (t->pprev != NULL)
+    timer_del(w, t);
+
+  t->expires = expires;
+  timer_place(w, t);
+}
+
+void timer_del(TimerWheel *w, Timer *t) {
+  if (t->pprev == NULL)
+    return;
+
+  *t->pprev = t->next;
+  if (t->next != NULL)
+    t->next->pprev = t->pprev;
+
+  if (w->slots[t->level][t->slot] == NULL)
+    w->occupied[t->level] &= ~(1ULL << t->slot);
+
+  t->next = NULL;
+  t->pprev = NULL;
+}
+
+static Timer *timer_slot_take(TimerWheel *w, int level, int slot) {
+  Timer *list = w->slots[level][slot];
+
+  w->slots[level][slot] = NULL;
+  w->occupied[level] &= ~(1ULL << slot);
+
+  return list;
+}
+
+// First tick at which the wheel has to do something: run a timer of level 0
+// or move a slot of a higher level down. LLONG_MAX if there are no timers.
+static long long timer_wheel_next(TimerWheel *w) {
+  long long next = LLONG_MAX;
+
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    uint64_t occupied = w->occupied[level];
+    if (occupied == 0)
+      continue;
+
+    int shift = TIMER_LEVEL_SHIFT(level);
+    long long base = w->now & ~(TIMER_LEVEL_SPAN(level) - 1);
+    int current = (int)(w->now >> shift) & TIMER_WHEEL_MASK;
+
+    // Slots from the current one on come up in this turn of the level, the
+    // ones before it in the next turn. The current slot only counts while
+    // the wheel sits on its first tick: past that it has been moved down,
+    // and whatever it holds since belongs to the next turn.
+    uint64_t ahead = occupied & (~0ULL << current);
+    if ((w->now & ((1LL << shift) - 1)) != 0)
+      ahead &= ~(1ULL << current);
+    long long tick;
+
+    if (ahead != 0)
+      tick = base + ((long long)__builtin_ctzll(ahead) << shift);
+    else
+      tick = base + TIMER_LEVEL_SPAN(level) +
+             ((long long)__builtin_ctzll(occupied) << shift);
+
+    if (tick < next)
+      next = tick;
+  }
+
+  return next;
+}
+
+static void timer_wheel_tick(TimerWheel *w) {
+  long long now = w->now;
+
+  // Entering a new slot of a higher level moves its timers down, starting
+  // from the top so everything lands where it belongs
+  for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+    if ((now & ((1LL << TIMER_LEVEL_SHIFT(level)) - 1)) != 0)
+      continue;
+
+    int slot = (int)(now >> TIMER_LEVEL_SHIFT(level)) & TIMER_WHEEL_MASK;
+    Timer *t = timer_slot_take(w, level, slot);
+
+    while (t != NULL) {
+      Timer *next = t->next;
+      timer_place(w, t);
+      t = next;
+    }
+  }
+
+  int slot = (int)now & TIMER_WHEEL_MASK;
+  w->now = now + 1;
+
+  // Every timer left in the slot is due. Callbacks may add or delete timers,
+  // the slot is detached first since a deadline 63 ticks out maps back onto
+  // it and has to wait for the next turn.
+  Timer *due = timer_slot_take(w, 0, slot);
+  if (due != NULL)
+    due->pprev = &due;
+
+  Timer *t;
+  while ((t = due) != NULL) {
+    timer_del(w, t);
+    t->proc(t->data);
+  }
+}
+
+// Runs every timer due at or before `now`, skipping over idle ticks
+void timer_wheel_run(TimerWheel *w, long long now) {
+  while (w->now <= now) {
+    long long next = timer_wheel_next(w);
+
+    if (next > now) {
+      w->now = now + 1;
+      return;
+    }
+
+    if (next > w->now)
+      w->now = next;
+
+    timer_wheel_tick(w);
+  }
+}
+
+// Milliseconds until the next timer, -1 if there is none
+int timer_wheel_timeout(TimerWheel *w, long long now) {
+  long long next = timer_wheel_next(w);
+
+  if (next == LLONG_MAX)
+    return -1;
+  if (next <= now)
+    return 0;
+  if (next - now > INT_MAX)
+    return INT_MAX;
+
+  return (int)(next - now);
+}
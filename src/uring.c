@@ -0,0 +1,270 @@
+#ifdef NET_IO_URING
+
+#include "../include/uring.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned wait_nr,
+                              unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, flags,
+                      NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// The ring must be created on the thread that drives it
+int uring_init(Uring *r, unsigned entries) {
+  struct io_uring_params p;
+
+  memset(r, 0, sizeof(*r));
+  memset(&p, 0, sizeof(p));
+
+  // Completions are only reaped by the owning loop, so task work can wait
+  // until it enters the kernel anyway
+  p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  r->fd = sys_io_uring_setup(entries, &p);
+
+  if (r->fd < 0 && errno == EINVAL) {
+    memset(&p, 0, sizeof(p));
+    r->fd = sys_io_uring_setup(entries, &p);
+  }
+
+  if (r->fd < 0) {
+    perror("io_uring_setup");
+    return -1;
+  }
+
+  r->flags = p.flags;
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_size > sq_size)
+      sq_size = cq_size;
+    cq_size = sq_size;
+  }
+
+  char *sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED) {
+    perror("mmap sq ring");
+    return -1;
+  }
+
+  char *cq_ptr = sq_ptr;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (cq_ptr == MAP_FAILED) {
+      perror("mmap cq ring");
+      return -1;
+    }
+  }
+
+  r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                 IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    perror("mmap sqes");
+    return -1;
+  }
+
+  r->sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+  r->sq_mask = *(unsigned *)(sq_ptr + p.sq_off.ring_mask);
+  r->sq_entries = p.sq_entries;
+  r->sqe_tail = *r->sq_tail;
+
+  // Slot i of the submission array always points at sqe i
+  unsigned *sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+  for (unsigned i = 0; i < p.sq_entries; i++)
+    sq_array[i] = i;
+
+  r->cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+  r->cq_mask = *(unsigned *)(cq_ptr + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+
+  return 0;
+}
+
+// Registers `count` buffers of `size` bytes the kernel picks from for
+// IOSQE_BUFFER_SELECT receives. count must be a power of two.
+int uring_setup_buffers(Uring *r, unsigned count, unsigned size, int group) {
+  size_t ring_size = count * sizeof(struct io_uring_buf);
+
+  r->buf_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r->buf_ring == MAP_FAILED) {
+    perror("mmap buffer ring");
+    return -1;
+  }
+
+  r->buf_base = mmap(NULL, (size_t)count * size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r->buf_base == MAP_FAILED) {
+    perror("mmap buffers");
+    return -1;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)r->buf_ring;
+  reg.ring_entries = count;
+  reg.bgid = group;
+
+  if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    perror("io_uring_register pbuf ring");
+    return -1;
+  }
+
+  r->buf_count = count;
+  r->buf_size = size;
+  r->buf_tail = 0;
+
+  for (unsigned bid = 0; bid < count; bid++)
+    uring_recycle_buffer(r, bid);
+
+  return 0;
+}
+
+char *uring_buffer(Uring *r, unsigned bid) {
+  return r->buf_base + (size_t)bid * r->buf_size;
+}
+
+// Hands a consumed receive buffer back to the kernel
+void uring_recycle_buffer(Uring *r, unsigned bid) {
+  struct io_uring_buf *buf =
+      &r->buf_ring->bufs[r->buf_tail & (r->buf_count - 1)];
+
+  buf->addr = (uint64_t)(uintptr_t)uring_buffer(r, bid);
+  buf->len = r->buf_size;
+  buf->bid = bid;
+
+  r->buf_tail++;
+  __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Returns a zeroed sqe, submitting the queued ones first if the ring is full
+struct io_uring_sqe *uring_get_sqe(Uring *r) {
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+  if (r->sqe_tail - head >= r->sq_entries) {
+    uring_submit_and_wait(r, 0);
+    head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    if (r->sqe_tail - head >= r->sq_entries)
+      return NULL;
+  }
+
+  struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sqe_tail++;
+  return sqe;
+}
+
+// One io_uring_enter submits everything queued since the last call
+int uring_submit_and_wait(Uring *r, unsigned wait_nr) {
+  __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+  // Counts from the kernel's head so entries left over by a short submit
+  // are retried
+  unsigned to_submit =
+      r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  unsigned flags = 0;
+
+  // Deferred task work only runs when we ask for events
+  if (wait_nr > 0 || (r->flags & IORING_SETUP_DEFER_TASKRUN))
+    flags |= IORING_ENTER_GETEVENTS;
+
+  if (to_submit == 0 && flags == 0)
+    return 0;
+
+  int ret = sys_io_uring_enter(r->fd, to_submit, wait_nr, flags);
+  if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+    perror("io_uring_enter");
+    return -1;
+  }
+
+  return 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(Uring *r) {
+  unsigned head = *r->cq_head;
+  unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+  if (head == tail)
+    return NULL;
+
+  return &r->cqes[head & r->cq_mask];
+}
+
+void uring_cqe_seen(Uring *r) {
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd,
+                                 uint64_t user_data) {
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK;
+  sqe->user_data = user_data;
+}
+
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, int group,
+                               uint64_t user_data) {
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = group;
+  sqe->user_data = user_data;
+}
+
+// msg and its iovecs must stay untouched until the completion
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                        const struct msghdr *msg, uint64_t user_data) {
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = user_data;
+}
+
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf, size_t len,
+                     uint64_t user_data) {
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = (unsigned)len;
+  sqe->off = (uint64_t)-1;
+  sqe->user_data = user_data;
+}
+
+// Completes with -ETIME once ts has passed, ts must outlive the operation
+void uring_prep_timeout(struct io_uring_sqe *sqe,
+                        struct __kernel_timespec *ts, uint64_t user_data) {
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t)(uintptr_t)ts;
+  sqe->len = 1;
+  sqe->user_data = user_data;
+}
+
+#endif // NET_IO_URING
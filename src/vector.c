@@ -26,6 +26,8 @@ r_obj *create_vector_object(Vector *v) {
     return NULL;
 
   o->type = VECTOR;
+  o->refcount = 1;
+  o->encoding = OBJ_ENCODING_RAW;
   o->data = (void *)v;
 
   return o;
@@ -103,7 +105,7 @@ void vector_normalize(Vector *v) {
 
   // Calculate magnitude
 #ifdef __AVX__
-  if (v1->dimension >= 8) {
+  if (v->dimension >= 8) {
     __m256 sum256 = _mm256_setzero_ps();
     for (; i <= v->dimension - 8; i += 8) {
       __m256 a = _mm256_loadu_ps(v->data + i);
@@ -0,0 +1,195 @@
+#include "../include/zpack.h"
+#include <stdlib.h>
+#include <string.h>
+
+ZPack *zpack_new(void) {
+  ZPack *zp;
+
+  if ((zp = (ZPack *)malloc(sizeof(ZPack))) == NULL)
+    return NULL;
+
+  zp->count = 0;
+  zp->bytes = 0;
+  return zp;
+}
+
+// Same order as bytes_compare
+static int zpack_member_compare(const char *a, uint32_t a_len, const char *b,
+                                uint32_t b_len) {
+  uint32_t min_len = a_len < b_len ? a_len : b_len;
+  int cmp = memcmp(a, b, min_len);
+
+  if (cmp == 0)
+    return a_len < b_len ? -1 : a_len > b_len;
+  return cmp;
+}
+
+// Orders an entry against a (score, member) pair
+static int zpack_entry_compare(ZPack *zp, ZPackEntry *e, double score,
+                               const char *member, uint32_t len) {
+  if (e->score < score)
+    return -1;
+  if (e->score > score)
+    return 1;
+
+  return zpack_member_compare(zpack_members(zp) + e->offset, e->length, member,
+                              len);
+}
+
+long zpack_find(ZPack *zp, const char *member, uint32_t len) {
+  char *members = zpack_members(zp);
+
+  for (uint32_t i = 0; i < zp->count; i++) {
+    ZPackEntry *e = &zp->entries[i];
+
+    if (e->length == len && memcmp(members + e->offset, member, len) == 0)
+      return i;
+  }
+
+  return -1;
+}
+
+// The member points into the zpack and is only valid until it changes
+void zpack_get(ZPack *zp, uint32_t index, Bytes *member, double *score) {
+  ZPackEntry *e = &zp->entries[index];
+
+  member->length = e->length;
+  member->flags = 0;
+  member->data = zpack_members(zp) + e->offset;
+  *score = e->score;
+}
+
+uint32_t zpack_score_lower(ZPack *zp, double min, int exclusive) {
+  uint32_t lo = 0, hi = zp->count;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    double score = zp->entries[mid].score;
+
+    if (exclusive ? score <= min : score < min)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+uint32_t zpack_lex_lower(ZPack *zp, Bytes *min, int exclusive) {
+  char *members = zpack_members(zp);
+  uint32_t lo = 0, hi = zp->count;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    ZPackEntry *e = &zp->entries[mid];
+    int cmp = zpack_member_compare(members + e->offset, e->length, min->data,
+                                   min->length);
+
+    if (exclusive ? cmp <= 0 : cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+// The member must not be in the zpack yet
+ZPack *zpack_insert(ZPack *zp, double score, const char *member,
+                    uint32_t len) {
+  uint32_t lo = 0, hi = zp->count;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if (zpack_entry_compare(zp, &zp->entries[mid], score, member, len) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  uint32_t pos = lo;
+  uint32_t offset = pos < zp->count ? zp->entries[pos].offset : zp->bytes;
+
+  ZPack *grown;
+  if ((grown = realloc(zp, zpack_blob_len(zp) + sizeof(ZPackEntry) + len)) ==
+      NULL)
+    return NULL;
+  zp = grown;
+
+  // Members after the new one move by the new entry and the new member,
+  // the ones before it by the new entry only
+  char *members = zpack_members(zp);
+  char *moved = members + sizeof(ZPackEntry);
+
+  memmove(moved + offset + len, members + offset, zp->bytes - offset);
+  memmove(moved, members, offset);
+  memcpy(moved + offset, member, len);
+
+  memmove(&zp->entries[pos + 1], &zp->entries[pos],
+          (zp->count - pos) * sizeof(ZPackEntry));
+  zp->entries[pos].score = score;
+  zp->entries[pos].offset = offset;
+  zp->entries[pos].length = len;
+
+  zp->count++;
+  zp->bytes += len;
+
+  for (uint32_t i = pos + 1; i < zp->count; i++)
+    zp->entries[i].offset += len;
+
+  return zp;
+}
+
+// Never fails, a zpack that can't shrink keeps its allocation
+ZPack *zpack_delete(ZPack *zp, uint32_t index) {
+  uint32_t offset = zp->entries[index].offset;
+  uint32_t len = zp->entries[index].length;
+  char *members = zpack_members(zp);
+
+  memmove(&zp->entries[index], &zp->entries[index + 1],
+          (zp->count - index - 1) * sizeof(ZPackEntry));
+
+  // The last entry slot is free now, members slide down over it
+  char *moved = members - sizeof(ZPackEntry);
+  memmove(moved, members, offset);
+  memmove(moved + offset, members + offset + len, zp->bytes - offset - len);
+
+  zp->count--;
+  zp->bytes -= len;
+
+  for (uint32_t i = index; i < zp->count; i++)
+    zp->entries[i].offset -= len;
+
+  ZPack *shrunk;
+  if ((shrunk = realloc(zp, zpack_blob_len(zp))) != NULL)
+    zp = shrunk;
+
+  return zp;
+}
+
+// Checks a zpack read from disk: the size adds up, members are back to
+// back and entries are strictly ordered
+int zpack_valid(ZPack *zp, size_t len) {
+  if (len < sizeof(ZPack) || len != zpack_blob_len(zp))
+    return 0;
+
+  char *members = zpack_members(zp);
+  uint64_t offset = 0;
+
+  for (uint32_t i = 0; i < zp->count; i++) {
+    ZPackEntry *e = &zp->entries[i];
+
+    if (e->score != e->score || e->offset != offset ||
+        offset + e->length > zp->bytes)
+      return 0;
+
+    if (i > 0 && zpack_entry_compare(zp, &zp->entries[i - 1], e->score,
+                                     members + e->offset, e->length) >= 0)
+      return 0;
+
+    offset += e->length;
+  }
+
+  return offset == zp->bytes;
+}
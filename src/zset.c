@@ -7,6 +7,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+int zset_max_zpack_entries = ZSET_MAX_ZPACK_ENTRIES;
+int zset_max_zpack_value = ZSET_MAX_ZPACK_VALUE;
+
 ZSkipListNode *zsl_create_node(int level, double score, Bytes *element) {
   ZSkipListNode *node;
   if ((node = (ZSkipListNode *)malloc(sizeof(ZSkipListNode) +
@@ -196,17 +199,22 @@ int zset_add(ZSet *zs, Bytes *element, double score) {
     if (zsl_remove(zs->zsl, current_score, element) == 0)
       return 0;
 
-    zsl_insert(zs->zsl, score, element);
+    // The skiplist keeps the element, element itself may be a transient
+    // command argument
+    zsl_insert(zs->zsl, score, bytes_dup(element));
     hash_table_set(zs->dict, element, create_double_object(score));
 
     return 1;
   }
 
-  Bytes *element_copy = bytes_dup(element);
-
-  zsl_insert(zs->zsl, score, element_copy);
+  // The dict copies the element, the skiplist gets its own copy
+  r_obj *new_score = create_double_object(score);
+  if (hash_table_set(zs->dict, element, new_score) != 0) {
+    free_object(new_score);
+    return -1;
+  }
 
-  hash_table_set(zs->dict, element_copy, create_double_object(score));
+  zsl_insert(zs->zsl, score, bytes_dup(element));
 
   return 1;
 }
@@ -217,15 +225,20 @@ r_obj *create_zset_object() {
     return NULL;
 
   o->type = ZSET;
+  o->refcount = 1;
+  o->encoding = OBJ_ENCODING_RAW;
   o->data = zset_create();
   return o;
 }
 
-ZSkipListNode *zsl_get_element_by_rank(ZSkipList *zsl, int rank) {
-  ZSkipListNode *x = zsl->head->level[0].forward;
+// Node at the 0 based rank, NULL if out of range. Spans count from the
+// head, where the first node is 1 away.
+ZSkipListNode *zsl_get_element_by_rank(ZSkipList *zsl, unsigned long rank) {
+  ZSkipListNode *x = zsl->head;
   unsigned long traversed = 0;
   int i = 0;
 
+  rank++;
   for (i = zsl->level - 1; i >= 0; i--) {
     while (x->level[i].forward && (traversed + x->level[i].span) <= rank) {
       traversed += x->level[i].span;
@@ -237,7 +250,7 @@ ZSkipListNode *zsl_get_element_by_rank(ZSkipList *zsl, int rank) {
     }
   }
 
-  return x;
+  return NULL;
 }
 
 ZSkipListNode *zsl_first_in_range(ZSkipList *zsl, double min) {
@@ -325,14 +338,15 @@ unsigned long zsl_get_rank(ZSkipList *zsl, double score, Bytes *element) {
     while (x->level[i].forward &&
            (x->level[i].forward->score < score ||
             (x->level[i].forward->score == score &&
-             bytes_equal(x->level[i].forward->element, element) <= 0))) {
+             bytes_compare(x->level[i].forward->element, element) <= 0))) {
 
       rank += x->level[i].span;
       x = x->level[i].forward;
-
-      if (x->score == score && bytes_equal(x->element, element) == 0)
-        return rank;
     }
+
+    if (x != zsl->head && x->score == score &&
+        bytes_equal(x->element, element))
+      return rank;
   }
 
   return 0;
@@ -342,22 +356,270 @@ ZSkipListNode *zsl_next_node(ZSkipListNode *node, int reverse) {
   return reverse ? node->backward : node->level[0].forward;
 }
 
-void zrange_emit_node(OutputBuffer *ob, ZSkipListNode *node, int with_scores) {
+void zrange_emit(OutputBuffer *ob, Bytes *member, double score,
+                 int with_scores) {
   char buf[128];
   int len;
 
-  uint32_t val_len = node->element->length;
+  uint32_t val_len = member->length;
   len = snprintf(buf, sizeof(buf), "$%" PRIu32 "\r\n", val_len);
   append_to_output_buffer(ob, buf, len);
-  append_to_output_buffer(ob, node->element->data, val_len);
+  append_to_output_buffer(ob, member->data, val_len);
   append_to_output_buffer(ob, "\r\n", 2);
 
   if (with_scores) {
     len = snprintf(buf, sizeof(buf), "$%d\r\n",
-                   (int)snprintf(NULL, 0, "%.17g", node->score));
+                   (int)snprintf(NULL, 0, "%.17g", score));
     append_to_output_buffer(ob, buf, len);
 
-    len = snprintf(buf, sizeof(buf), "%.17g\r\n", node->score);
+    len = snprintf(buf, sizeof(buf), "%.17g\r\n", score);
     append_to_output_buffer(ob, buf, len);
   }
 }
+
+r_obj *create_zset_zpack_object(void) {
+  r_obj *o;
+
+  if ((o = (r_obj *)malloc(sizeof(r_obj))) == NULL)
+    return NULL;
+
+  o->type = ZSET;
+  o->refcount = 1;
+  o->encoding = OBJ_ENCODING_ZPACK;
+
+  o->data = zpack_new();
+
+  if (o->data == NULL) {
+    free(o);
+    return NULL;
+  }
+
+  return o;
+}
+
+// Moves the members of a ZPack sorted set into a dict and skiplist
+static int zset_object_convert(r_obj *o) {
+  ZPack *zp = (ZPack *)o->data;
+  ZSet *zs;
+
+  if ((zs = zset_create()) == NULL)
+    return -1;
+
+  for (uint32_t i = 0; i < zpack_count(zp); i++) {
+    Bytes member;
+    double score;
+
+    zpack_get(zp, i, &member, &score);
+    if (zset_add(zs, &member, score) < 0) {
+      zset_destroy(zs);
+      return -1;
+    }
+  }
+
+  free(zp);
+  o->data = zs;
+  o->encoding = OBJ_ENCODING_RAW;
+  return 0;
+}
+
+// Converts a ZPack sorted set that no longer fits the limits, e.g. one
+// loaded from disk that was written with larger ones
+void zset_object_check_limits(r_obj *o) {
+  if (o->encoding != OBJ_ENCODING_ZPACK)
+    return;
+
+  ZPack *zp = (ZPack *)o->data;
+  if (zpack_count(zp) > (uint32_t)zset_max_zpack_entries) {
+    zset_object_convert(o);
+    return;
+  }
+
+  for (uint32_t i = 0; i < zpack_count(zp); i++) {
+    if (zp->entries[i].length > (uint32_t)zset_max_zpack_value) {
+      zset_object_convert(o);
+      return;
+    }
+  }
+}
+
+int zset_object_score(r_obj *o, Bytes *member, double *score) {
+  if (o->encoding == OBJ_ENCODING_ZPACK) {
+    ZPack *zp = (ZPack *)o->data;
+    long index = zpack_find(zp, member->data, member->length);
+
+    if (index < 0)
+      return 0;
+
+    *score = zp->entries[index].score;
+    return 1;
+  }
+
+  r_obj *score_o = hash_table_get(((ZSet *)o->data)->dict, member);
+  if (score_o == NULL)
+    return 0;
+
+  *score = *(double *)score_o->data;
+  return 1;
+}
+
+// Adds the member or moves it to the new score, the member is copied
+void zset_object_add(r_obj *o, Bytes *member, double score) {
+  if (o->encoding == OBJ_ENCODING_ZPACK &&
+      member->length > (uint32_t)zset_max_zpack_value) {
+    if (zset_object_convert(o) < 0)
+      return;
+  }
+
+  if (o->encoding == OBJ_ENCODING_ZPACK) {
+    ZPack *zp = (ZPack *)o->data;
+    ZPack *updated;
+    long index = zpack_find(zp, member->data, member->length);
+
+    if (index >= 0) {
+      if (zp->entries[index].score == score)
+        return;
+      o->data = zp = zpack_delete(zp, (uint32_t)index);
+    }
+
+    if ((updated = zpack_insert(zp, score, member->data, member->length)) ==
+        NULL)
+      return;
+    o->data = updated;
+
+    if (zpack_count(updated) > (uint32_t)zset_max_zpack_entries)
+      zset_object_convert(o);
+    return;
+  }
+
+  zset_add((ZSet *)o->data, member, score);
+}
+
+int zset_object_rem(r_obj *o, Bytes *member) {
+  if (o->encoding == OBJ_ENCODING_ZPACK) {
+    ZPack *zp = (ZPack *)o->data;
+    long index = zpack_find(zp, member->data, member->length);
+
+    if (index < 0)
+      return 0;
+
+    o->data = zpack_delete(zp, (uint32_t)index);
+    return 1;
+  }
+
+  ZSet *zs = (ZSet *)o->data;
+  r_obj *score_o = hash_table_get(zs->dict, member);
+
+  if (score_o == NULL)
+    return 0;
+
+  double score = *(double *)score_o->data;
+
+  return zsl_remove(zs->zsl, score, member) == 1 &&
+         hash_table_del(zs->dict, member) == 1;
+}
+
+size_t zset_object_size(r_obj *o) {
+  if (o->encoding == OBJ_ENCODING_ZPACK)
+    return zpack_count((ZPack *)o->data);
+
+  return ((ZSet *)o->data)->dict->count;
+}
+
+// 0 based rank by ascending score, -1 if the member isn't there
+long zset_object_rank(r_obj *o, Bytes *member) {
+  if (o->encoding == OBJ_ENCODING_ZPACK)
+    return zpack_find((ZPack *)o->data, member->data, member->length);
+
+  ZSet *zs = (ZSet *)o->data;
+  r_obj *score_o = hash_table_get(zs->dict, member);
+
+  if (score_o == NULL)
+    return -1;
+
+  unsigned long rank =
+      zsl_get_rank(zs->zsl, *(double *)score_o->data, member);
+  return rank > 0 ? (long)rank - 1 : -1;
+}
+
+static void zset_iterator_init(r_obj *o, int reverse, ZSetIterator *it) {
+  it->o = o;
+  it->node = NULL;
+  it->index = -1;
+  it->reverse = reverse;
+}
+
+// Starts at the 0 based rank
+void zset_iterator_rank(r_obj *o, long rank, int reverse, ZSetIterator *it) {
+  zset_iterator_init(o, reverse, it);
+
+  if (rank < 0)
+    return;
+
+  if (o->encoding == OBJ_ENCODING_ZPACK)
+    it->index = rank;
+  else
+    it->node = zsl_get_element_by_rank(((ZSet *)o->data)->zsl, rank);
+}
+
+// Starts at the first score >= bound, or the last one <= bound in reverse
+void zset_iterator_score(r_obj *o, double bound, int reverse,
+                         ZSetIterator *it) {
+  zset_iterator_init(o, reverse, it);
+
+  if (o->encoding == OBJ_ENCODING_ZPACK) {
+    ZPack *zp = (ZPack *)o->data;
+
+    if (reverse)
+      it->index = (long)zpack_score_lower(zp, bound, 1) - 1;
+    else
+      it->index = zpack_score_lower(zp, bound, 0);
+    return;
+  }
+
+  ZSkipList *zsl = ((ZSet *)o->data)->zsl;
+  it->node = reverse ? zsl_last_in_range(zsl, bound)
+                     : zsl_first_in_range(zsl, bound);
+}
+
+// Starts at the first member >= bound (> if not inclusive), or the last
+// one <= bound (<) in reverse
+void zset_iterator_lex(r_obj *o, Bytes *bound, int inclusive, int reverse,
+                       ZSetIterator *it) {
+  zset_iterator_init(o, reverse, it);
+
+  if (o->encoding == OBJ_ENCODING_ZPACK) {
+    ZPack *zp = (ZPack *)o->data;
+
+    if (reverse)
+      it->index = (long)zpack_lex_lower(zp, bound, inclusive) - 1;
+    else
+      it->index = zpack_lex_lower(zp, bound, !inclusive);
+    return;
+  }
+
+  ZSkipList *zsl = ((ZSet *)o->data)->zsl;
+  it->node = reverse ? zsl_last_in_lex_range(zsl, bound, inclusive)
+                     : zsl_first_in_lex_range(zsl, bound, inclusive);
+}
+
+// The member points into the set, which must not change while iterating
+int zset_next(ZSetIterator *it, Bytes *member, double *score) {
+  if (it->o->encoding == OBJ_ENCODING_ZPACK) {
+    ZPack *zp = (ZPack *)it->o->data;
+
+    if (it->index < 0 || it->index >= (long)zpack_count(zp))
+      return 0;
+
+    zpack_get(zp, (uint32_t)it->index, member, score);
+    it->index += it->reverse ? -1 : 1;
+    return 1;
+  }
+
+  if (it->node == NULL)
+    return 0;
+
+  *member = *it->node->element;
+  *score = it->node->score;
+  it->node = zsl_next_node(it->node, it->reverse);
+  return 1;
+}
@@ -0,0 +1,58 @@
+// Percentiles of LatencyHistogram: they never decrease with the percentile
+// and land in the bucket holding the call at their rank.
+//
+// Links src/latency.c only.
+#include "../include/latency.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures = 0;
+
+static void check(int ok, const char *what, uint64_t calls) {
+  if (!ok) {
+    fprintf(stderr, "FAIL: %s with %llu calls\n", what,
+            (unsigned long long)calls);
+    failures++;
+  }
+}
+
+int main(void) {
+  static const double percentiles[] = {0, 50, 90, 99, 99.9, 100};
+  size_t n = sizeof(percentiles) / sizeof(percentiles[0]);
+  LatencyHistogram h;
+
+  // 90% fast calls and 10% slow ones, for every count up to 3000, so most
+  // percentiles fall between two whole ranks
+  for (uint64_t calls = 1; calls <= 3000; calls++) {
+    memset(&h, 0, sizeof(h));
+
+    uint64_t slow = calls / 10;
+    for (uint64_t i = 0; i < calls; i++)
+      latency_record(&h, i < calls - slow ? 100 : 1000000);
+
+    double prev = 0;
+    for (size_t i = 0; i < n; i++) {
+      double p = latency_percentile(&h, percentiles[i]);
+
+      check(p >= prev, "percentiles decrease", calls);
+      prev = p;
+    }
+
+    double fast_usec = latency_bucket_usec(latency_bucket(100));
+    double slow_usec = latency_bucket_usec(latency_bucket(1000000));
+
+    check(latency_percentile(&h, 50) == fast_usec, "p50 is not fast", calls);
+    if (slow > 0) {
+      check(latency_percentile(&h, 99) == slow_usec, "p99 is not slow", calls);
+      check(latency_percentile(&h, 99.9) == slow_usec, "p999 is not slow",
+            calls);
+    }
+  }
+
+  if (failures > 0)
+    return EXIT_FAILURE;
+
+  printf("PASS\n");
+  return EXIT_SUCCESS;
+}
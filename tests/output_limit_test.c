@@ -0,0 +1,204 @@
+// Clients that don't read a large reply get dropped at the hard output
+// limit. The memory their replies held must come back, the server stays near
+// its earlier size over many rounds of dropped clients. Freed memory the
+// allocator keeps is bounded by what one round uses, a leak grows with every
+// round.
+//
+// Usage: output_limit_test <path to server>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PORT 6379
+#define LIST_LEN 8000
+#define VALUE_LEN 1000
+#define CLIENTS 5
+#define ROUNDS 20
+// Allowed growth, a leak adds about 25 MB a round
+#define SLACK_KB (64 * 1024)
+
+static pid_t server_pid;
+
+static void sleep_ms(long ms) {
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+}
+
+static void fail(const char *what) {
+  fprintf(stderr, "FAIL: %s\n", what);
+  kill(server_pid, SIGKILL);
+  waitpid(server_pid, NULL, 0);
+  exit(EXIT_FAILURE);
+}
+
+static long server_rss_kb(void) {
+  char path[64], line[256];
+  long rss = -1;
+
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)server_pid);
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL)
+    fail("server is gone");
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (strncmp(line, "VmRSS:", 6) == 0)
+      rss = strtol(line + 6, NULL, 10);
+  }
+  fclose(fp);
+  return rss;
+}
+
+// rcvbuf > 0 keeps the kernel from taking much of the reply off the server
+static int connect_server(int rcvbuf) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1)
+    fail("socket");
+
+  if (rcvbuf > 0)
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void send_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n <= 0)
+      fail("write");
+    buf += n;
+    len -= n;
+  }
+}
+
+// Reads until the server closes the connection, returns the bytes read
+static size_t read_until_closed(int fd) {
+  char buf[65536];
+  size_t total = 0;
+  ssize_t n;
+
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    total += n;
+  return total;
+}
+
+static void fill_list(void) {
+  int fd = connect_server(0);
+  char value[VALUE_LEN];
+  char header[64];
+
+  memset(value, 'v', sizeof(value));
+
+  for (int i = 0; i < LIST_LEN; i++) {
+    int len = snprintf(header, sizeof(header),
+                       "*3\r\n$5\r\nLPUSH\r\n$4\r\nlist\r\n$%d\r\n", VALUE_LEN);
+    send_all(fd, header, len);
+    send_all(fd, value, VALUE_LEN);
+    send_all(fd, "\r\n", 2);
+  }
+
+  // One integer reply per push
+  char buf[4096];
+  int replies = 0;
+  while (replies < LIST_LEN) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0)
+      fail("LPUSH replies");
+    for (ssize_t i = 0; i < n; i++)
+      replies += buf[i] == '\n';
+  }
+  close(fd);
+}
+
+static void drop_round(void) {
+  static const char lrange[] =
+      "*4\r\n$6\r\nLRANGE\r\n$4\r\nlist\r\n$1\r\n0\r\n$2\r\n-1\r\n";
+  int fds[CLIENTS];
+
+  for (int i = 0; i < CLIENTS; i++) {
+    if ((fds[i] = connect_server(4096)) == -1)
+      fail("connect");
+    send_all(fds[i], lrange, sizeof(lrange) - 1);
+  }
+
+  // Nothing is read until the server had its chance to drop them
+  sleep_ms(150);
+
+  for (int i = 0; i < CLIENTS; i++) {
+    if (read_until_closed(fds[i]) >= (size_t)LIST_LEN * VALUE_LEN)
+      fail("a client got its whole reply instead of being dropped");
+    close(fds[i]);
+  }
+
+  sleep_ms(50);
+}
+
+int main(int argc, char **argv) {
+  char server[PATH_MAX];
+  char dir[] = "/tmp/output_limit_testXXXXXX";
+
+  if (argc != 2 || realpath(argv[1], server) == NULL) {
+    fprintf(stderr, "Usage: %s <path to server>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+
+  if ((server_pid = fork()) == 0) {
+    // No dump.rdb to load, and the server's chatter stays out of the way
+    if (chdir(dir) == -1 || freopen("/dev/null", "w", stdout) == NULL)
+      _exit(EXIT_FAILURE);
+    execl(server, server, "--client-output-buffer-limit", "normal", "1mb",
+          "0", "0", (char *)NULL);
+    _exit(EXIT_FAILURE);
+  }
+
+  int fd = -1;
+  for (int i = 0; i < 100 && fd == -1; i++) {
+    sleep_ms(50);
+    fd = connect_server(0);
+  }
+  if (fd == -1)
+    fail("server did not start");
+  close(fd);
+
+  fill_list();
+
+  long before = server_rss_kb();
+  for (int i = 0; i < ROUNDS; i++)
+    drop_round();
+  long after = server_rss_kb();
+
+  printf("RSS %ld kB before, %ld kB after %d rounds of %d dropped clients\n",
+         before, after, ROUNDS, CLIENTS);
+
+  if (after > before + SLACK_KB)
+    fail("dropped clients still hold memory");
+
+  kill(server_pid, SIGKILL);
+  waitpid(server_pid, NULL, 0);
+  rmdir(dir);
+  printf("PASS\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,162 @@
+// Timers of every level, including deadlines parked beyond the last one,
+// fire no earlier than their deadline and no later than the run that passes
+// it. The wheel's timeout never sleeps past the earliest pending deadline.
+//
+// Links src/timer.c only.
+#include "../include/timer.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ENTRIES 512
+#define ROUNDS 200000
+
+typedef struct Entry_ {
+  Timer timer;
+  long long fired;
+} Entry;
+
+static TimerWheel wheel;
+static Entry entries[ENTRIES];
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+// The `now` of the timer_wheel_run in progress
+static long long run_to;
+static int failures = 0;
+
+static void check(int ok, const char *what, long long expires) {
+  if (!ok && failures++ < 10)
+    fprintf(stderr, "FAIL: %s, deadline %lld, wheel at %lld\n", what, expires,
+            wheel.now);
+}
+
+static uint64_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+// Deadlines for every level of the wheel, and past its end
+static long long random_delta(void) {
+  static const long long limits[] = {64, 64 * 64, 64 * 64 * 64, 1LL << 24,
+                                     1LL << 26};
+  int level = rng() % 5;
+  long long low = level == 0 ? 0 : limits[level - 1];
+
+  return low + (long long)(rng() % (uint64_t)(limits[level] - low));
+}
+
+static void on_fire(void *data) {
+  Entry *e = data;
+  // The tick being run, the wheel already points past it
+  long long tick = wheel.now - 1;
+
+  check(tick >= e->timer.expires, "timer fired early", e->timer.expires);
+  check(tick <= run_to, "timer fired past the run", e->timer.expires);
+  e->fired++;
+
+  // Callbacks adding timers, the new deadline lands in a later slot
+  if (rng() % 4 == 0)
+    timer_add(&wheel, &e->timer, wheel.now + random_delta());
+}
+
+static void run_to_time(long long now) {
+  run_to = now;
+  timer_wheel_run(&wheel, now);
+
+  long long earliest = -1;
+  for (int i = 0; i < ENTRIES; i++) {
+    Timer *t = &entries[i].timer;
+    if (!timer_pending(t))
+      continue;
+
+    check(t->expires > now, "timer still pending past its deadline",
+          t->expires);
+    if (earliest == -1 || t->expires < earliest)
+      earliest = t->expires;
+  }
+
+  int timeout = timer_wheel_timeout(&wheel, now);
+  if (earliest == -1)
+    return;
+
+  check(timeout >= 0 && now + timeout <= earliest,
+        "timeout sleeps past the earliest deadline", earliest);
+}
+
+// A slot of a higher level that holds next turn timers must not hide the
+// later slots of the current turn
+static void test_next_turn_slot(void) {
+  Entry late, soon;
+  long long slot_ticks = 1LL << (3 * TIMER_WHEEL_BITS);
+
+  timer_wheel_init(&wheel, 0);
+  timer_init(&late.timer, on_fire, &late);
+  timer_init(&soon.timer, on_fire, &soon);
+  late.fired = soon.fired = 0;
+
+  run_to_time(25 * slot_ticks + 1000);
+
+  // Wraps around into the current slot of level 3, then two slots ahead
+  timer_add(&wheel, &late.timer, wheel.now + (1LL << 24) - 100);
+  timer_add(&wheel, &soon.timer, wheel.now + 2 * slot_ticks);
+
+  // One run straight past the later deadline
+  run_to_time(soon.timer.expires);
+
+  check(soon.fired == 1, "later slot of level 3 missed", soon.timer.expires);
+  check(late.fired == 0, "next turn timer fired early", late.timer.expires);
+  timer_del(&wheel, &late.timer);
+  timer_del(&wheel, &soon.timer);
+}
+
+static void test_random(void) {
+  static const long long steps[] = {1, 50, 5000, 300000};
+  long long now = 1000;
+
+  timer_wheel_init(&wheel, now);
+  for (int i = 0; i < ENTRIES; i++) {
+    timer_init(&entries[i].timer, on_fire, &entries[i]);
+    entries[i].fired = 0;
+  }
+
+  for (int round = 0; round < ROUNDS && failures == 0; round++) {
+    Entry *e = &entries[rng() % ENTRIES];
+
+    if (timer_pending(&e->timer) && rng() % 4 == 0)
+      timer_del(&wheel, &e->timer);
+    else
+      timer_add(&wheel, &e->timer, wheel.now + random_delta());
+
+    now += 1 + (long long)(rng() % (uint64_t)steps[rng() % 4]);
+    run_to_time(now);
+  }
+
+  // Everything left, the parked deadlines too, comes due in the end
+  while (failures == 0) {
+    int pending = 0;
+    for (int i = 0; i < ENTRIES; i++)
+      pending += timer_pending(&entries[i].timer);
+    if (pending == 0)
+      break;
+
+    now += 1 + (long long)(rng() % 300000);
+    run_to_time(now);
+  }
+
+  long long fired = 0;
+  for (int i = 0; i < ENTRIES; i++)
+    fired += entries[i].fired;
+  check(fired > ROUNDS / 2, "too few timers fired", fired);
+}
+
+int main(void) {
+  test_next_turn_slot();
+  test_random();
+
+  if (failures > 0)
+    return EXIT_FAILURE;
+
+  printf("PASS\n");
+  return EXIT_SUCCESS;
+}